@@ -0,0 +1,33 @@
+-- Measures deleting a big tree of small files, like node_modules.
+-- Run it from the lib directory: lua ../bench/del.lua [directories] [files each] [threads]
+
+require 'apolo':as_global()
+
+local dirs = tonumber(arg[1]) or 1000
+local files = tonumber(arg[2]) or 50
+local threads = tonumber(arg[3]) or apolo.core.cpu_count()
+
+local function make_tree()
+    chdir.mk('del-bench', function()
+        for i = 1, dirs do
+            chdir.mk('package-' .. i, function()
+                mkdir 'lib'
+                for j = 1, files do
+                    writef('lib/file-' .. j .. '.js', '')
+                end
+            end)
+        end
+    end)
+end
+
+local function measure(name, num_threads)
+    make_tree()
+
+    local start = apolo.core.clock()
+    assert(del('del-bench', num_threads))
+    print(string.format('%-22s %.3f s for %d entries', name .. ':',
+        apolo.core.clock() - start, dirs * (files + 2)))
+end
+
+measure('one thread', 1)
+measure(threads .. ' threads', threads)
@@ -0,0 +1,41 @@
+-- Measures listing a huge directory, reporting the memory used by Lua.
+-- Run it from the lib directory: lua ../bench/dir_iter.lua [entries]
+
+require 'apolo':as_global()
+
+local num_entries = tonumber(arg[1]) or 200000
+
+mkdir 'dir-iter-bench'
+for i = 1, num_entries, 1000 do
+    local names = {}
+    for j = i, math.min(i + 999, num_entries) do
+        names[#names + 1] = 'dir-iter-bench/entry-' .. j
+    end
+    assert(run(table.move(names, 1, #names, 2, {'touch'})))
+end
+
+local function measure(name, fun)
+    collectgarbage()
+    collectgarbage('stop')
+    local before = collectgarbage('count')
+    local start = apolo.core.clock()
+    local count = fun()
+
+    print(string.format('%-12s %.3f s, %d KiB allocated for %d entries',
+        name .. ':', apolo.core.clock() - start,
+        math.floor(collectgarbage('count') - before), count))
+    collectgarbage('restart')
+end
+
+measure('entry_infos', function()
+    local count = 0
+    for _ in pairs(entry_infos('dir-iter-bench')) do count = count + 1 end
+    return count
+end)
+measure('dir_iter', function()
+    local count = 0
+    for _ in dir_iter('dir-iter-bench') do count = count + 1 end
+    return count
+end)
+
+del('dir-iter-bench')
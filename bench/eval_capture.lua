@@ -0,0 +1,24 @@
+-- Measures eval on large outputs, reporting the peak memory of the process.
+-- Run it from the lib directory: lua ../bench/eval_capture.lua [megabytes] [spill_at]
+
+require 'apolo':as_global()
+
+local megabytes = tonumber(arg[1]) or 256
+local spill_at = tonumber(arg[2]) or 0
+
+local function status_kb(field)
+    local status = readf('/proc/self/status') or ''
+    return tonumber(string.match(status, field .. ':%s*(%d+)')) or 0
+end
+
+local before = status_kb('VmHWM')
+local start = os.clock()
+
+local out = assert(eval.spill_at(spill_at){
+    'head', '-c', tostring(megabytes * 1024 * 1024), '/dev/zero'})
+
+print(string.format('captured: %d bytes', #out))
+print(string.format('parent cpu time: %.3f s', os.clock() - start))
+print(string.format(
+    'peak rss: %d KiB before, %d KiB after (output alone is %d KiB)',
+    before, status_kb('VmHWM'), #out // 1024))
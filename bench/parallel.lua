@@ -0,0 +1,40 @@
+-- Measures the speedup of run.parallel over running commands one at a time.
+-- Run it from the lib directory: lua ../bench/parallel.lua [commands]
+
+local apolo = require 'apolo'
+apolo:as_global()
+
+local luacmd = arg[-1]
+local ncommands = tonumber(arg[1]) or 2 * apolo.core.cpu_count()
+
+-- os.clock only measures this process, so get the wall clock from date
+local function wall()
+    if currentos.linux then
+        return tonumber(eval 'date +%s.%N')
+    end
+
+    return os.time()
+end
+
+writef('busy.lua', [[
+    local x = 0
+    for i = 1, 30000000 do x = x + i % 7 end
+]])
+
+local commands = {}
+for i = 1, ncommands do
+    commands[i] = {luacmd, 'busy.lua'}
+end
+
+local base
+for jobs = 1, apolo.core.cpu_count() do
+    local start = wall()
+    assert(run.parallel.jobs(jobs)(commands))
+    local elapsed = wall() - start
+
+    base = base or elapsed
+    print(string.format('jobs: %3d  commands: %d  time: %.2f s  speedup: %.2fx',
+        jobs, ncommands, elapsed, base / elapsed))
+end
+
+os.remove('busy.lua')
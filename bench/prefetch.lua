@@ -0,0 +1,51 @@
+-- Measures how much prefetch saves when a launcher starts a big program with
+-- a cold file cache. Run it from the lib directory, as root so that the
+-- cache can be dropped:
+--   lua ../bench/prefetch.lua <program> [setup seconds] [runs] [files...]
+--
+-- Each run drops the cache, spends the setup time like a launcher setting up
+-- the environment, and then starts the program (which should exit right away,
+-- e.g. with --version). With prefetch, the program and the files (or glob
+-- patterns) given after it are read during the setup.
+
+require 'apolo':as_global()
+
+local program = assert(arg[1], 'Expecting the program to start')
+local setup = tonumber(arg[2]) or 0.5
+local runs = tonumber(arg[3]) or 5
+local files = {which(program) or program, table.unpack(arg, 4)}
+
+local function drop_caches()
+    return run.out_to('/proc/sys/vm/drop_caches'){'sh', '-c', 'sync && echo 3'}
+end
+
+if not drop_caches() then
+    print('WARNING: the file cache could not be dropped (not root?), '
+        .. 'so both cases run with a warm cache')
+end
+
+local function setup_env()
+    local deadline = apolo.core.clock() + setup
+    while apolo.core.clock() < deadline do end
+end
+
+local function measure(name, use_prefetch)
+    local total = 0
+    for _ = 1, runs do
+        drop_caches()
+
+        local start = apolo.core.clock()
+        if use_prefetch then
+            prefetch(files)
+        end
+        setup_env()
+        assert(run.out_to('/dev/null'){program, '--version'})
+        total = total + apolo.core.clock() - start
+    end
+
+    print(string.format('%-20s %.3f s each (%.3f s of setup)', name .. ':',
+        total / runs, setup))
+end
+
+measure('cold start', false)
+measure('prefetched start', true)
@@ -0,0 +1,61 @@
+-- Measures the throughput of moving lots of data through pipes and files.
+-- Run it from the lib directory: lua ../bench/pump.lua [megabytes] [pipe size]
+--
+-- Each line compares a way of moving the data through Lua or the default
+-- pipes with the one that keeps it in the kernel or uses bigger pipes.
+
+require 'apolo':as_global()
+
+local megabytes = tonumber(arg[1]) or 2048
+local pipe_size = tonumber(arg[2]) or 1024 * 1024
+local bytes = megabytes * 1024 * 1024
+
+local src = 'pump-bench-src'
+local dst = 'pump-bench-dst'
+local log = 'pump-bench-log'
+
+local function measure(name, fun)
+    local start_cpu = os.clock()
+    local start_wall = apolo.core.clock()
+    fun()
+    local wall = apolo.core.clock() - start_wall
+
+    print(string.format(
+        '%-28s %8.1f MiB/s  parent cpu: %.3f s',
+        name .. ':', megabytes / wall, os.clock() - start_cpu))
+end
+
+local head = {'head', '-c', tostring(bytes), '/dev/zero'}
+
+measure('pipe, default size', function()
+    assert(run.pipe.out_to(dst)(head, 'cat', 'cat'))
+end)
+measure('pipe, ' .. pipe_size .. ' bytes', function()
+    assert(run.pipe.pipe_size(pipe_size).out_to(dst)(head, 'cat', 'cat'))
+end)
+
+assert(run.out_to(src)(head))
+
+measure('copy, Lua read/write', function()
+    local from = assert(io.open(src, 'rb'))
+    local to = assert(io.open(dst, 'wb'))
+    for block in function() return from:read(65536) end do
+        to:write(block)
+    end
+    from:close()
+    to:close()
+end)
+measure('copy, pump', function()
+    assert(pump(src, dst) == bytes)
+end)
+
+measure('tee, tee command', function()
+    assert(run.pipe.out_to(dst)(head, {'tee', log}))
+end)
+measure('tee, run.tee', function()
+    assert(run.tee(log).out_to(dst)(head))
+end)
+
+del(src)
+del(dst)
+del(log)
@@ -0,0 +1,34 @@
+-- Measures how long it takes to start short commands as the Lua heap grows.
+-- Run it from the lib directory: lua ../bench/spawn.lua [spawns] [steps]
+--
+-- With fork, every spawn copies the page tables of the whole interpreter, so
+-- the time per spawn grows with the heap; with posix_spawn it stays flat.
+
+require 'apolo':as_global()
+
+local spawns = tonumber(arg[1]) or 500
+local steps = tonumber(arg[2]) or 5
+
+local function rss_kb()
+    local status = readf('/proc/self/status') or ''
+    return tonumber(string.match(status, 'VmRSS:%s*(%d+)')) or 0
+end
+
+local ballast = {}
+
+for step = 0, steps - 1 do
+    -- Grow the heap by ~100 MB per step
+    for i = 1, step > 0 and 100 or 0 do
+        ballast[#ballast + 1] = string.rep(string.char(65 + step), 1024 * 1024 - i)
+    end
+
+    local start = os.clock()
+    for _ = 1, spawns do
+        assert(run{'true'})
+    end
+    local elapsed = os.clock() - start
+
+    print(string.format(
+        'rss: %7d KiB  spawns: %d  parent cpu per spawn: %.3f ms',
+        rss_kb(), spawns, elapsed * 1000 / spawns))
+end
@@ -0,0 +1,40 @@
+-- Measures what loading apolo.lua costs when the launcher starts.
+-- Run it from the lib directory: lua ../bench/startup.lua [loads] [spawns]
+--
+-- The launcher used to compile apolo.lua from source on every start; now it
+-- loads stripped bytecode. The first lines compare the two in this process,
+-- the last one starts the launcher itself (if it was built) with an empty
+-- script.
+
+require 'apolo':as_global()
+
+local loads = tonumber(arg[1]) or 1000
+local spawns = tonumber(arg[2]) or 200
+
+local source = assert(readf 'apolo.lua')
+local bytecode = string.dump(assert(load(source, '=apolo')), true)
+
+local function measure(name, times, fun)
+    local start = apolo.core.clock()
+    for _ = 1, times do
+        fun()
+    end
+
+    print(string.format('%-24s %.3f ms each', name .. ':',
+        (apolo.core.clock() - start) * 1000 / times))
+end
+
+measure('compile source', loads, function()
+    assert(load(source, '=apolo', 't'))
+end)
+measure('load bytecode', loads, function()
+    assert(load(bytecode, '=apolo', 'b'))
+end)
+
+if exists '../apolo' then
+    writef('startup-bench.lua', '')
+    measure('launcher start', spawns, function()
+        assert(run{'../apolo', 'startup-bench.lua'})
+    end)
+    del 'startup-bench.lua'
+end
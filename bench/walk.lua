@@ -0,0 +1,33 @@
+-- Measures walking a big tree, against find and a single thread.
+-- Run it from the lib directory: lua ../bench/walk.lua [root] [threads]
+--
+-- Drop the caches between runs (echo 3 > /proc/sys/vm/drop_caches) to see
+-- the difference that keeping many directory reads in flight makes.
+
+require 'apolo':as_global()
+
+local root = arg[1] or '/usr'
+local threads = tonumber(arg[2]) or apolo.core.cpu_count()
+
+local function measure(name, fun)
+    local start = apolo.core.clock()
+    local count = fun()
+    print(string.format('%-16s %.3f s for %d entries', name .. ':',
+        apolo.core.clock() - start, count))
+end
+
+measure('find', function()
+    local count = 0
+    for _ in eval.lines{'find', root, '-mindepth', '1'} do count = count + 1 end
+    return count
+end)
+measure('walk, 1 thread', function()
+    local count = 0
+    for _ in walk(root, {threads = 1}) do count = count + 1 end
+    return count
+end)
+measure('walk, ' .. threads .. ' threads', function()
+    local count = 0
+    for _ in walk(root, {threads = threads}) do count = count + 1 end
+    return count
+end)
@@ -0,0 +1,47 @@
+-- Measures what looking commands up in a long PATH costs on each spawn.
+-- Run it from the lib directory: lua ../bench/which.lua [spawns] [path entries]
+--
+-- Commands are found once and hashed, so spawning a bare name should cost
+-- about the same as spawning its absolute path. Clearing the hash before
+-- every spawn shows what walking PATH each time (like execvp does) costs.
+
+local apolo = require 'apolo'
+apolo:as_global()
+
+local spawns = tonumber(arg[1]) or 1000
+local entries = tonumber(arg[2]) or 100
+
+-- PATH can only be changed for child processes, so run again in one
+if arg[3] ~= 'long-path' then
+    local dirs = {}
+    for i = 1, entries do
+        dirs[i] = apolo.abspath('no-such-dir-' .. i)
+    end
+    table.insert(dirs, E.PATH)
+
+    assert(run.env{PATH = table.concat(dirs, ':')}{
+        arg[-1], arg[0], tostring(spawns), tostring(entries), 'long-path'})
+    return
+end
+
+local true_path = assert(which 'true', "Can't find true in PATH")
+
+local function measure(name, command, before_spawn)
+    local start_cpu = os.clock()
+    local start_wall = apolo.core.clock()
+    for _ = 1, spawns do
+        if before_spawn then before_spawn() end
+        assert(run{command})
+    end
+
+    print(string.format(
+        '%-22s parent cpu per spawn: %.3f ms  wall per spawn: %.3f ms',
+        name .. ':',
+        (os.clock() - start_cpu) * 1000 / spawns,
+        (apolo.core.clock() - start_wall) * 1000 / spawns))
+end
+
+print(string.format('PATH entries before %s: %d', true_path, entries))
+measure('absolute path', true_path)
+measure('hashed name', 'true')
+measure('name, hash cleared', 'true', hash_clear)
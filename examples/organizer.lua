@@ -68,13 +68,14 @@ if exists(selectedDir) then
         mkdir(keys)
     end
 
-    -- move files into their respective folders
+    -- find where each file goes
+    local moves = {}
     function moveFiles(fileGroup, fileTable)
         for _, fileExtension in pairs(fileTable) do
             local matchedFiles = glob('*' ..fileExtension)
 
             for _, matchedFile in pairs(matchedFiles) do
-                move(matchedFile, current() .. '/' .. fileGroup .. '/' .. matchedFile)
+                moves[matchedFile] = current() .. '/' .. fileGroup .. '/' .. matchedFile
             end
         end
     end
@@ -82,6 +83,14 @@ if exists(selectedDir) then
     for key in pairs(extensions) do
         moveFiles(key, extensions[key])
     end
+
+    -- move files into their respective folders, all at once
+    local ok, errors = move.many(moves)
+    if not ok then
+        for file, err in pairs(errors) do
+            print('---> could not move ' .. file .. ': ' .. err)
+        end
+    end
 else
     print('---> directory doesn\'t exist')
 end
@@ -19,6 +19,9 @@
    DEALINGS IN THE SOFTWARE.
 */
 
+#include <lua.h>
+#include <lauxlib.h>
+
 #include <stdio.h>
 
 #define OPEN_FILE(__varname, __filename, __mode) \
@@ -28,27 +31,39 @@
         return 1; \
     }
 
-int main(void)
+/* Writes the bytecode as the contents of a C array, 16 bytes per line */
+static int write_bytes(lua_State *L, const void *p, size_t size, void *ud)
 {
-    OPEN_FILE(apolo_lua, "lib/apolo.lua", "r");
-    OPEN_FILE(apolo_lua_h, "launcher/apolo_lua.h", "w");
+    (void) L;
+    FILE *apolo_lua_h = ud;
+    static size_t count = 0;
 
-    fprintf(apolo_lua_h, "const char* apolo_lua =\n\"");
+    const unsigned char *bytes = p;
+    for (size_t i = 0; i < size; ++i, ++count)
+        fprintf(apolo_lua_h, count % 16 == 0 ? "\n0x%02x," : " 0x%02x,", bytes[i]);
 
-    int c;
-    while ((c = fgetc(apolo_lua)) != EOF) {
-	if ((char) c == '\n') {
-	    fprintf(apolo_lua_h, "\\n\"\n\"");
-	    continue;
-	}
+    return ferror(apolo_lua_h);
+}
 
-	if ((char) c == '"' || (char) c == '\\')
-	    fputc('\\', apolo_lua_h);
-	fputc(c, apolo_lua_h);
+int main(void)
+{
+    // The launcher loads precompiled, stripped bytecode, so apolo.lua isn't
+    // parsed again every time it starts
+    lua_State *L = luaL_newstate();
+    if (luaL_loadfile(L, "lib/apolo.lua") != LUA_OK) {
+        fprintf(stderr, "Failure to compile lib/apolo.lua: %s\n", lua_tostring(L, -1));
+        return 1;
     }
 
-    fprintf(apolo_lua_h, "\";");
+    OPEN_FILE(apolo_lua_h, "launcher/apolo_lua.h", "w");
+
+    fprintf(apolo_lua_h, "static const unsigned char apolo_lua[] = {");
+    if (lua_dump(L, write_bytes, apolo_lua_h, 1) != 0) {
+        fprintf(stderr, "Failure to write launcher/apolo_lua.h\n");
+        return 1;
+    }
+    fprintf(apolo_lua_h, "\n};\n");
 
     fclose(apolo_lua_h);
-    fclose(apolo_lua);
+    lua_close(L);
 }
@@ -23,36 +23,470 @@
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef APOLO_OS_WIN
+    #include <windows.h>
+#else
+    #include <sys/stat.h>
+#endif
+
 #include "apolo_lua.h"
 #include "../lib/apolocore.h"
 
-#define try_load(__what, __name) \
-    { \
-        int err = luaL_do##__what(L, __name); \
-        if (err != LUA_OK) { \
-            const char* error_msg = lua_tostring(L, -1); \
-            fprintf(stderr, "Failed to load %s: %s\n", __name, error_msg); \
-	    exit(1); \
-        } \
+/* Scripts are compiled once and kept in the cache as bytecode, which is used
+   again for as long as the script and the Lua version stay the same. Setting
+   APOLO_NO_CACHE turns it off */
+#define CACHE_MAGIC "apolo bytecode cache"
+
+#ifdef APOLO_OS_WIN
+    #define PATH_SEP "\\"
+#else
+    #define PATH_SEP "/"
+#endif
+
+/* FNV-1a, to name the cache file after the script's path */
+static unsigned long long hash_path(const char *path)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (; *path; ++path)
+        hash = (hash ^ (unsigned char) *path) * 1099511628211ULL;
+
+    return hash;
+}
+
+/* Fills cache_path with where the bytecode of script goes and header with
+   what has to come before it there for it to be used. Returns 0 if there's
+   no cache */
+static int cache_entry(const char *script, char *cache_path, char *header, size_t size)
+{
+    if (getenv("APOLO_NO_CACHE"))
+        return 0;
+
+    char dir[512];
+#ifdef APOLO_OS_WIN
+    const char *base = getenv("LOCALAPPDATA");
+    if (!base)
+        return 0;
+    snprintf(dir, sizeof(dir), "%s\\apolo", base);
+#else
+    const char *base = getenv("XDG_CACHE_HOME");
+    if (base && *base) {
+        snprintf(dir, sizeof(dir), "%s/apolo", base);
+    } else {
+        base = getenv("HOME");
+        if (!base)
+            return 0;
+
+        snprintf(dir, sizeof(dir), "%s/.cache", base);
+        native_mkdir(dir);
+        snprintf(dir, sizeof(dir), "%s/.cache/apolo", base);
     }
+#endif
+    native_mkdir(dir);
+
+    struct native_stat st;
+    if (native_stat(script, NATIVE_STAT_SIZE | NATIVE_STAT_MTIME, 1, &st) <= 0)
+        return 0;
+
+    // Relative paths mean different scripts from different directories
+    // Without knowing which script it is, there's no cache for it
+    char abs_path[1024];
+    int abs_len;
+    int is_abs = script[0] == '/' || script[0] == '\\' || (script[0] && script[1] == ':');
+    if (is_abs) {
+        abs_len = snprintf(abs_path, sizeof(abs_path), "%s", script);
+    } else {
+        char cwd[512];
+        if (!native_curdir(cwd))
+            return 0;
+        abs_len = snprintf(abs_path, sizeof(abs_path), "%s" PATH_SEP "%s", cwd, script);
+    }
+    if (abs_len < 0 || (size_t) abs_len >= sizeof(abs_path))
+        return 0;
+
+    snprintf(cache_path, size, "%s" PATH_SEP "%016llx.luac", dir, hash_path(abs_path));
+    int len = snprintf(header, size, "%s\n%s\n%s\n%lld %.6f\n", CACHE_MAGIC, LUA_RELEASE,
+        abs_path, st.size, st.mtime);
+
+    return len > 0 && (size_t) len < size;
+}
+
+static int write_cache(lua_State *L, const void *p, size_t size, void *ud)
+{
+    (void) L;
+
+    return !native_out_write(ud, p, size);
+}
+
+/* Like luaL_loadfile, but through the cache */
+static int load_script(lua_State *L, const char *script)
+{
+    char cache_path[2048];
+    char header[2048];
+    if (!cache_entry(script, cache_path, header, sizeof(cache_path)))
+        return luaL_loadfile(L, script);
+
+    char chunkname[1024];
+    snprintf(chunkname, sizeof(chunkname), "@%s", script);
+    size_t header_len = strlen(header);
+    int top = lua_gettop(L);
+
+    size_t len;
+    const char *data = native_map_file(cache_path, &len);
+    if (data) {
+        int is_current = len > header_len && memcmp(data, header, header_len) == 0;
+        int is_hit = is_current &&
+            luaL_loadbufferx(L, data + header_len, len - header_len, chunkname, "b") == LUA_OK;
+        native_unmap_file(data, len);
+
+        if (is_hit)
+            return LUA_OK;
+    }
+
+    // Either stale or unreadable (like when written by another version of Lua)
+    lua_settop(L, top);
+
+    int err = luaL_loadfile(L, script);
+    if (err != LUA_OK)
+        return err;
+
+    // Written to a temporary file and renamed into place, so launches running
+    // at the same time never see half of it
+    struct native_out_file *f = native_out_open(cache_path, 0, 1);
+    if (f) {
+        int ok = native_out_write(f, header, header_len) &&
+            lua_dump(L, write_cache, f, 0) == 0;
+        native_out_close(f, ok);
+    }
+
+    return LUA_OK;
+}
 
 static int luaopen_apolo(lua_State *L)
 {
-    try_load(string, apolo_lua);
+    // Only bytecode is accepted, since that's what gen_apolo_lua embeds
+    int err = luaL_loadbufferx(L, (const char *) apolo_lua, sizeof(apolo_lua), "=apolo", "b");
+    if (err == LUA_OK)
+        err = lua_pcall(L, 0, 1, 0);
+
+    if (err != LUA_OK) {
+        fprintf(stderr, "Failed to load apolo: %s\n", lua_tostring(L, -1));
+        exit(1);
+    }
 
     return 1;
 }
 
-static void create_arg_table(lua_State *L, int argc, char *argv[])
+/* A bundle is the launcher followed by an archive with the script (named "")
+   and the modules it requires, as bytecode. Each of them is stored as the
+   length of the name, the name, the length of the chunk and the chunk; the
+   last 16 bytes of the file are the offset of the archive and BUNDLE_MAGIC.
+   Lengths are 64-bit little endian */
+#define BUNDLE_MAGIC "APOLOBND"
+#define BUNDLE_TRAILER_LEN 16
+
+/* The archive, in the mapped executable, if there is one */
+static const char *bundle_data = NULL;
+static size_t bundle_len = 0;
+
+static const char *self_exe_path(void)
+{
+#ifdef APOLO_OS_WIN
+    static char path[MAX_PATH];
+    if (GetModuleFileName(NULL, path, MAX_PATH) == 0)
+        return NULL;
+
+    return path;
+#else
+    return "/proc/self/exe";
+#endif
+}
+
+static unsigned long long get_u64(const char *p)
+{
+    unsigned long long v = 0;
+    for (int i = 7; i >= 0; --i)
+        v = (v << 8) | (unsigned char) p[i];
+
+    return v;
+}
+
+static void put_u64(char *p, unsigned long long v)
+{
+    for (int i = 0; i < 8; ++i, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+/* Maps the executable (mapped_len bytes) and finds the archive in it. Sets
+   launcher_len to how much of it is the launcher itself; the mapping is
+   kept, since the modules are loaded straight from it */
+static const char *map_bundle(size_t *mapped_len, size_t *launcher_len)
+{
+    const char *path = self_exe_path();
+    const char *data = path ? native_map_file(path, mapped_len) : NULL;
+    if (!data) {
+        *mapped_len = *launcher_len = 0;
+        return NULL;
+    }
+
+    size_t self_len = *launcher_len = *mapped_len;
+    if (self_len < BUNDLE_TRAILER_LEN ||
+            memcmp(data + self_len - 8, BUNDLE_MAGIC, 8) != 0)
+        return data;
+
+    unsigned long long offset = get_u64(data + self_len - BUNDLE_TRAILER_LEN);
+    if (offset > self_len - BUNDLE_TRAILER_LEN)
+        return data;
+
+    bundle_data = data + offset;
+    bundle_len = self_len - BUNDLE_TRAILER_LEN - offset;
+    *launcher_len = offset;
+    return data;
+}
+
+static const char *find_bundled(const char *name, size_t *len)
+{
+    size_t name_len = strlen(name);
+    const char *p = bundle_data;
+    const char *end = bundle_data + bundle_len;
+
+    while (end - p >= 8) {
+        unsigned long long entry_name_len = get_u64(p);
+        p += 8;
+        if (entry_name_len > (size_t) (end - p) || end - p - entry_name_len < 8)
+            break;
+
+        const char *entry_name = p;
+        p += entry_name_len;
+        unsigned long long chunk_len = get_u64(p);
+        p += 8;
+        if (chunk_len > (size_t) (end - p))
+            break;
+
+        if (entry_name_len == name_len && memcmp(entry_name, name, name_len) == 0) {
+            *len = chunk_len;
+            return p;
+        }
+        p += chunk_len;
+    }
+
+    return NULL;
+}
+
+/* Comes right after package.preload, so bundled modules are never looked for
+   in the filesystem */
+static int bundle_searcher(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    size_t len;
+    const char *chunk = find_bundled(name, &len);
+    if (!chunk) {
+        lua_pushfstring(L, "\n\tno module '%s' in the bundle", name);
+        return 1;
+    }
+
+    if (luaL_loadbufferx(L, chunk, len, name, "b") != LUA_OK)
+        return lua_error(L);
+
+    lua_pushliteral(L, ":bundle:");
+    return 2;
+}
+
+static void add_bundle_searcher(lua_State *L)
+{
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchers");
+    for (lua_Integer i = luaL_len(L, -1); i >= 2; --i) {
+        lua_geti(L, -1, i);
+        lua_seti(L, -2, i + 1);
+    }
+
+    lua_pushcfunction(L, bundle_searcher);
+    lua_seti(L, -2, 2);
+    lua_pop(L, 2);
+}
+
+struct dump_buffer
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static int write_dump(lua_State *L, const void *p, size_t size, void *ud)
+{
+    (void) L;
+    struct dump_buffer *buf = ud;
+
+    if (buf->len + size > buf->cap) {
+        size_t cap = (buf->len + size) * 2;
+        char *data = realloc(buf->data, cap);
+        if (!data)
+            return 1;
+
+        buf->data = data;
+        buf->cap = cap;
+    }
+
+    memcpy(buf->data + buf->len, p, size);
+    buf->len += size;
+    return 0;
+}
+
+static int bundle_file(lua_State *L, struct native_out_file *out, int seen,
+    const char *name, const char *path);
+
+/* Bundles the modules in require 'name' and require("name") calls in source.
+   Requires of names built at run time can't be seen */
+static int bundle_requires(lua_State *L, struct native_out_file *out, int seen,
+    const char *source, size_t len)
+{
+    const char *end = source + len;
+    for (const char *p = source; end - p >= 7; ++p) {
+        if (*p != 'r' || memcmp(p, "require", 7) != 0)
+            continue;
+
+        // Part of another name
+        if (p > source && (isalnum((unsigned char) p[-1]) || p[-1] == '_' || p[-1] == '.'))
+            continue;
+
+        const char *q = p + 7;
+        while (q < end && isspace((unsigned char) *q))
+            ++q;
+        if (q < end && *q == '(') {
+            ++q;
+            while (q < end && isspace((unsigned char) *q))
+                ++q;
+        }
+        if (q >= end || (*q != '\'' && *q != '"'))
+            continue;
+
+        char quote = *q++;
+        const char *name_start = q;
+        while (q < end && (isalnum((unsigned char) *q) || *q == '_' || *q == '.' || *q == '-'))
+            ++q;
+        if (q >= end || *q != quote || q == name_start)
+            continue;
+
+        lua_pushlstring(L, name_start, q - name_start);
+        const char *name = lua_tostring(L, -1);
+
+        // Built in (like apolo itself) or already bundled
+        lua_getglobal(L, "package");
+        lua_getfield(L, -1, "loaded");
+        int is_skipped = lua_getfield(L, -1, name) != LUA_TNIL;
+        is_skipped = lua_getfield(L, seen, name) != LUA_TNIL || is_skipped;
+        lua_pop(L, 4);
+        if (is_skipped) {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        // Only Lua modules can be bundled
+        lua_getglobal(L, "package");
+        lua_getfield(L, -1, "searchpath");
+        lua_pushvalue(L, -3);
+        lua_getfield(L, -3, "path");
+        lua_call(L, 2, 1);
+        const char *path = lua_tostring(L, -1);
+        if (!path)
+            fprintf(stderr, "Not bundling %s: no Lua module found\n", name);
+
+        int ok = !path || bundle_file(L, out, seen, name, path);
+        lua_pop(L, 3);
+        if (!ok)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int bundle_file(lua_State *L, struct native_out_file *out, int seen,
+    const char *name, const char *path)
+{
+    lua_pushboolean(L, 1);
+    lua_setfield(L, seen, name);
+
+    if (luaL_loadfile(L, path) != LUA_OK) {
+        fprintf(stderr, "Failed to load %s: %s\n", path, lua_tostring(L, -1));
+        return 0;
+    }
+
+    struct dump_buffer buf = {NULL, 0, 0};
+    char lens[8];
+    size_t name_len = strlen(name);
+    int ok = lua_dump(L, write_dump, &buf, 0) == 0;
+    lua_pop(L, 1);
+
+    put_u64(lens, name_len);
+    ok = ok && native_out_write(out, lens, 8) && native_out_write(out, name, name_len);
+    put_u64(lens, buf.len);
+    ok = ok && native_out_write(out, lens, 8) && native_out_write(out, buf.data, buf.len);
+    free(buf.data);
+
+    if (!ok) {
+        fprintf(stderr, "Failed to bundle %s\n", path);
+        return 0;
+    }
+
+    size_t source_len;
+    const char *source = native_map_file(path, &source_len);
+    if (!source)
+        return 1;
+
+    ok = bundle_requires(L, out, seen, source, source_len);
+    native_unmap_file(source, source_len);
+    return ok;
+}
+
+/* apolo --bundle script -o output */
+static int bundle(lua_State *L, const char *script, const char *output,
+    const char *self_data, size_t self_len)
+{
+    if (!self_data) {
+        fprintf(stderr, "Failed to read the launcher itself\n");
+        return 1;
+    }
+
+    // Written atomically, so a failure never leaves a broken launcher behind
+    struct native_out_file *out = native_out_open(output, 0, 1);
+    if (!out) {
+        fprintf(stderr, "Failed to open %s\n", output);
+        return 1;
+    }
+
+    lua_newtable(L);
+    int seen = lua_gettop(L);
+
+    char trailer[BUNDLE_TRAILER_LEN];
+    put_u64(trailer, self_len);
+    memcpy(trailer + 8, BUNDLE_MAGIC, 8);
+
+    int ok = native_out_write(out, self_data, self_len) &&
+        bundle_file(L, out, seen, "", script) &&
+        native_out_write(out, trailer, BUNDLE_TRAILER_LEN);
+    if (!native_out_close(out, ok) || !ok) {
+        fprintf(stderr, "Failed to write %s\n", output);
+        return 1;
+    }
+
+#ifndef APOLO_OS_WIN
+    chmod(output, 0755);
+#endif
+
+    return 0;
+}
+
+static void create_arg_table(lua_State *L, int argc, char *argv[], int script_index)
 {
     lua_createtable(L, argc, 0);
     for (int i = 0; i < argc; ++i) {
 	lua_pushstring(L, argv[i]);
-	lua_seti(L, -2, i - 1);
+	lua_seti(L, -2, i - script_index);
     }
 
     lua_setglobal(L, "arg");
@@ -60,19 +494,48 @@ static void create_arg_table(lua_State *L, int argc, char *argv[])
 
 int main(int argc, char* argv[])
 {
-    if (argc < 2) {
-	printf("Usage: %s <apolo script>\n", argv[0]);
-	return 1;
-    }
-
     lua_State *L = luaL_newstate();
     luaL_openlibs(L);
     luaL_requiref(L, "apolocore", luaopen_apolocore, 0);
     luaL_requiref(L, "apolo", luaopen_apolo, 0);
 
-    create_arg_table(L, argc, argv);
+    size_t mapped_len, self_len;
+    const char *self_data = map_bundle(&mapped_len, &self_len);
+
+    // Bundles run their own script, and all the arguments are for it
+    size_t main_len;
+    const char *main_chunk = bundle_data ? find_bundled("", &main_len) : NULL;
+    if (main_chunk) {
+        create_arg_table(L, argc, argv, 0);
+        add_bundle_searcher(L);
+
+        if (luaL_loadbufferx(L, main_chunk, main_len, argv[0], "b") != LUA_OK ||
+                lua_pcall(L, 0, 0, 0) != LUA_OK) {
+            fprintf(stderr, "Failed to load %s: %s\n", argv[0], lua_tostring(L, -1));
+            exit(1);
+        }
+
+        return 0;
+    }
+
+    if (argc == 5 && strcmp(argv[1], "--bundle") == 0 && strcmp(argv[3], "-o") == 0)
+        return bundle(L, argv[2], argv[4], self_data, self_len);
 
-    try_load(file, argv[1]);
+    if (self_data)
+        native_unmap_file(self_data, mapped_len);
+
+    if (argc < 2) {
+	printf("Usage: %s <apolo script>\n", argv[0]);
+	printf("       %s --bundle <apolo script> -o <output>\n", argv[0]);
+	return 1;
+    }
+
+    create_arg_table(L, argc, argv, 1);
+
+    if (load_script(L, argv[1]) != LUA_OK || lua_pcall(L, 0, 0, 0) != LUA_OK) {
+        fprintf(stderr, "Failed to load %s: %s\n", argv[1], lua_tostring(L, -1));
+        exit(1);
+    }
 
     return 0;
 }
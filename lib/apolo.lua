@@ -28,16 +28,6 @@ if apolo.core.osname ~= 'win' then
     apolo.core.rmdir = os.remove
 end
 
-if apolo.core.osname == 'linux' then
-    function apolo.core.copy(orig, dest)
-        return apolo.run{'/bin/cp', '-r', '--preserve=all', '--', orig, dest}
-    end
-
-    function apolo.core.move(orig, dest)
-        return apolo.run{'/bin/mv', '--', orig, dest}
-    end
-end
-
 local path_sep
 if apolo.core.osname == 'win' then
     path_sep = '\\'
@@ -45,6 +35,17 @@ else
     path_sep = '/'
 end
 
+-- Results of apolo.stat while the cache is on, from each path to false (if it
+-- doesn't exist) or to {info = fields, fetched = set of field names}
+local stat_cache = nil
+
+-- Called by everything that changes the filesystem (or the current directory)
+local function apolo_stat_invalidate()
+    if stat_cache then
+        stat_cache = {}
+    end
+end
+
 function apolo.abspath(path)
     if path:sub(1, 1) == path_sep then
         return path
@@ -107,6 +108,7 @@ local apolo_chdir_mt = {}
 function apolo_chdir_mt.__call(apolo_dir, dir, fun)
     -- Get old dir
     local old_dir = apolo.core.curdir()
+    apolo_stat_invalidate()
 
     -- Enter dir
     assert(apolo.core.chdir(dir), "Could not enter directory \"" .. dir .. "\"")
@@ -118,25 +120,47 @@ function apolo_chdir_mt.__call(apolo_dir, dir, fun)
 
     fun()
     apolo.core.chdir(old_dir)
+    apolo_stat_invalidate()
 
     return true
 end
 
 setmetatable(apolo.chdir, apolo_chdir_mt)
 
-local function apolo_copymove(orig, dest, coreop)
+function apolo.copy(orig, dest)
     assert(type(dest) == 'string', 'Expecting string as destination')
+    assert(type(orig) == 'string' or type(orig) == 'table',
+        'Expecting string or table as origin')
 
-    if type(orig) == 'string' then
-        local success = coreop(orig, dest)
+    -- Lists are copied in a single native call
+    apolo_stat_invalidate()
+    return apolo.core.copy(orig, dest)
+end
+
+apolo.move = {}
+
+-- Moves each key of the table to its value in a single native call
+function apolo.move.many(moves)
+    assert(type(moves) == 'table', 'Expecting a table of origins and destinations')
+
+    apolo_stat_invalidate()
+    return apolo.core.move_many(moves)
+end
+
+local apolo_move_mt = {}
+
+function apolo_move_mt.__call(_, orig, dest)
+    assert(type(dest) == 'string', 'Expecting string as destination')
+    apolo_stat_invalidate()
 
-        return success
+    if type(orig) == 'string' then
+        return apolo.core.move(orig, dest)
     end
 
     assert(type(orig) == 'table', 'Expecting string or table as origin')
 
     for _, path in ipairs(orig) do
-        if not coreop(path, dest) then
+        if not apolo.core.move(path, dest) then
             return false, 'Failed on file ' .. path
         end
     end
@@ -144,13 +168,7 @@ local function apolo_copymove(orig, dest, coreop)
     return true
 end
 
-function apolo.copy(orig, dest)
-    return apolo_copymove(orig, dest, apolo.core.copy)
-end
-
-function apolo.move(orig, dest)
-    return apolo_copymove(orig, dest, apolo.core.move)
-end
+setmetatable(apolo.move, apolo_move_mt)
 
 apolo.current = apolo.core.curdir
 
@@ -159,31 +177,15 @@ apolo.currentos.linux = apolo.core.osname == 'linux'
 apolo.currentos.win = apolo.core.osname == 'win'
 apolo.currentos.name = apolo.core.osname
 
-function apolo.del(entry)
-    local cur_entry_infos = apolo.entry_infos()[entry]
-    if not cur_entry_infos then
-        return false
+function apolo.del(entry, threads)
+    -- Removed natively, without entering any directory
+    apolo_stat_invalidate()
+    local deleted, err = apolo.core.del(entry, threads or 1)
+    if deleted == nil then
+        error(err, 2)
     end
 
-    if cur_entry_infos.type == 'dir' then
-        -- Enter dir and remove everything in it
-        apolo.chdir(entry, function()
-            for name, e in pairs(apolo.entry_infos()) do
-                if e.type == "dir" then
-                    assert(apolo.del(name))
-                else
-                    assert(os.remove(name))
-                end
-            end
-        end)
-
-        -- Then, finally, try removing the empty directory
-        assert(apolo.core.rmdir(entry))
-    else
-        assert(os.remove(entry))
-    end
-
-    return true
+    return deleted
 end
 
 apolo.E = {}
@@ -195,37 +197,73 @@ end
 
 setmetatable(apolo.E, apolo_E_mt)
 
+function apolo.dir_iter(dir)
+    return assert(apolo.core.dir_iter(dir or '.'))
+end
+
 function apolo.entries(dir)
-    local infos = apolo.entry_infos(dir)
     local res = {}
 
-    -- Get only names
-    for name, _ in pairs(infos) do
-        table.insert(res, name)
+    local iter = apolo.core.dir_iter(dir or '.')
+    if iter then
+        for name in iter do
+            res[#res + 1] = name
+        end
     end
 
     return res
 end
 
-function apolo.entry_infos(dir)
-    local dir = dir and dir or '.'
-    local raw = apolo.core.listdirentries(dir)
+function apolo.entry_infos(dir, fields)
     local res = {}
 
-    -- Exclude . and .. from listing
-    for _, e in ipairs(raw) do
-        if e.name ~= '.' and e.name ~= '..' then
-            local name = e.name
+    local iter = apolo.core.dir_iter(dir or '.')
+    if iter then
+        for name, type in iter do
+            res[name] = {type = type}
+        end
+    end
 
-            e.name = nil
-            res[name] = e
+    -- The other fields come from a single native call for the whole directory
+    if fields and next(res) then
+        local names, paths = {}, {}
+        for name in pairs(res) do
+            names[#names + 1] = name
+            paths[#paths + 1] = apolo.path(dir or '.', name)
+        end
+
+        local infos = assert(apolo.core.stat(paths, fields, false))
+        for i, name in ipairs(names) do
+            for k, v in pairs(infos[paths[i]] or {}) do
+                res[name][k] = v
+            end
         end
     end
 
     return res
 end
 
-apolo.exists = apolo.core.exists
+-- Recursive listing of root, read by many threads at once
+function apolo.walk(root, opts)
+    local opts = opts or {}
+    assert(opts.prune == nil or type(opts.prune) == 'function',
+        'Expecting a function as prune predicate')
+
+    return assert(apolo.core.walk(
+        root or '.', opts.threads or apolo.core.cpu_count(), opts.max_depth or -1,
+        opts.min_depth or 1, opts.follow == true, opts.types or false, opts.prune or false,
+        opts.fields or false))
+end
+
+function apolo.exists(path)
+    if stat_cache then
+        return apolo.stat(path, {'type'}) and true or false
+    end
+
+    return apolo.core.exists(path)
+end
+
+apolo.hash_clear = apolo.core.hash_clear
 
 local function apolo_inspect(value, visited)
     local vtype = type(value)
@@ -282,22 +320,6 @@ end
 apolo.jobs = {}
 
 local apolo_jobs_mt = {}
-
---Job call function that prints all still existing processes created by .bg
-function apolo_jobs_mt.__call(apolo_jobs, status_filter)
-    if status_filter then
-        job_table = {}
-        for pid, proc in pairs(apolo_jobs) do
-            local status = proc:status()
-            if status == status_filter then
-                table.insert(job_table, proc)
-            end
-        end
-        return job_table
-    end
-    return apolo_jobs
-end
-
 setmetatable(apolo.jobs, apolo_jobs_mt)
 
 function apolo.path(...)
@@ -321,20 +343,106 @@ function apolo_proc_mt.terminate(self)
     return apolo.core.job_kill(self.pid, false)
 end
 
-local function apolo_check_job(self, is_wait)
-    local status, exit_code = apolo.core.job_status(self.pid, is_wait)
-    self.cur_status = status or self.cur_status
-    
-    if exit_code ~= nil and exit_code < 0 then exit_code = nil end
-    
+local function apolo_update_job(proc, status, exit_code)
+    proc.cur_status = status or proc.cur_status
+
+    if type(exit_code) ~= "number" or exit_code < 0 then exit_code = nil end
+
+    -- Once a process is gone, the system won't know about it anymore
     if status == "finished" or status == "failed" then
-        self.status = function(self) return status end
-        self.exit_code = function(self) return exit_code end
+        proc.status = function(self) return status end
+        proc.exit_code = function(self) return exit_code end
+        proc.wait = proc.exit_code
     end
 
     return exit_code
 end
 
+local function apolo_check_job(self, is_wait)
+    return apolo_update_job(self, apolo.core.job_status(self.pid, is_wait))
+end
+
+-- Apply the changes the core has seen in background jobs, waiting up to
+-- timeout milliseconds (-1 for no limit) for one if there are none yet.
+-- Returns false if there are no jobs left to wait for
+local function apolo_update_jobs(timeout)
+    local events = apolo.core.job_events(timeout)
+    if not events then
+        return false
+    end
+
+    for _, event in ipairs(events) do
+        local proc = apolo.jobs[event.pid]
+        if proc then
+            apolo_update_job(proc, event.status, event.exit_code)
+        end
+    end
+
+    return true
+end
+
+local function apolo_job_is_done(proc)
+    return proc.cur_status == "finished" or proc.cur_status == "failed"
+end
+
+--Job call function that prints all still existing processes created by .bg
+function apolo_jobs_mt.__call(apolo_jobs, status_filter)
+    -- Only jobs that changed since the last call have to be looked at
+    apolo_update_jobs(0)
+
+    if status_filter then
+        local job_table = {}
+        for pid, proc in pairs(apolo_jobs) do
+            if proc.cur_status == status_filter then
+                table.insert(job_table, proc)
+            end
+        end
+        return job_table
+    end
+    return apolo_jobs
+end
+
+-- Wait until any of procs finishes, for up to timeout seconds, and return it
+function apolo.wait_any(procs, timeout)
+    local deadline = timeout and apolo.core.clock() + timeout
+
+    while true do
+        for _, proc in ipairs(procs) do
+            if apolo_job_is_done(proc) then
+                return proc
+            end
+        end
+
+        local wait_ms = -1
+        if deadline then
+            wait_ms = math.max(0, math.floor((deadline - apolo.core.clock()) * 1000))
+        end
+
+        if not apolo_update_jobs(wait_ms) then
+            -- Nothing is being tracked; the jobs may have been waited for
+            -- by other means
+            for _, proc in ipairs(procs) do
+                proc:status()
+                if apolo_job_is_done(proc) then
+                    return proc
+                end
+            end
+
+            return nil, "No jobs to wait for"
+        end
+
+        if deadline and apolo.core.clock() >= deadline then
+            for _, proc in ipairs(procs) do
+                if apolo_job_is_done(proc) then
+                    return proc
+                end
+            end
+
+            return nil, "timeout"
+        end
+    end
+end
+
 function apolo_proc_mt.wait(self)
     return apolo_check_job(self, true)
 end
@@ -348,7 +456,9 @@ end
 function apolo_proc_mt.suspend(self)
     apolo_check_job(self, false)
     if self.cur_status == "running" then
-        return apolo.core.job_active(self.pid, true)
+        local ok, err = apolo.core.job_active(self.pid, true)
+        if ok then self.cur_status = "suspended" end
+        return ok, err
     else
         return nil, "process can not be suspended because it is not running"
     end
@@ -356,115 +466,93 @@ end
 function apolo_proc_mt.resume(self)
     apolo_check_job(self, false)
     if self.cur_status == "suspended" then
-        return apolo.core.job_active(self.pid, false)
+        local ok, err = apolo.core.job_active(self.pid, false)
+        if ok then self.cur_status = "running" end
+        return ok, err
     else
         return nil, "process is not suspended"
     end
 end
 
-local function apolo_matches_glob_pattern(pattern, str)
-    local pat = {}
+local apolo_watch_mt = {}
+apolo_watch_mt.__index = apolo_watch_mt
 
-    -- Parse the pattern before using it
-    local i = 1
-    local patlen = #pattern
-    while i <= patlen do
-        local ch = string.sub(pattern, i, i)
+-- Waits up to timeout seconds (forever without one) for changes and returns
+-- the changed paths, or nil on timeout
+function apolo_watch_mt.wait(self, timeout)
+    local timeout_ms = timeout and math.floor(timeout * 1000) or -1
+    return apolo.core.watch_wait(self.handle, timeout_ms, self.debounce, false)
+end
 
-        if ch == '*' then
-            table.insert(pat, '*')
-            i = i + 1
-        elseif ch == '?' then
-            table.insert(pat, '?')
-            i = i + 1
-        elseif ch == '[' then
-            local j = i + 1
-            local subch = string.sub(pattern, j, j)
-            local charopts = {'opts'}
+-- Iterator over each batch of changes
+function apolo_watch_mt.__call(self)
+    return self:wait()
+end
 
-            while subch ~= ']' do
-                table.insert(charopts, subch)
-                j = j + 1
-                subch = string.sub(pattern, j, j)
+function apolo_watch_mt.close(self)
+    apolo.core.watch_close(self.handle)
+end
+
+-- Keeps command running in the background, restarting it after each batch of
+-- changes, until it finishes by itself. Both are waited for at once, so
+-- nothing is polled
+function apolo_watch_mt.run(self, command, on_change)
+    local proc = assert(apolo.run.bg(command))
+
+    while true do
+        local changes = apolo.core.watch_wait(self.handle, -1, self.debounce, true)
+        if changes then
+            if not apolo_job_is_done(proc) then
+                proc:terminate()
+                proc:wait()
+            end
+            apolo.jobs[proc.pid] = nil
+            if on_change then
+                on_change(changes)
             end
 
-            table.insert(pat, charopts)
-            i = j + 1
+            proc = assert(apolo.run.bg(command))
         else
-            table.insert(pat, ch)
-            i = i + 1
+            apolo_update_jobs(0)
+            if apolo_job_is_done(proc) then
+                apolo.jobs[proc.pid] = nil
+                return proc:exit_code()
+            end
         end
     end
+end
 
-    -- Now use the parsed pat to see if str matches
-    local pati = 1  -- Pattern index
-    for i = 1, #str do
-        local ch = string.sub(str, i, i)
-        local curpatchar = pat[pati]
+function apolo.watch(paths, opts)
+    local opts = opts or {}
+    if type(paths) == 'string' then
+        paths = {paths}
+    end
+    assert(type(paths) == 'table', 'Expecting string or table of paths')
 
-        -- If there's no more pattern left, but there are still characters,
-        -- the globbing fails
-        if not curpatchar then
-            return false
-        end
+    local handle = assert(apolo.core.watch(paths, opts.recursive ~= false))
+    local watch = {handle = handle, debounce = opts.debounce or 100}
 
-        if curpatchar == '*' then
-            -- Keep consuming str's chars until ch is equal to next patchar
-            if ch == pat[pati + 1] then
-                pati = pati + 2
-            end
-        elseif curpatchar == '?' then
-            -- Consume one char then go to the next patchar
-            if ch == pat[pati + 1] then
-                pati = pati + 2
-            else
-                pati = pati + 1
-            end
-        elseif type(curpatchar) == 'string' then
-            -- Stop comparing and return false
-            if ch ~= curpatchar then
-                return false
-            end
+    return setmetatable(watch, apolo_watch_mt)
+end
 
-            pati = pati + 1
-        else
-            curpatchar[0] = nil  -- Remove opts
+apolo.glob = {}
 
-            -- Check if the current char corresponds to any of the options
-            matches = false
-            for _, opt in pairs(curpatchar) do
-                if ch == opt then
-                    matches = true
-                    break
-                end
-            end
+-- Compiled patterns can be run many times, and test paths with :matches
+apolo.glob.compile = apolo.core.glob_compile
 
-            if not matches then
-                return false
-            end
+local apolo_glob_mt = {}
 
-            pati = pati + 1
-        end
-    end
-
-    -- If the pattern was not completely cosumed, then there wasn't a match
-    return pati >= #pat
+function apolo_glob_mt.__call(_, pattern)
+    return apolo.core.glob_compile(pattern)()
 end
 
-function apolo.glob(pattern)
-    local res = {}
-
-    for _, e in ipairs(apolo.entries()) do
-        if apolo_matches_glob_pattern(pattern, e) then
-            table.insert(res, e)
-        end
-    end
+setmetatable(apolo.glob, apolo_glob_mt)
 
-    return res
+function apolo.mkdir(dir)
+    apolo_stat_invalidate()
+    return apolo.core.mkdir(dir)
 end
 
-apolo.mkdir = apolo.core.mkdir
-
 local function merge_lists(...)
     local result = {}
     for _, l in pairs{...} do
@@ -607,27 +695,186 @@ function apolo.parseopts(options)
     return results
 end
 
+-- Started prefetches are kept here until they finish, so they aren't stopped
+-- by the collector when the script doesn't keep them around
+local prefetching = {}
+
+local apolo_prefetch_mt = {}
+apolo_prefetch_mt.__index = apolo_prefetch_mt
+
+-- Waits up to timeout seconds (forever without one) for all files to be read
+-- and returns the number of bytes read, or nil on timeout
+function apolo_prefetch_mt.wait(self, timeout)
+    local timeout_ms = timeout and math.floor(timeout * 1000) or -1
+    local bytes = apolo.core.prefetch_wait(self.handle, timeout_ms)
+    if bytes then
+        prefetching[self] = nil
+    end
+
+    return bytes
+end
+
+function apolo_prefetch_mt.close(self)
+    prefetching[self] = nil
+    apolo.core.prefetch_close(self.handle)
+end
+
+function apolo.prefetch(paths, opts)
+    local opts = opts or {}
+    if type(paths) == 'string' then
+        paths = {paths}
+    end
+    assert(type(paths) == 'table', 'Expecting string or table of paths')
+
+    local files = {}
+    for _, path in ipairs(paths) do
+        assert(type(path) == 'string', 'Expecting string or table of paths')
+        if string.find(path, '[*?[{]') then
+            for _, file in ipairs(apolo.glob(path)) do
+                table.insert(files, file)
+            end
+        else
+            table.insert(files, path)
+        end
+    end
+
+    local handle = assert(apolo.core.prefetch(files))
+    local prefetch = setmetatable({handle = handle, files = files}, apolo_prefetch_mt)
+    prefetching[prefetch] = true
+
+    if opts.wait then
+        prefetch:wait()
+    end
+
+    return prefetch
+end
+
+function apolo.pump(src, dst)
+    apolo_stat_invalidate()
+    return apolo.core.pump(src, dst)
+end
+
 apolo.readf = {}
 
--- TODO support non-local protocols
+-- Handlers are either functions, which read the whole thing, or tables with
+-- any of read, map and chunks functions
 apolo.readf.protocol_handlers = {}
 
+-- Handler for the protocol of filename, as a table; local files have none
+local function apolo_readf_handler(filename)
+    -- Look for a colon in the matches and get the text before it
+    local protocol, matches = string.gsub(filename, ":.*", "")
+
+    -- If there's no match, it's a local file
+    if matches == 0 then
+        return nil
+    end
+
+    local handler = apolo.readf.protocol_handlers[protocol]
+    if not handler then
+        return nil, "Unsupported protocol: " .. protocol
+    end
+
+    if type(handler) == 'function' then
+        return {read = handler}
+    end
+    return handler
+end
+
+-- Iterator over the string in pieces of size bytes
+local function apolo_string_chunks(str, size)
+    local pos = 1
+
+    return function()
+        if pos > #str then
+            return nil
+        end
+
+        local chunk = string.sub(str, pos, pos + size - 1)
+        pos = pos + size
+        return chunk
+    end
+end
+
+-- Maps the file into memory instead of reading it
+function apolo.readf.map(filename)
+    local handler, err = apolo_readf_handler(filename)
+    if err then
+        return nil, err
+    elseif handler then
+        if not handler.map then
+            return nil, "Protocol can't be mapped: " .. filename:match("^[^:]*")
+        end
+        return handler.map(filename)
+    end
+
+    return apolo.core.map(filename)
+end
+
+-- Reads the file size bytes at a time, so it's never all in memory
+function apolo.readf.chunks(filename, size)
+    size = size or 64 * 1024
+    assert(size > 0, "Chunks must have at least one byte")
+
+    local handler, err = apolo_readf_handler(filename)
+    if err then
+        return nil, err
+    elseif handler then
+        if handler.chunks then
+            return handler.chunks(filename, size)
+        elseif not handler.read then
+            return nil, "Protocol can't be read: " .. filename:match("^[^:]*")
+        end
+
+        local str, read_err = handler.read(filename)
+        if not str then
+            return nil, read_err
+        end
+        return apolo_string_chunks(str, size)
+    end
+
+    local file, file_err = io.open(filename, "rb")
+    if not file then
+        return nil, "Could not open file: " .. file_err
+    end
+
+    return function()
+        if not file then
+            return nil
+        end
+
+        local chunk = file:read(size)
+        if not chunk then
+            file:close()
+            file = nil
+        end
+        return chunk
+    end
+end
+
 local apolo_readf_mt = {}
 
 function apolo_readf_mt.__call(apolo_readf, filename)
-    -- Look for a colon in the matches and get the text before it
-    local protocol, matches = string.gsub(filename, ":.*", "")
+    local handler, err = apolo_readf_handler(filename)
+    if err then
+        return nil, err
+    elseif handler then
+        if handler.read then
+            return handler.read(filename)
+        elseif not handler.chunks then
+            return nil, "Protocol can't be read: " .. filename:match("^[^:]*")
+        end
 
-    -- If there's a match, then it's not a local file
-    if matches >= 1 then
-        -- Look for the right handler for the protocol
-        for p, handler in pairs(apolo_readf.protocol_handlers) do
-            if protocol == p then
-                return handler(filename)
-            end
+        local chunks, chunks_err = handler.chunks(filename, 64 * 1024)
+        if not chunks then
+            return nil, chunks_err
         end
 
-        return nil, "Unsupported protocol: " .. protocol
+        local pieces = {}
+        for chunk in chunks do
+            pieces[#pieces + 1] = chunk
+        end
+        return table.concat(pieces)
     end
 
     -- Otherwise, just open it as a normal local file
@@ -708,12 +955,32 @@ local function make_apolo_command(options, option_types, call)
     return apolo_command
 end
 
+function apolo.envblock(vars)
+    local strvars = {}
+    for name, val in pairs(vars) do
+        -- Convert lua booleans to a more usual representation of booleans
+        -- used in command-line arguments and environment variables
+        if val == true then
+            val = 1
+        elseif val == false then
+            val = 0
+        end
+
+        strvars[tostring(name)] = tostring(val)
+    end
+
+    return apolo.core.envblock(strvars)
+end
+
 local function apolo_execute_call(options, args)
     assert(options.pipe or #args == 1, "Non-piped run commands must have only one command. "
         .. "Did you remember to encapsulate the command into a table?")
     assert(not options.pipe or #args > 1, "Piped run commands must have more than one command. "
         .. "Did you accidentally encapsulate all the commands in a table?")
-    assert(#args < 32, "Maxed out pipe length. run.pipe has a limit of 32 processes")
+    assert(not (options.tee and options.bg), "Background run commands can't be teed")
+
+    -- Commands can change any file
+    apolo_stat_invalidate()
 
     local exec_commands = {}
 
@@ -733,20 +1000,9 @@ local function apolo_execute_call(options, args)
         table.insert(exec_commands, arg_table)
     end
 
-    local envstrings = {}
-    local exeenv = options.env
-    if exeenv then
-        for name, val in pairs(exeenv) do
-            -- Convert lua booleans to a more usual representation of booleans
-            -- used in command-line arguments and environment variables
-            if val == true then
-                val = 1
-            elseif val == false then
-                val = 0
-            end
-
-            table.insert(envstrings, name .. "=" .. tostring(val))
-        end
+    local envblock = options.env or false
+    if envblock and type(envblock) ~= 'userdata' then
+        envblock = apolo.envblock(envblock)
     end
 
     -- Set warning for when users try appending to the same file twice at the same time
@@ -755,16 +1011,19 @@ local function apolo_execute_call(options, args)
             "This is not supported for all platforms and can cause file corruption on Linux.")
     end
 
-    local result, errcode = apolo.core.execute(
-        exec_commands, envstrings, options.bg, options.is_eval, #exec_commands,
+    local result, errcode, stage_codes = apolo.core.execute(
+        exec_commands, envblock, options.bg, options.is_eval, #exec_commands,
         options.from or "", options.out_to or options.append_to or "",
         (options.out_to == nil), options.err_to or options.append_err_to or "",
-        (options.err_to == nil), options.err_to_out, options.out_to_err)
+        (options.err_to == nil), options.err_to_out, options.out_to_err,
+        options.spill_at or 0, (options.lines or options.chunks) ~= nil,
+        options.chunks or 0, options.pipefail == true, options.pipe_size or 0,
+        options.tee or "")
 
     if result and options.bg  then
         -- Create process object
-        local proc = {pid = result, name = executable, cur_status = "running"}
-        jobs[proc.pid] = proc
+        local proc = {pid = result, name = exec_commands[1][1], cur_status = "running"}
+        apolo.jobs[proc.pid] = proc
 
         setmetatable(proc, {__index=apolo_proc_mt})
 
@@ -774,24 +1033,244 @@ local function apolo_execute_call(options, args)
     if options.is_eval then
         return result
     else
-        return result, errcode
+        return result, errcode, stage_codes
     end
 end
 
+-- Keep up to options.jobs commands running at once, in the background
+local function apolo_run_parallel(options, args)
+    assert(not options.pipe, "Parallel run commands can't be piped")
+    assert(not options.tee, "Parallel run commands can't be teed")
+    assert(#args == 1 and type(args[1]) == 'table',
+        "run.parallel expects a single sequence of commands")
+    apolo_stat_invalidate()
+
+    local commands = args[1]
+    local max_jobs = options.jobs or apolo.core.cpu_count()
+    assert(max_jobs >= 1, "run.parallel needs at least one job")
+
+    local bg_options = {}
+    for k, v in pairs(options) do bg_options[k] = v end
+    bg_options.parallel = nil
+    bg_options.jobs = nil
+    bg_options.bg = true
+
+    -- Merge the environment once for all commands
+    if type(bg_options.env) == 'table' then
+        bg_options.env = apolo.envblock(bg_options.env)
+    end
+
+    local codes = {}
+    local errors = {}
+    local all_ok = true
+    local running = {}
+    local command_index = {}
+    local next_command = 1
+
+    while next_command <= #commands or #running > 0 do
+        while #running < max_jobs and next_command <= #commands do
+            local proc, err = apolo_execute_call(bg_options, {commands[next_command]})
+            if proc then
+                table.insert(running, proc)
+                command_index[proc] = next_command
+            else
+                codes[next_command] = false
+                errors[next_command] = err
+                all_ok = false
+            end
+
+            next_command = next_command + 1
+        end
+
+        if #running > 0 then
+            local proc = assert(apolo.wait_any(running))
+            local i = command_index[proc]
+
+            for j, p in ipairs(running) do
+                if p == proc then
+                    table.remove(running, j)
+                    break
+                end
+            end
+
+            -- The caller never sees these jobs, so nobody else would remove them
+            apolo.jobs[proc.pid] = nil
+
+            codes[i] = proc:exit_code() or false
+            if codes[i] ~= 0 then
+                all_ok = false
+            end
+            if not codes[i] then
+                errors[i] = "Process failed"
+            end
+        end
+    end
+
+    return all_ok, codes, errors
+end
+
+local function apolo_run_call(options, args)
+    if options.parallel then
+        return apolo_run_parallel(options, args)
+    end
+
+    return apolo_execute_call(options, args)
+end
+
 local apolo_run_options = {bg = 'switch', env = 'param', pipe = 'switch', from = 'param',
     out_to = 'param', append_to = 'param', err_to = 'param', append_err_to = 'param',
-    err_to_out = 'switch', out_to_err = 'switch'}
+    err_to_out = 'switch', out_to_err = 'switch', parallel = 'switch', jobs = 'param',
+    pipefail = 'switch', pipe_size = 'param', tee = 'param'}
 apolo.run = make_apolo_command({bg = false, is_eval = false, err_to_out = false, out_to_err = false},
-    apolo_run_options, apolo_execute_call)
+    apolo_run_options, apolo_run_call)
 
 local apolo_eval_options = {env = 'param', pipe = 'switch', from = 'param', err_to = 'param',
-    append_err_to = 'param', err_to_out = 'switch'}
+    append_err_to = 'param', err_to_out = 'switch', spill_at = 'param', lines = 'switch',
+    chunks = 'param', pipe_size = 'param'}
 apolo.eval = make_apolo_command({bg = false, is_eval = true, err_to_out = false, out_to_err = false},
     apolo_eval_options, apolo_execute_call)
 
+-- Replaces the Lua process with the command; only returns if it can't be run
+local function apolo_exec_call(options, args)
+    assert(#args == 1, "exec commands must have only one command. "
+        .. "Did you remember to encapsulate the command into a table?")
+
+    local command = args[1]
+    if type(command) == 'string' then
+        command = unstringfy_args(command)
+    else
+        assert(type(command) == 'table', 'Expecting either string or table as exec argument')
+    end
+
+    local envblock = options.env or false
+    if envblock and type(envblock) ~= 'userdata' then
+        envblock = apolo.envblock(envblock)
+    end
+
+    local result, err = apolo.core.exec(
+        {command}, envblock, options.from or "", options.out_to or options.append_to or "",
+        (options.out_to == nil), options.err_to or options.append_err_to or "",
+        (options.err_to == nil), options.err_to_out, options.out_to_err)
+
+    -- The targets may have been created before the command failed
+    apolo_stat_invalidate()
+    return result, err
+end
+
+local apolo_exec_options = {env = 'param', from = 'param', out_to = 'param',
+    append_to = 'param', err_to = 'param', append_err_to = 'param', err_to_out = 'switch',
+    out_to_err = 'switch'}
+apolo.exec = make_apolo_command({err_to_out = false, out_to_err = false},
+    apolo_exec_options, apolo_exec_call)
+
+apolo.stat = {}
+
+-- Field names, in the order they're looked up in the cache
+local stat_fields = {'type', 'size', 'mode', 'mtime', 'atime', 'ctime', 'uid', 'gid'}
+
+local function apolo_stat_lookup(path, fields)
+    local cached = stat_cache[path]
+    if not cached then
+        return cached
+    end
+
+    for _, field in ipairs(fields) do
+        if not cached.fetched[field] then
+            return nil
+        end
+    end
+
+    return cached.info
+end
+
+-- Merges what was fetched now with what was already there
+local function apolo_stat_store(path, fields, info)
+    if not info then
+        stat_cache[path] = false
+        return false
+    end
+
+    local cached = stat_cache[path] or {info = {}, fetched = {}}
+    for _, field in ipairs(fields) do
+        cached.fetched[field] = true
+    end
+    for k, v in pairs(info) do
+        cached.info[k] = v
+    end
+
+    stat_cache[path] = cached
+    return cached.info
+end
+
+local apolo_stat_mt = {}
+
+function apolo_stat_mt.__call(_, paths, fields)
+    assert(type(paths) == 'string' or type(paths) == 'table',
+        'Expecting string or table of paths')
+
+    if not stat_cache then
+        return apolo.core.stat(paths, fields or false, true)
+    end
+
+    fields = fields or stat_fields
+    local is_list = type(paths) == 'table'
+    local res, missing = {}, {}
+    for _, path in ipairs(is_list and paths or {paths}) do
+        local info = apolo_stat_lookup(path, fields)
+        if info == nil then
+            missing[#missing + 1] = path
+        else
+            res[path] = info
+        end
+    end
+
+    -- Whatever isn't cached yet is fetched in a single native call
+    if #missing > 0 then
+        local infos, err = apolo.core.stat(missing, fields, true)
+        if not infos then
+            return nil, err
+        end
+
+        for path, info in pairs(infos) do
+            res[path] = apolo_stat_store(path, fields, info)
+        end
+    end
+
+    if is_list then
+        return res
+    end
+    return res[paths]
+end
+
+-- Until turned off, stat and exists reuse earlier results for the same path
+function apolo.stat.cache(enable)
+    if enable == false then
+        stat_cache = nil
+    else
+        stat_cache = stat_cache or {}
+    end
+end
+
+apolo.stat.invalidate = apolo_stat_invalidate
+
+setmetatable(apolo.stat, apolo_stat_mt)
+
+apolo.which = apolo.core.which
+
+-- Buffered writes to a file that stays open
+function apolo.writer(filename, opts)
+    local opts = opts or {}
+    assert(not (opts.append and opts.atomic), "Atomic writers can't append")
+
+    apolo_stat_invalidate()
+    return apolo.core.writer(filename, opts.append == true, opts.atomic == true,
+        opts.buffer or 64 * 1024)
+end
+
 apolo.writef = {}
 
 local function apolo_writef(filename, content, mode)
+    apolo_stat_invalidate()
     local file, file_err = io.open(filename, mode)
     if not file then
         return nil, "Could not open file: " .. file_err
@@ -810,9 +1289,23 @@ function apolo.writef.app(filename, content)
     return apolo_writef(filename, content, "a")
 end
 
+-- Writes each key of the table with its value in a single native call
+function apolo.writef.many(files, opts)
+    assert(type(files) == 'table', 'Expecting a table of files and contents')
+
+    apolo_stat_invalidate()
+    return apolo.core.writef_many(files, (opts or {}).atomic == true)
+end
+
 local apolo_writef_mt = {}
 
-function apolo_writef_mt.__call(_, filename, content)
+function apolo_writef_mt.__call(_, filename, content, opts)
+    if opts and opts.atomic then
+        -- Written to a temporary file, synced and then renamed over filename
+        apolo_stat_invalidate()
+        return apolo.core.writef(filename, content, false, true)
+    end
+
     return apolo_writef(filename, content, "w")
 end
 
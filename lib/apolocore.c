@@ -20,15 +20,15 @@
    DEALINGS IN THE SOFTWARE.
 */
 
-#define MAX_PIPE_LENGTH 32
-
 /* Lua includes */
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
 /* C includes */
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <stdio.h>
 /* Apolo includes */
@@ -59,11 +59,35 @@ static int apolocore_chdir(lua_State *L)
     return 1;
 }
 
+/* orig may be a sequence of paths, all copied in this call; it stops on the
+   first one that fails */
 static int apolocore_copy(lua_State *L)
 {
     check_argc(2);
-    check_arg_type(1, LUA_TSTRING);
     check_arg_type(2, LUA_TSTRING);
+
+    if (lua_type(L, 1) == LUA_TTABLE) {
+        const char *dest = lua_tostring(L, 2);
+        lua_Integer len = luaL_len(L, 1);
+
+        for (lua_Integer i = 1; i <= len; ++i) {
+            if (lua_geti(L, 1, i) != LUA_TSTRING)
+                return luaL_error(L, "Expecting only strings as origins");
+
+            const char *orig = lua_tostring(L, -1);
+            if (!native_copy(orig, dest)) {
+                lua_pushboolean(L, 0);
+                lua_pushfstring(L, "Failed on file %s", orig);
+                return 2;
+            }
+            lua_pop(L, 1);
+        }
+
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    check_arg_type(1, LUA_TSTRING);
     
     lua_pushboolean(
         L,
@@ -73,208 +97,2231 @@ static int apolocore_copy(lua_State *L)
     return 1;
 }
 
-static int apolocore_curdir(lua_State *L)
-{
-    char dir[512];
-    check_argc(0);
+static int apolocore_curdir(lua_State *L)
+{
+    char dir[512];
+    check_argc(0);
+
+    if (!native_curdir(dir)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not get the current directory: %s", strerror(errno));
+        return 2;
+    }
+
+    lua_pushstring(L, dir);
+    return 1;
+}
+
+static int apolocore_clock(lua_State *L)
+{
+    check_argc(0);
+
+    lua_pushnumber(L, native_clock());
+    return 1;
+}
+
+static int apolocore_cpu_count(lua_State *L)
+{
+    check_argc(0);
+
+    lua_pushinteger(L, native_cpu_count());
+    return 1;
+}
+
+static int apolocore_del(lua_State *L)
+{
+    check_argc(2);
+    check_arg_type(1, LUA_TSTRING);
+    check_arg_type(2, LUA_TNUMBER);
+
+    const char *path = lua_tostring(L, 1);
+    switch (native_del(path, lua_tointeger(L, 2))) {
+    case 1:
+        lua_pushboolean(L, 1);
+        return 1;
+    case 0:
+        lua_pushboolean(L, 0);
+        return 1;
+    default:
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not delete %s: %s", path, strerror(errno));
+        return 2;
+    }
+}
+
+/* Lua names of enum native_entry_type */
+static const char *entry_type_names[NATIVE_ENTRY_TYPE_COUNT] = {
+    "dir", "file", "blkdev", "chrdev", "namedpipe", "symlink", "udsocket", "unknown"
+};
+
+/* Lua names of enum native_stat_field, in bit order */
+static const char *stat_field_names[] = {
+    "type", "size", "mode", "mtime", "atime", "ctime", "uid", "gid", NULL
+};
+
+/* Bit set of the fields named in the sequence at index, or all of them if
+   it's false */
+static unsigned stat_fields_arg(lua_State *L, int index)
+{
+    if (!lua_toboolean(L, index))
+        return NATIVE_STAT_ALL;
+
+    unsigned fields = 0;
+    lua_Integer len = luaL_len(L, index);
+    for (lua_Integer i = 1; i <= len; ++i) {
+        lua_geti(L, index, i);
+        const char *name = lua_tostring(L, -1);
+        int f;
+        for (f = 0; stat_field_names[f]; ++f) {
+            if (name && strcmp(name, stat_field_names[f]) == 0)
+                break;
+        }
+        if (!stat_field_names[f])
+            return luaL_error(L, "Unknown stat field: %s", name ? name : "?");
+
+        fields |= 1u << f;
+        lua_pop(L, 1);
+    }
+
+    return fields;
+}
+
+/* Table with the fields that were filled */
+static void push_stat(lua_State *L, const struct native_stat *st)
+{
+    lua_createtable(L, 0, 8);
+
+    if (st->fields & NATIVE_STAT_TYPE) {
+        lua_pushstring(L, entry_type_names[st->type]);
+        lua_setfield(L, -2, "type");
+    }
+    if (st->fields & NATIVE_STAT_SIZE) {
+        lua_pushinteger(L, st->size);
+        lua_setfield(L, -2, "size");
+    }
+    if (st->fields & NATIVE_STAT_MODE) {
+        lua_pushinteger(L, st->mode);
+        lua_setfield(L, -2, "mode");
+    }
+    if (st->fields & NATIVE_STAT_MTIME) {
+        lua_pushnumber(L, st->mtime);
+        lua_setfield(L, -2, "mtime");
+    }
+    if (st->fields & NATIVE_STAT_ATIME) {
+        lua_pushnumber(L, st->atime);
+        lua_setfield(L, -2, "atime");
+    }
+    if (st->fields & NATIVE_STAT_CTIME) {
+        lua_pushnumber(L, st->ctime);
+        lua_setfield(L, -2, "ctime");
+    }
+    if (st->fields & NATIVE_STAT_UID) {
+        lua_pushinteger(L, st->uid);
+        lua_setfield(L, -2, "uid");
+    }
+    if (st->fields & NATIVE_STAT_GID) {
+        lua_pushinteger(L, st->gid);
+        lua_setfield(L, -2, "gid");
+    }
+}
+
+#define APOLO_DIR_ITER_MT "apolo.dir_iter"
+
+struct apolo_dir_iter
+{
+    struct native_dir *dir;
+};
+
+static int dir_iter_gc(lua_State *L)
+{
+    struct apolo_dir_iter *iter = luaL_checkudata(L, 1, APOLO_DIR_ITER_MT);
+    if (iter->dir) {
+        native_dir_close(iter->dir);
+        iter->dir = NULL;
+    }
+
+    return 0;
+}
+
+/* Upvalues: the iterator userdata, then the entry type names. Pushing the
+   names from there means the name string is the only allocation per entry */
+static int dir_iter_next(lua_State *L)
+{
+    struct apolo_dir_iter *iter = lua_touserdata(L, lua_upvalueindex(1));
+    const char *name;
+    enum native_entry_type type;
+
+    if (!iter->dir)
+        return 0;
+
+    int res = native_dir_next(iter->dir, &name, &type);
+    if (res <= 0) {
+        int error = errno;
+        native_dir_close(iter->dir);
+        iter->dir = NULL;
+
+        if (res < 0)
+            return luaL_error(L, "Could not read directory: %s", strerror(error));
+        return 0;
+    }
+
+    lua_pushstring(L, name);
+    lua_pushvalue(L, lua_upvalueindex(2 + type));
+    return 2;
+}
+
+static int apolocore_dir_iter(lua_State *L)
+{
+    check_argc(1);
+    check_arg_type(1, LUA_TSTRING);
+
+    struct apolo_dir_iter *iter = lua_newuserdata(L, sizeof(struct apolo_dir_iter));
+    iter->dir = NULL;
+    luaL_setmetatable(L, APOLO_DIR_ITER_MT);
+
+    iter->dir = native_dir_open(lua_tostring(L, 1));
+    if (!iter->dir) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not open directory %s: %s",
+            lua_tostring(L, 1), strerror(errno));
+        return 2;
+    }
+
+    for (int i = 0; i < NATIVE_ENTRY_TYPE_COUNT; ++i)
+        lua_pushstring(L, entry_type_names[i]);
+    lua_pushcclosure(L, dir_iter_next, 1 + NATIVE_ENTRY_TYPE_COUNT);
+
+    return 1;
+}
+
+#define APOLO_WALK_MT "apolo.walk"
+
+struct apolo_walk
+{
+    struct native_walk *walk;
+    int max_depth;
+    int min_depth;
+    unsigned types;  /* bit set of the enum native_entry_type to yield */
+    unsigned fields;  /* enum native_stat_field to attach, if any */
+    int follow_links;
+};
+
+static int walk_gc(lua_State *L)
+{
+    struct apolo_walk *iter = luaL_checkudata(L, 1, APOLO_WALK_MT);
+    if (iter->walk) {
+        native_walk_close(iter->walk);
+        iter->walk = NULL;
+    }
+
+    return 0;
+}
+
+/* Upvalues: the walk userdata, the prune predicate (or false), then the entry
+   type names */
+static int walk_next(lua_State *L)
+{
+    struct apolo_walk *iter = lua_touserdata(L, lua_upvalueindex(1));
+    int has_prune = lua_toboolean(L, lua_upvalueindex(2));
+    const char *path;
+    enum native_entry_type type;
+    int depth, is_dir;
+
+    while (iter->walk) {
+        int res = native_walk_next(iter->walk, &path, &type, &depth, &is_dir);
+        if (res <= 0) {
+            int error = errno;
+            native_walk_close(iter->walk);
+            iter->walk = NULL;
+            if (res < 0)
+                return luaL_error(L, "Could not walk the whole tree: %s", strerror(error));
+            break;
+        }
+
+        // Pushed first, since the path goes away with the entry once descended
+        int is_wanted = depth >= iter->min_depth && (iter->types & (1u << type));
+        if (is_wanted) {
+            lua_pushstring(L, path);
+            lua_pushvalue(L, lua_upvalueindex(3 + type));
+            lua_pushinteger(L, depth);
+
+            struct native_stat st;
+            if (iter->fields && native_stat(path, iter->fields, iter->follow_links, &st) > 0)
+                push_stat(L, &st);
+            else if (iter->fields)
+                lua_pushboolean(L, 0);
+        }
+
+        if (is_dir && (iter->max_depth < 0 || depth < iter->max_depth)) {
+            int is_pruned = 0;
+            if (has_prune) {
+                lua_pushvalue(L, lua_upvalueindex(2));
+                lua_pushstring(L, path);
+                lua_pushvalue(L, lua_upvalueindex(3 + type));
+                lua_pushinteger(L, depth);
+                lua_call(L, 3, 1);
+                is_pruned = lua_toboolean(L, -1);
+                lua_pop(L, 1);
+            }
+
+            if (!is_pruned)
+                native_walk_descend(iter->walk);
+        }
+
+        if (is_wanted)
+            return iter->fields ? 4 : 3;
+    }
+
+    return 0;
+}
+
+/* Arguments: root, threads, max_depth (negative for no limit), min_depth,
+   follow links, sequence of types to yield (or false for all of them), prune
+   predicate (or false) and sequence of stat fields to attach to each entry
+   (or false for none) */
+static int apolocore_walk(lua_State *L)
+{
+    check_argc(8);
+    check_arg_type(1, LUA_TSTRING);
+    check_arg_type(2, LUA_TNUMBER);
+    check_arg_type(3, LUA_TNUMBER);
+    check_arg_type(4, LUA_TNUMBER);
+    check_arg_type(5, LUA_TBOOLEAN);
+    if (lua_toboolean(L, 6)) {
+        check_arg_type(6, LUA_TTABLE);
+    }
+    if (lua_toboolean(L, 7)) {
+        check_arg_type(7, LUA_TFUNCTION);
+    }
+    if (lua_toboolean(L, 8)) {
+        check_arg_type(8, LUA_TTABLE);
+    }
+
+    unsigned types = ~0u;
+    if (lua_toboolean(L, 6)) {
+        types = 0;
+        lua_Integer len = luaL_len(L, 6);
+        for (lua_Integer i = 1; i <= len; ++i) {
+            lua_geti(L, 6, i);
+            const char *name = lua_tostring(L, -1);
+            int t;
+            for (t = 0; t < NATIVE_ENTRY_TYPE_COUNT; ++t) {
+                if (name && strcmp(name, entry_type_names[t]) == 0)
+                    break;
+            }
+            if (t == NATIVE_ENTRY_TYPE_COUNT)
+                return luaL_error(L, "Unknown entry type: %s", name ? name : "?");
+
+            types |= 1u << t;
+            lua_pop(L, 1);
+        }
+    }
+
+    struct apolo_walk *iter = lua_newuserdata(L, sizeof(struct apolo_walk));
+    iter->walk = NULL;
+    iter->max_depth = lua_tointeger(L, 3);
+    iter->min_depth = lua_tointeger(L, 4);
+    iter->types = types;
+    iter->fields = lua_toboolean(L, 8) ? stat_fields_arg(L, 8) : 0;
+    iter->follow_links = lua_toboolean(L, 5);
+    luaL_setmetatable(L, APOLO_WALK_MT);
+
+    iter->walk = native_walk_open(lua_tostring(L, 1), lua_tointeger(L, 2), lua_toboolean(L, 5));
+    if (!iter->walk) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not open directory %s: %s",
+            lua_tostring(L, 1), strerror(errno));
+        return 2;
+    }
+
+    lua_pushvalue(L, 7);
+    for (int i = 0; i < NATIVE_ENTRY_TYPE_COUNT; ++i)
+        lua_pushstring(L, entry_type_names[i]);
+    lua_pushcclosure(L, walk_next, 2 + NATIVE_ENTRY_TYPE_COUNT);
+
+    return 1;
+}
+
+/* Glob patterns are compiled once into a list of alternatives (one for each
+   expansion of the braces), each made of one segment per path component.
+   Segments without wildcards are just looked up, and directories are only
+   read when some segment can still match inside them */
+enum glob_op_kind {
+    GLOB_CHAR,
+    GLOB_OPT,   /* ?: one character or none */
+    GLOB_STAR,
+    GLOB_SET    /* [...] or [!...] */
+};
+
+struct glob_op
+{
+    unsigned char kind;
+    unsigned char c;
+    unsigned char set[32];  /* bit set of the characters matched by GLOB_SET */
+};
+
+struct glob_segment
+{
+    int is_globstar;
+    char *literal;  /* the whole segment, if it has no wildcards */
+    size_t num_ops;
+    struct glob_op *ops;
+};
+
+struct glob_alt
+{
+    int is_absolute;
+    size_t num_segments;
+    struct glob_segment *segments;
+};
+
+#define APOLO_GLOB_MT "apolo.glob"
+#define GLOB_MAX_ALTS 4096
+
+struct apolo_glob
+{
+    size_t num_alts;
+    size_t capacity;
+    struct glob_alt *alts;
+};
+
+static void free_glob(struct apolo_glob *glob)
+{
+    for (size_t i = 0; i < glob->num_alts; ++i) {
+        struct glob_alt *alt = &glob->alts[i];
+        for (size_t j = 0; j < alt->num_segments; ++j) {
+            free(alt->segments[j].literal);
+            free(alt->segments[j].ops);
+        }
+        free(alt->segments);
+    }
+    free(glob->alts);
+    glob->alts = NULL;
+    glob->num_alts = 0;
+    glob->capacity = 0;
+}
+
+/* Compiles one path component; 0 if out of memory */
+static int compile_glob_segment(const char *text, size_t len, struct glob_segment *seg)
+{
+    seg->is_globstar = len == 2 && text[0] == '*' && text[1] == '*';
+    seg->literal = NULL;
+    seg->num_ops = 0;
+    seg->ops = NULL;
+    if (seg->is_globstar)
+        return 1;
+
+    if (!memchr(text, '*', len) && !memchr(text, '?', len) && !memchr(text, '[', len)) {
+        if (!(seg->literal = malloc(len + 1)))
+            return 0;
+        memcpy(seg->literal, text, len);
+        seg->literal[len] = 0;
+        return 1;
+    }
+
+    if (!(seg->ops = calloc(len, sizeof(struct glob_op))))
+        return 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        struct glob_op *op = &seg->ops[seg->num_ops];
+
+        if (text[i] == '*') {
+            // Consecutive stars match the same as one
+            if (seg->num_ops > 0 && op[-1].kind == GLOB_STAR)
+                continue;
+            op->kind = GLOB_STAR;
+        } else if (text[i] == '?') {
+            op->kind = GLOB_OPT;
+        } else if (text[i] == '[') {
+            size_t j = i + 1;
+            int negate = j < len && (text[j] == '!' || text[j] == '^');
+            if (negate)
+                ++j;
+            size_t first = j;
+
+            // A ] right after the [ is one of the characters
+            while (j < len && (text[j] != ']' || j == first))
+                ++j;
+
+            if (j >= len) {
+                // Unterminated: just a [
+                op->kind = GLOB_CHAR;
+                op->c = '[';
+            } else {
+                op->kind = GLOB_SET;
+                for (size_t k = first; k < j; ++k) {
+                    unsigned char from = text[k], to = text[k];
+                    if (k + 2 < j && text[k + 1] == '-') {
+                        to = text[k + 2];
+                        k += 2;
+                    }
+                    for (unsigned c = from; c <= to; ++c)
+                        op->set[c / 8] |= 1 << (c % 8);
+                }
+                if (negate) {
+                    for (int k = 0; k < 32; ++k)
+                        op->set[k] = ~op->set[k];
+                }
+                i = j;
+            }
+        } else {
+            op->kind = GLOB_CHAR;
+            op->c = text[i];
+        }
+
+        ++seg->num_ops;
+    }
+
+    return 1;
+}
+
+static int compile_glob_alt(const char *pattern, struct glob_alt *alt)
+{
+    size_t max_segments = 1;
+    for (const char *p = pattern; *p; ++p) {
+        if (*p == '/')
+            ++max_segments;
+    }
+
+    alt->is_absolute = pattern[0] == '/';
+    alt->num_segments = 0;
+    if (!(alt->segments = calloc(max_segments, sizeof(struct glob_segment))))
+        return 0;
+
+    const char *start = pattern;
+    for (;;) {
+        const char *end = strchr(start, '/');
+        size_t len = end ? (size_t) (end - start) : strlen(start);
+
+        // Empty components (like in a//b) are skipped
+        if (len > 0) {
+            struct glob_segment *seg = &alt->segments[alt->num_segments];
+            if (!compile_glob_segment(start, len, seg))
+                return 0;
+
+            // So is a ** right after another
+            if (seg->is_globstar && alt->num_segments > 0 &&
+                    alt->segments[alt->num_segments - 1].is_globstar)
+                continue;
+            ++alt->num_segments;
+        }
+
+        if (!end)
+            break;
+        start = end + 1;
+    }
+
+    return 1;
+}
+
+/* Expands the first brace group of pattern (recursively, so every group is
+   expanded) and compiles each expansion. Braces without a match are kept.
+   Returns 0 if out of memory and -1 if there are too many expansions */
+static int expand_glob_braces(const char *pattern, struct apolo_glob *glob)
+{
+    const char *open = NULL, *close = NULL;
+    int depth = 0;
+    for (const char *p = pattern; *p && !close; ++p) {
+        if (*p == '{') {
+            if (depth++ == 0)
+                open = p;
+        } else if (*p == '}' && depth > 0) {
+            if (--depth == 0)
+                close = p;
+        }
+    }
+
+    if (!close) {
+        if (glob->num_alts == GLOB_MAX_ALTS)
+            return -1;
+
+        if (glob->num_alts == glob->capacity) {
+            size_t new_capacity = glob->capacity ? glob->capacity * 2 : 4;
+            struct glob_alt *new_alts =
+                realloc(glob->alts, new_capacity * sizeof(struct glob_alt));
+            if (!new_alts)
+                return 0;
+            glob->alts = new_alts;
+            glob->capacity = new_capacity;
+        }
+
+        struct glob_alt *alt = &glob->alts[glob->num_alts++];
+        alt->num_segments = 0;
+        alt->segments = NULL;
+        return compile_glob_alt(pattern, alt);
+    }
+
+    size_t len = strlen(pattern);
+    char *buf = malloc(len + 1);
+    if (!buf)
+        return 0;
+
+    const char *alt_start = open + 1;
+    depth = 0;
+    for (const char *p = open + 1; p <= close; ++p) {
+        if (*p == '{')
+            ++depth;
+        else if (*p == '}' && p != close)
+            --depth;
+        else if ((*p == ',' && depth == 0) || p == close) {
+            size_t prefix_len = open - pattern;
+            size_t alt_len = p - alt_start;
+            memcpy(buf, pattern, prefix_len);
+            memcpy(buf + prefix_len, alt_start, alt_len);
+            strcpy(buf + prefix_len + alt_len, close + 1);
+
+            int res = expand_glob_braces(buf, glob);
+            if (res <= 0) {
+                free(buf);
+                return res;
+            }
+            alt_start = p + 1;
+        }
+    }
+
+    free(buf);
+    return 1;
+}
+
+/* Stars keep a single backtrack point: when what follows the last star fails,
+   that star takes one more character and the rest is tried again. Earlier
+   stars never need to take more, so this is linear for each star. Only ?,
+   which may or may not take a character, has to try both */
+static int match_glob_ops(const struct glob_op *ops, size_t num_ops, const char *str)
+{
+    const struct glob_op *star_ops = NULL;
+    size_t star_num_ops = 0;
+    const char *star_str = NULL;
+
+    for (;;) {
+        if (num_ops == 0) {
+            if (*str == 0)
+                return 1;
+        } else {
+            unsigned char c = *str;
+            int is_match;
+
+            switch (ops->kind) {
+            case GLOB_STAR:
+                star_ops = ++ops;
+                star_num_ops = --num_ops;
+                star_str = str;
+                continue;
+            case GLOB_OPT:
+                if ((c && match_glob_ops(ops + 1, num_ops - 1, str + 1)) ||
+                        match_glob_ops(ops + 1, num_ops - 1, str))
+                    return 1;
+                is_match = 0;
+                break;
+            case GLOB_SET:
+                is_match = c && (ops->set[c / 8] & (1 << (c % 8)));
+                break;
+            default:
+                is_match = c && c == ops->c;
+                break;
+            }
+
+            if (is_match) {
+                ++ops;
+                --num_ops;
+                ++str;
+                continue;
+            }
+        }
+
+        // Give the last star one more character, if there are any left
+        if (!star_ops || *star_str == 0)
+            return 0;
+        ops = star_ops;
+        num_ops = star_num_ops;
+        str = ++star_str;
+    }
+}
+
+/* Like in shells, names starting with a dot are only matched by wildcards
+   when the pattern starts with a dot too */
+static int glob_segment_matches_dot(const struct glob_segment *seg)
+{
+    return seg->literal ||
+        (seg->num_ops > 0 && seg->ops[0].kind == GLOB_CHAR && seg->ops[0].c == '.');
+}
+
+static int match_glob_segment(const struct glob_segment *seg, const char *name, size_t len)
+{
+    if (seg->literal)
+        return strlen(seg->literal) == len && memcmp(seg->literal, name, len) == 0;
+    if (len > 0 && name[0] == '.' && !glob_segment_matches_dot(seg))
+        return 0;
+
+    char buf[256];
+    char *str = len < sizeof(buf) ? buf : malloc(len + 1);
+    if (!str)
+        return 0;
+    memcpy(str, name, len);
+    str[len] = 0;
+
+    int res = match_glob_ops(seg->ops, seg->num_ops, str);
+    if (str != buf)
+        free(str);
+    return res;
+}
+
+/* Matches the components of path (from comp on) against the segments of alt
+   (from seg on) */
+static int match_glob_path(const struct glob_alt *alt, size_t seg, const char *comp)
+{
+    while (*comp == '/')
+        ++comp;
+
+    if (seg == alt->num_segments)
+        return *comp == 0;
+    if (*comp == 0)
+        return seg + 1 == alt->num_segments && alt->segments[seg].is_globstar;
+
+    const char *end = strchr(comp, '/');
+    size_t len = end ? (size_t) (end - comp) : strlen(comp);
+
+    if (alt->segments[seg].is_globstar) {
+        // Either ** ends here or it takes this component too (unless hidden)
+        return match_glob_path(alt, seg + 1, comp) ||
+            (comp[0] != '.' && match_glob_path(alt, seg, comp + len));
+    }
+
+    return match_glob_segment(&alt->segments[seg], comp, len) &&
+        match_glob_path(alt, seg + 1, comp + len);
+}
+
+struct glob_results
+{
+    char **paths;
+    size_t count;
+    size_t capacity;
+    int failed;
+};
+
+static char *join_glob_path(const char *dir, const char *name)
+{
+    size_t dir_len = strlen(dir);
+    int has_sep = dir_len > 0 && dir[dir_len - 1] != '/';
+    char *path = malloc(dir_len + has_sep + strlen(name) + 1);
+    if (path) {
+        strcpy(path, dir);
+        if (has_sep)
+            path[dir_len] = '/';
+        strcpy(path + dir_len + has_sep, name);
+    }
+
+    return path;
+}
+
+/* Takes path */
+static void add_glob_result(struct glob_results *res, char *path)
+{
+    if (res->count == res->capacity) {
+        size_t new_capacity = res->capacity ? res->capacity * 2 : 64;
+        char **new_paths = realloc(res->paths, new_capacity * sizeof(char *));
+        if (!new_paths) {
+            free(path);
+            res->failed = 1;
+            return;
+        }
+        res->paths = new_paths;
+        res->capacity = new_capacity;
+    }
+
+    res->paths[res->count++] = path;
+}
+
+/* Finds what matches segments seg onwards inside dir ("" for the current
+   directory). Unreadable directories are skipped, like shells do */
+static void walk_glob(const struct glob_alt *alt, size_t seg, const char *dir,
+    struct glob_results *res)
+{
+    const struct glob_segment *segment = &alt->segments[seg];
+    int is_last = seg + 1 == alt->num_segments;
+
+    if (res->failed)
+        return;
+
+    if (segment->literal) {
+        char *path = join_glob_path(dir, segment->literal);
+        if (!path) {
+            res->failed = 1;
+        } else if (is_last) {
+            if (native_exists(path))
+                add_glob_result(res, path);
+            else
+                free(path);
+        } else {
+            if (native_is_dir(path))
+                walk_glob(alt, seg + 1, path, res);
+            free(path);
+        }
+        return;
+    }
+
+    // ** may match no directory at all
+    if (segment->is_globstar && !is_last)
+        walk_glob(alt, seg + 1, dir, res);
+
+    struct native_dir *d = native_dir_open(dir[0] ? dir : ".");
+    if (!d)
+        return;
+
+    const char *name;
+    enum native_entry_type type;
+    while (!res->failed && native_dir_next(d, &name, &type) > 0) {
+        if (segment->is_globstar ? name[0] == '.' :
+                !match_glob_segment(segment, name, strlen(name)))
+            continue;
+
+        char *path = join_glob_path(dir, name);
+        if (!path) {
+            res->failed = 1;
+            break;
+        }
+
+        if (segment->is_globstar) {
+            // Links aren't followed by **, so there are no loops
+            if (type == NATIVE_ENTRY_DIR)
+                walk_glob(alt, seg, path, res);
+            if (is_last)
+                add_glob_result(res, path);
+            else
+                free(path);
+        } else if (is_last) {
+            add_glob_result(res, path);
+        } else {
+            if (type == NATIVE_ENTRY_DIR ||
+                    (type == NATIVE_ENTRY_SYMLINK && native_is_dir(path)))
+                walk_glob(alt, seg + 1, path, res);
+            free(path);
+        }
+    }
+
+    native_dir_close(d);
+}
+
+static int compare_glob_results(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int glob_gc(lua_State *L)
+{
+    free_glob(luaL_checkudata(L, 1, APOLO_GLOB_MT));
+    return 0;
+}
+
+/* Runs the glob, returning the sorted sequence of paths found */
+static int glob_call(lua_State *L)
+{
+    struct apolo_glob *glob = luaL_checkudata(L, 1, APOLO_GLOB_MT);
+    struct glob_results res = {NULL, 0, 0, 0};
+
+    for (size_t i = 0; i < glob->num_alts; ++i) {
+        const struct glob_alt *alt = &glob->alts[i];
+        if (alt->num_segments > 0)
+            walk_glob(alt, 0, alt->is_absolute ? "/" : "", &res);
+    }
+
+    if (res.count > 0)
+        qsort(res.paths, res.count, sizeof(char *), compare_glob_results);
+
+    // Alternatives may find the same paths
+    lua_createtable(L, res.count, 0);
+    lua_Integer n = 0;
+    for (size_t i = 0; i < res.count; ++i) {
+        if (!res.failed && (i == 0 || strcmp(res.paths[i], res.paths[i - 1]) != 0)) {
+            lua_pushstring(L, res.paths[i]);
+            lua_seti(L, -2, ++n);
+        }
+        free(res.paths[i]);
+    }
+    free(res.paths);
+
+    if (res.failed)
+        return luaL_error(L, "Not enough memory to glob");
+
+    return 1;
+}
+
+static int glob_matches(lua_State *L)
+{
+    check_argc(2);
+    struct apolo_glob *glob = luaL_checkudata(L, 1, APOLO_GLOB_MT);
+    check_arg_type(2, LUA_TSTRING);
+
+    const char *path = lua_tostring(L, 2);
+    for (size_t i = 0; i < glob->num_alts; ++i) {
+        const struct glob_alt *alt = &glob->alts[i];
+        if (alt->is_absolute == (path[0] == '/') && match_glob_path(alt, 0, path)) {
+            lua_pushboolean(L, 1);
+            return 1;
+        }
+    }
+
+    lua_pushboolean(L, 0);
+    return 1;
+}
+
+static const struct luaL_Reg apolo_glob_methods[] = {
+    {"matches", glob_matches},
+    {NULL, NULL}
+};
+
+static int apolocore_glob_compile(lua_State *L)
+{
+    check_argc(1);
+    check_arg_type(1, LUA_TSTRING);
+
+    struct apolo_glob *glob = lua_newuserdata(L, sizeof(struct apolo_glob));
+    glob->num_alts = 0;
+    glob->capacity = 0;
+    glob->alts = NULL;
+    luaL_setmetatable(L, APOLO_GLOB_MT);
+
+    switch (expand_glob_braces(lua_tostring(L, 1), glob)) {
+    case 0:
+        return luaL_error(L, "Not enough memory to compile the glob pattern");
+    case -1:
+        return luaL_error(L, "Too many alternatives in glob pattern");
+    default:
+        return 1;
+    }
+}
+
+static int apolocore_exists(lua_State *L)
+{
+    check_argc(1);
+    check_arg_type(1, LUA_TSTRING);
+
+    lua_pushboolean(L, native_exists(lua_tostring(L, 1)));
+    return 1;
+}
+
+static int apolocore_hash_clear(lua_State *L)
+{
+    check_argc(0);
+
+    native_hash_clear();
+    return 0;
+}
+
+static int push_job_status(lua_State *L, struct native_job_result res)
+{
+    switch (res.tag) {
+        case NATIVE_ERR_NOTFOUND: 
+            lua_pushnil(L);
+            lua_pushstring(L, "Process not found");
+            return 2;
+        case NATIVE_ERR_BACKGROUND_UNCHANGED:
+            lua_pushnil(L);
+            return 1;
+        case NATIVE_ERR_BACKGROUND_FINISHED:
+            lua_pushstring(L, "finished");
+            lua_pushnumber(L, res.exit_code);
+            return 2;
+        case NATIVE_ERR_BACKGROUND_SUSPENDED:
+            lua_pushstring(L, "suspended");
+            return 1;
+        case NATIVE_ERR_BACKGROUND_RESUMED:
+            lua_pushstring(L, "running");
+            return 1;
+        case NATIVE_ERR_BACKGROUND_FAILED:
+            lua_pushstring(L, "failed");
+            // Failed processes don't have exit codes
+            return 1;
+        default:
+            lua_pushnil(L);
+            lua_pushstring(L, "Unknown error (most likely a bug in apolo)");
+            return 2;
+    }
+}
+
+static int apolocore_job_status(lua_State *L)
+{
+    check_argc(2);
+    check_arg_type(1, LUA_TNUMBER);
+    check_arg_type(2, LUA_TBOOLEAN);
+
+    struct native_job_result res = native_job_status(lua_tonumber(L, 1), lua_toboolean(L, 2));
+
+    return push_job_status(L, res);
+}
+
+/* apolo.core.job_events(timeout_ms) -> {{pid=, status=, exit_code=}, ...}
+   Returns nil when no background jobs are left to wait for */
+static int apolocore_job_events(lua_State *L)
+{
+    check_argc(1);
+    check_arg_type(1, LUA_TNUMBER);
+
+    struct native_job_event events[64];
+    int num_events = native_job_events(lua_tointeger(L, 1), events, 64);
+
+    if (num_events < 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_createtable(L, num_events, 0);
+    for (int i = 0; i < num_events; ++i) {
+        lua_createtable(L, 0, 3);
+        lua_pushinteger(L, events[i].pid);
+        lua_setfield(L, -2, "pid");
+
+        // Pushes the status and, for finished jobs, the exit code
+        if (push_job_status(L, events[i].result) > 1)
+            lua_setfield(L, -3, "exit_code");
+        lua_setfield(L, -2, "status");
+
+        lua_seti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+static int apolocore_job_kill(lua_State *L)
+{
+    check_argc(2);
+    check_arg_type(1, LUA_TNUMBER);
+    check_arg_type(2, LUA_TBOOLEAN);
+    
+    struct native_job_result res = native_job_kill(lua_tonumber(L, 1), lua_toboolean(L, 2));
+
+    switch (res.tag) {
+    case NATIVE_ERR_NOTFOUND: 
+        lua_pushnil(L);
+        lua_pushstring(L, "Process not found");
+        return 2;
+    case NATIVE_ERR_PERMISSION: 
+        lua_pushnil(L);
+        lua_pushstring(L, "Process doesn't have the permission to kill that process. Make sure process was started by this program");
+        return 2;
+    case NATIVE_ERR_SUCCESS:
+        lua_pushboolean(L, 1);
+        return 1;
+    default:
+        lua_pushnil(L);
+        lua_pushstring(L, "Unknown error (most likely a bug in apolo)");
+
+        return 2;
+    }
+}
+
+static int apolocore_job_active(lua_State *L)
+{
+    check_argc(2);
+    check_arg_type(1, LUA_TNUMBER);
+    check_arg_type(2, LUA_TBOOLEAN);
+    
+    struct native_job_result res = native_job_set_active(lua_tonumber(L, 1), lua_toboolean(L, 2));
+
+    switch (res.tag) {
+        case NATIVE_ERR_NOTFOUND: 
+            lua_pushnil(L);
+            lua_pushstring(L, "Process not found");
+            return 2;
+        case NATIVE_ERR_PERMISSION:
+            lua_pushnil(L);
+            lua_pushstring(L, "Process doesn't have the permission to change that process. Make sure process was started by this program");
+            return 2;
+        case NATIVE_ERR_SUCCESS:
+            lua_pushboolean(L, 1);
+            return 1;
+        default:
+            lua_pushnil(L);
+            lua_pushstring(L, "Unknown error (most likely a bug in apolo)");
+
+            return 2;
+    }
+}
+
+// To be called inside of native_fillentryarray
+#define APOLO_MAP_MT "apolo.map"
+
+/* Read-only view of a mapped file; only the parts asked for become strings */
+struct apolo_map
+{
+    const char *data;
+    size_t len;
+    int is_mapped;
+};
+
+static struct apolo_map *check_map(lua_State *L)
+{
+    struct apolo_map *map = luaL_checkudata(L, 1, APOLO_MAP_MT);
+    if (!map->is_mapped)
+        luaL_error(L, "Map was already closed");
+
+    return map;
+}
+
+/* Like in string.sub, negative positions count from the end */
+static size_t map_pos(lua_Integer pos, size_t len)
+{
+    if (pos >= 0)
+        return pos;
+    if ((size_t) -pos > len)
+        return 0;
+
+    return len + pos + 1;
+}
+
+static int map_gc(lua_State *L)
+{
+    struct apolo_map *map = luaL_checkudata(L, 1, APOLO_MAP_MT);
+    if (map->is_mapped) {
+        native_unmap_file(map->data, map->len);
+        map->is_mapped = 0;
+    }
+
+    return 0;
+}
+
+static int map_len(lua_State *L)
+{
+    lua_pushinteger(L, check_map(L)->len);
+    return 1;
+}
+
+static int map_sub(lua_State *L)
+{
+    struct apolo_map *map = check_map(L);
+    size_t start = map_pos(luaL_optinteger(L, 2, 1), map->len);
+    size_t end = map_pos(luaL_optinteger(L, 3, -1), map->len);
+
+    if (start < 1)
+        start = 1;
+    if (end > map->len)
+        end = map->len;
+
+    if (start > end)
+        lua_pushliteral(L, "");
+    else
+        lua_pushlstring(L, map->data + start - 1, end - start + 1);
+
+    return 1;
+}
+
+/* Plain text only; there's no way to run Lua patterns over the map without
+   copying it into a string */
+static int map_find(lua_State *L)
+{
+    struct apolo_map *map = check_map(L);
+    size_t needle_len;
+    const char *needle = luaL_checklstring(L, 2, &needle_len);
+    size_t init = map_pos(luaL_optinteger(L, 3, 1), map->len);
+
+    if (init < 1)
+        init = 1;
+    if (init > map->len + 1 || needle_len > map->len - (init - 1)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    const char *p = map->data + init - 1;
+    const char *last = map->data + map->len - needle_len;
+    for (; p <= last; ++p) {
+        if (needle_len > 0) {
+            p = memchr(p, needle[0], last - p + 1);
+            if (!p)
+                break;
+        }
+
+        if (memcmp(p, needle, needle_len) == 0) {
+            lua_pushinteger(L, p - map->data + 1);
+            lua_pushinteger(L, p - map->data + needle_len);
+            return 2;
+        }
+    }
+
+    lua_pushnil(L);
+    return 1;
+}
+
+/* Upvalues: the map and the offset of the next line */
+static int map_lines_next(lua_State *L)
+{
+    struct apolo_map *map = lua_touserdata(L, lua_upvalueindex(1));
+    size_t pos = lua_tointeger(L, lua_upvalueindex(2));
+
+    if (!map->is_mapped)
+        return luaL_error(L, "Map was already closed");
+    if (pos >= map->len)
+        return 0;
+
+    const char *line = map->data + pos;
+    const char *newline = memchr(line, '\n', map->len - pos);
+    size_t line_len = newline ? (size_t) (newline - line) : map->len - pos;
+
+    lua_pushinteger(L, pos + line_len + 1);
+    lua_replace(L, lua_upvalueindex(2));
+
+    lua_pushlstring(L, line, line_len);
+    return 1;
+}
+
+static int map_lines(lua_State *L)
+{
+    check_map(L);
+
+    lua_settop(L, 1);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, map_lines_next, 2);
+    return 1;
+}
+
+static const struct luaL_Reg apolo_map_methods[] = {
+    {"close", map_gc},
+    {"find", map_find},
+    {"lines", map_lines},
+    {"sub", map_sub},
+    {NULL, NULL}
+};
+
+static int apolocore_map(lua_State *L)
+{
+    check_argc(1);
+    check_arg_type(1, LUA_TSTRING);
+
+    struct apolo_map *map = lua_newuserdata(L, sizeof(struct apolo_map));
+    map->is_mapped = 0;
+    luaL_setmetatable(L, APOLO_MAP_MT);
+
+    map->data = native_map_file(lua_tostring(L, 1), &map->len);
+    if (!map->data) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not map file %s: %s", lua_tostring(L, 1), strerror(errno));
+        return 2;
+    }
+
+    map->is_mapped = 1;
+    return 1;
+}
+
+static int apolocore_mkdir(lua_State *L)
+{
+    check_argc(1);
+    check_arg_type(1, LUA_TSTRING);
+
+    // return native_mkdir's return
+    lua_pushboolean(L, native_mkdir(lua_tostring(L, 1)));
+    return 1;
+}
+
+static int apolocore_move(lua_State *L)
+{
+    check_argc(2);
+    check_arg_type(1, LUA_TSTRING);
+    check_arg_type(2, LUA_TSTRING);
+    
+    lua_pushboolean(
+        L,
+        native_move(
+            lua_tostring(L, 1),
+            lua_tostring(L, 2)));
+    return 1;
+}
+
+/* Moves every src = dest pair of the table; the ones that fail are returned
+   with the reason, but don't stop the others */
+static int apolocore_move_many(lua_State *L)
+{
+    check_argc(1);
+    check_arg_type(1, LUA_TTABLE);
+
+    int all_ok = 1;
+    lua_newtable(L);
+
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING)
+            return luaL_error(L, "Expecting only strings as origins and destinations");
+
+        errno = 0;
+        if (!native_move(lua_tostring(L, -2), lua_tostring(L, -1))) {
+            all_ok = 0;
+            lua_pushvalue(L, -2);
+            lua_pushstring(L, errno ? strerror(errno) : "Could not move");
+            lua_settable(L, -5);
+        }
+        lua_pop(L, 1);
+    }
+
+    if (all_ok) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    lua_pushboolean(L, 0);
+    lua_insert(L, -2);
+    return 2;
+}
+
+/* Either a file opened by the io library or a path, which is opened here (and
+   has to be closed by the caller) */
+static FILE *pump_arg_file(lua_State *L, int arg, const char *mode, int *is_opened)
+{
+    *is_opened = 0;
+    if (lua_type(L, arg) == LUA_TSTRING) {
+        *is_opened = 1;
+        return fopen(lua_tostring(L, arg), mode);
+    }
+
+    luaL_Stream *stream = luaL_checkudata(L, arg, LUA_FILEHANDLE);
+    if (!stream->closef)
+        luaL_argerror(L, arg, "attempt to use a closed file");
+
+    return stream->f;
+}
+
+static int apolocore_pump(lua_State *L)
+{
+    check_argc(2);
+
+    int is_src_opened, is_dst_opened;
+    FILE *src = pump_arg_file(L, 1, "rb", &is_src_opened);
+    if (!src) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not open file: %s", lua_tostring(L, 1));
+        return 2;
+    }
+
+    FILE *dst = pump_arg_file(L, 2, "wb", &is_dst_opened);
+    if (!dst) {
+        if (is_src_opened)
+            fclose(src);
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not open file: %s", lua_tostring(L, 2));
+        return 2;
+    }
+
+    long long num_bytes = native_pump(src, dst);
+
+    if (is_src_opened)
+        fclose(src);
+    if (is_dst_opened && fclose(dst) != 0)
+        num_bytes = -1;
+
+    if (num_bytes < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Could not copy the data");
+        return 2;
+    }
+
+    lua_pushinteger(L, num_bytes);
+    return 1;
+}
+
+static int apolocore_rmdir(lua_State *L)
+{
+    check_argc(1);
+    check_arg_type(1, LUA_TSTRING);
+
+    lua_pushboolean(L, native_rmdir(lua_tostring(L, 1)));
+    return 1;
+}
+
+/* Arguments: path or sequence of paths, sequence of field names (or false
+   for all of them) and whether to follow links. Paths that don't exist get
+   false; a sequence gets back a table from each path to its fields */
+static int apolocore_stat(lua_State *L)
+{
+    check_argc(3);
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        check_arg_type(1, LUA_TSTRING);
+    }
+    if (lua_toboolean(L, 2)) {
+        check_arg_type(2, LUA_TTABLE);
+    }
+    check_arg_type(3, LUA_TBOOLEAN);
+
+    unsigned fields = stat_fields_arg(L, 2);
+    int follow_links = lua_toboolean(L, 3);
+    int is_list = lua_type(L, 1) == LUA_TTABLE;
+    lua_Integer len = is_list ? luaL_len(L, 1) : 1;
+
+    if (is_list)
+        lua_createtable(L, 0, len);
+
+    for (lua_Integer i = 1; i <= len; ++i) {
+        if (is_list)
+            lua_geti(L, 1, i);
+        else
+            lua_pushvalue(L, 1);
+
+        const char *path = lua_tostring(L, -1);
+        if (!path)
+            return luaL_error(L, "Expecting a sequence of paths");
+
+        struct native_stat st;
+        switch (native_stat(path, fields, follow_links, &st)) {
+        case 1:
+            push_stat(L, &st);
+            break;
+        case 0:
+            lua_pushboolean(L, 0);
+            break;
+        default: {
+            int error = errno;
+            lua_pushnil(L);
+            lua_pushfstring(L, "Could not stat %s: %s", path, strerror(error));
+            return 2;
+        }
+        }
+
+        if (!is_list)
+            return 1;
+        lua_settable(L, -3);
+    }
+
+    return 1;
+}
+
+#define APOLO_PREFETCH_MT "apolo.prefetch"
+
+struct apolo_prefetch
+{
+    struct native_prefetch *prefetch;
+};
+
+static int prefetch_gc(lua_State *L)
+{
+    struct apolo_prefetch *p = luaL_checkudata(L, 1, APOLO_PREFETCH_MT);
+    if (p->prefetch) {
+        native_prefetch_close(p->prefetch);
+        p->prefetch = NULL;
+    }
+
+    return 0;
+}
+
+/* Arguments: sequence of files to be read into the page cache */
+static int apolocore_prefetch(lua_State *L)
+{
+    check_argc(1);
+    check_arg_type(1, LUA_TTABLE);
+
+    lua_Integer len = luaL_len(L, 1);
+    const char **paths = lua_newuserdata(L, (len + 1) * sizeof(const char *));
+    for (lua_Integer i = 1; i <= len; ++i) {
+        // Only strings are kept alive by the table; converted numbers aren't
+        if (lua_geti(L, 1, i) != LUA_TSTRING)
+            return luaL_error(L, "Expecting a sequence of paths");
+        paths[i - 1] = lua_tostring(L, -1);
+        lua_pop(L, 1);
+    }
+
+    struct apolo_prefetch *p = lua_newuserdata(L, sizeof(struct apolo_prefetch));
+    p->prefetch = NULL;
+    luaL_setmetatable(L, APOLO_PREFETCH_MT);
+
+    p->prefetch = native_prefetch_start(paths, len);
+    if (!p->prefetch) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not start prefetching: %s", strerror(errno));
+        return 2;
+    }
+
+    return 1;
+}
+
+/* Arguments: the prefetch and the timeout (in milliseconds). Returns the
+   number of bytes read, or nil on timeout */
+static int apolocore_prefetch_wait(lua_State *L)
+{
+    check_argc(2);
+    check_arg_type(2, LUA_TNUMBER);
+
+    struct apolo_prefetch *p = luaL_checkudata(L, 1, APOLO_PREFETCH_MT);
+    if (!p->prefetch)
+        return luaL_error(L, "Prefetch was already closed");
+
+    long long bytes;
+    if (!native_prefetch_wait(p->prefetch, lua_tointeger(L, 2), &bytes)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushinteger(L, bytes);
+    return 1;
+}
+
+#define APOLO_WATCH_MT "apolo.watch"
+
+struct apolo_watch
+{
+    struct native_watch *watch;
+};
+
+static int watch_gc(lua_State *L)
+{
+    struct apolo_watch *w = luaL_checkudata(L, 1, APOLO_WATCH_MT);
+    if (w->watch) {
+        native_watch_close(w->watch);
+        w->watch = NULL;
+    }
+
+    return 0;
+}
+
+/* Arguments: sequence of paths and whether to watch directories recursively */
+static int apolocore_watch(lua_State *L)
+{
+    check_argc(2);
+    check_arg_type(1, LUA_TTABLE);
+    check_arg_type(2, LUA_TBOOLEAN);
+
+    struct apolo_watch *w = lua_newuserdata(L, sizeof(struct apolo_watch));
+    w->watch = NULL;
+    luaL_setmetatable(L, APOLO_WATCH_MT);
+
+    w->watch = native_watch_open();
+    if (!w->watch) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not watch files: %s", strerror(errno));
+        return 2;
+    }
+
+    lua_Integer len = luaL_len(L, 1);
+    for (lua_Integer i = 1; i <= len; ++i) {
+        lua_geti(L, 1, i);
+        const char *path = lua_tostring(L, -1);
+        if (!path)
+            return luaL_error(L, "Expecting a sequence of paths");
+
+        if (!native_watch_add(w->watch, path, lua_toboolean(L, 2))) {
+            int error = errno;
+            native_watch_close(w->watch);
+            w->watch = NULL;
+
+            lua_pushnil(L);
+            lua_pushfstring(L, "Could not watch %s: %s", path, strerror(error));
+            return 2;
+        }
+        lua_pop(L, 1);
+    }
+
+    return 1;
+}
+
+/* Arguments: the watch, the timeout and the debounce time (in milliseconds)
+   and whether background jobs should wake it up. Returns the changed paths
+   (each once), false if a job changed first or nil on timeout */
+static int apolocore_watch_wait(lua_State *L)
+{
+    check_argc(4);
+    check_arg_type(2, LUA_TNUMBER);
+    check_arg_type(3, LUA_TNUMBER);
+    check_arg_type(4, LUA_TBOOLEAN);
+
+    struct apolo_watch *w = luaL_checkudata(L, 1, APOLO_WATCH_MT);
+    if (!w->watch)
+        return luaL_error(L, "Watch was already closed");
+
+    switch (native_watch_wait(w->watch, lua_tointeger(L, 2), lua_tointeger(L, 3),
+            lua_toboolean(L, 4))) {
+    case NATIVE_WATCH_TIMEOUT:
+        lua_pushnil(L);
+        return 1;
+    case NATIVE_WATCH_JOBS:
+        lua_pushboolean(L, 0);
+        return 1;
+    case NATIVE_WATCH_ERROR:
+        return luaL_error(L, "Could not wait for changes: %s", strerror(errno));
+    default:
+        break;
+    }
+
+    // A burst repeats the same paths a lot; the set keeps only the first one
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_Integer len = 0;
+    const char *path;
+    for (size_t i = 0; (path = native_watch_changed(w->watch, i)); ++i) {
+        if (lua_getfield(L, -1, path) != LUA_TNIL) {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_pop(L, 1);
+
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, path);
+        lua_pushstring(L, path);
+        lua_seti(L, -3, ++len);
+    }
+    lua_pop(L, 1);
+
+    return 1;
+}
+
+static int apolocore_which(lua_State *L)
+{
+    check_argc(1);
+    check_arg_type(1, LUA_TSTRING);
+
+    const char *path = native_which(lua_tostring(L, 1));
+    if (!path) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushstring(L, path);
+    return 1;
+}
+
+/* 0 on failure, with errno set */
+static int write_whole_file(const char *path, const char *content, size_t len,
+    int is_append, int is_atomic)
+{
+    struct native_out_file *f = native_out_open(path, is_append, is_atomic);
+    if (!f)
+        return 0;
+
+    int ok = native_out_write(f, content, len);
+    int error = errno;
+    ok = native_out_close(f, ok) && ok;
+    if (!ok && error)
+        errno = error;
+
+    return ok;
+}
+
+/* Arguments: path, content, append and atomic */
+static int apolocore_writef(lua_State *L)
+{
+    check_argc(4);
+    check_arg_type(1, LUA_TSTRING);
+    check_arg_type(2, LUA_TSTRING);
+    check_arg_type(3, LUA_TBOOLEAN);
+    check_arg_type(4, LUA_TBOOLEAN);
+
+    size_t len;
+    const char *content = lua_tolstring(L, 2, &len);
+    if (!write_whole_file(lua_tostring(L, 1), content, len, lua_toboolean(L, 3),
+            lua_toboolean(L, 4))) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not write to file: %s", strerror(errno));
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Arguments: table from paths to contents and atomic. Returns true, or false
+   and a table from the paths that failed to their errors */
+static int apolocore_writef_many(lua_State *L)
+{
+    check_argc(2);
+    check_arg_type(1, LUA_TTABLE);
+    check_arg_type(2, LUA_TBOOLEAN);
+
+    int all_ok = 1;
+    lua_newtable(L);
+
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING)
+            return luaL_error(L, "Expecting only strings as files and contents");
+
+        size_t len;
+        const char *content = lua_tolstring(L, -1, &len);
+        errno = 0;
+        if (!write_whole_file(lua_tostring(L, -2), content, len, 0, lua_toboolean(L, 2))) {
+            all_ok = 0;
+            lua_pushvalue(L, -2);
+            lua_pushstring(L, errno ? strerror(errno) : "Could not write");
+            lua_settable(L, -5);
+        }
+        lua_pop(L, 1);
+    }
+
+    if (all_ok) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    lua_pushboolean(L, 0);
+    lua_insert(L, -2);
+    return 2;
+}
+
+#define APOLO_WRITER_MT "apolo.writer"
+
+/* Writes are gathered in buf and only reach the file when it's full (or when
+   flushed), unless they're bigger than it */
+struct apolo_writer
+{
+    struct native_out_file *file;
+    int is_atomic;
+    size_t len;
+    size_t cap;
+    char buf[];
+};
+
+static struct apolo_writer *check_writer(lua_State *L)
+{
+    struct apolo_writer *w = luaL_checkudata(L, 1, APOLO_WRITER_MT);
+    if (!w->file)
+        luaL_error(L, "Writer was already closed");
+
+    return w;
+}
+
+static int writer_flush_buf(struct apolo_writer *w)
+{
+    int ok = w->len == 0 || native_out_write(w->file, w->buf, w->len);
+    w->len = 0;
+
+    return ok;
+}
+
+static int push_writer_error(lua_State *L)
+{
+    int error = errno;
+    lua_pushnil(L);
+    lua_pushfstring(L, "Could not write to file: %s", strerror(error));
+    return 2;
+}
+
+/* Like file:write, takes strings and numbers and returns the writer */
+static int writer_write(lua_State *L)
+{
+    struct apolo_writer *w = check_writer(L);
+    int n = lua_gettop(L);
+
+    for (int i = 2; i <= n; ++i) {
+        size_t len;
+        const char *data = luaL_checklstring(L, i, &len);
+
+        if (w->len + len > w->cap && !writer_flush_buf(w))
+            return push_writer_error(L);
+
+        if (len >= w->cap) {
+            if (!native_out_write(w->file, data, len))
+                return push_writer_error(L);
+        } else {
+            memcpy(w->buf + w->len, data, len);
+            w->len += len;
+        }
+    }
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int writer_flush(lua_State *L)
+{
+    struct apolo_writer *w = check_writer(L);
+    if (!writer_flush_buf(w))
+        return push_writer_error(L);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Atomic writers only replace the file here */
+static int writer_close(lua_State *L)
+{
+    struct apolo_writer *w = check_writer(L);
+    int ok = writer_flush_buf(w);
+    ok = native_out_close(w->file, ok) && ok;
+    w->file = NULL;
+
+    if (!ok)
+        return push_writer_error(L);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Writers that were never closed keep what was written, except for atomic
+   ones, which may have been left halfway on purpose (like by an error) */
+static int writer_gc(lua_State *L)
+{
+    struct apolo_writer *w = luaL_checkudata(L, 1, APOLO_WRITER_MT);
+    if (w->file) {
+        int ok = w->is_atomic || writer_flush_buf(w);
+        native_out_close(w->file, ok && !w->is_atomic);
+        w->file = NULL;
+    }
+
+    return 0;
+}
+
+static const struct luaL_Reg apolo_writer_methods[] = {
+    {"close", writer_close},
+    {"flush", writer_flush},
+    {"write", writer_write},
+    {NULL, NULL}
+};
+
+/* Arguments: path, append, atomic and buffer size */
+static int apolocore_writer(lua_State *L)
+{
+    check_argc(4);
+    check_arg_type(1, LUA_TSTRING);
+    check_arg_type(2, LUA_TBOOLEAN);
+    check_arg_type(3, LUA_TBOOLEAN);
+    check_arg_type(4, LUA_TNUMBER);
+
+    lua_Integer cap = lua_tointeger(L, 4);
+    if (cap < 0)
+        return luaL_error(L, "Buffer size can't be negative");
+
+    struct apolo_writer *w = lua_newuserdata(L, sizeof(struct apolo_writer) + cap);
+    w->file = NULL;
+    w->is_atomic = lua_toboolean(L, 3);
+    w->len = 0;
+    w->cap = cap;
+    luaL_setmetatable(L, APOLO_WRITER_MT);
+
+    w->file = native_out_open(lua_tostring(L, 1), lua_toboolean(L, 2), w->is_atomic);
+    if (!w->file) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Could not open file %s: %s", lua_tostring(L, 1), strerror(errno));
+        return 2;
+    }
+
+    return 1;
+}
+
+/* Environment merged with the parent's once, to be reused by many commands.
+   The pointers and the strings live in the userdata itself */
+struct apolo_envblock
+{
+    size_t count;
+    const char *strings[];
+};
+
+#define APOLO_ENVBLOCK_MT "apolo.envblock"
+
+/* Length of the name in a name=value string */
+static size_t env_name_len(const char *envstring)
+{
+    const char *eq = strchr(envstring, '=');
+
+    return eq ? (size_t) (eq - envstring) : strlen(envstring);
+}
+
+/* apolo.core.envblock(vars) -> envblock
+   vars maps names to values; they take the place of the parent's variables
+   with the same name */
+static int apolocore_envblock(lua_State *L)
+{
+    check_argc(1);
+    check_arg_type(1, LUA_TTABLE);
+
+    const char **parent_env = native_parent_env();
+    size_t count = 0;
+    size_t num_bytes = 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING)
+            return luaL_error(L, "Environment variables and values must be strings");
+
+        num_bytes += lua_rawlen(L, -2) + lua_rawlen(L, -1) + 2;
+        ++count;
+        lua_pop(L, 1);
+    }
+
+    for (const char **env = parent_env; env && *env; ++env) {
+        lua_pushlstring(L, *env, env_name_len(*env));
+        if (lua_rawget(L, 1) == LUA_TNIL) {
+            num_bytes += strlen(*env) + 1;
+            ++count;
+        }
+        lua_pop(L, 1);
+    }
+
+    size_t pointers_size = sizeof(struct apolo_envblock) + (count + 1) * sizeof(const char *);
+    struct apolo_envblock *block = lua_newuserdata(L, pointers_size + num_bytes);
+    char *cur = (char *) block + pointers_size;
+    size_t i = 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        size_t name_len, value_len;
+        const char *name = lua_tolstring(L, -2, &name_len);
+        const char *value = lua_tolstring(L, -1, &value_len);
+
+        block->strings[i++] = cur;
+        memcpy(cur, name, name_len);
+        cur[name_len] = '=';
+        memcpy(cur + name_len + 1, value, value_len + 1);
+        cur += name_len + value_len + 2;
+
+        lua_pop(L, 1);
+    }
+
+    for (const char **env = parent_env; env && *env; ++env) {
+        lua_pushlstring(L, *env, env_name_len(*env));
+        if (lua_rawget(L, 1) == LUA_TNIL) {
+            size_t len = strlen(*env) + 1;
+
+            block->strings[i++] = cur;
+            memcpy(cur, *env, len);
+            cur += len;
+        }
+        lua_pop(L, 1);
+    }
+
+    block->strings[i] = NULL;
+    block->count = i;
+
+    luaL_setmetatable(L, APOLO_ENVBLOCK_MT);
+    return 1;
+}
+
+static int envblock_len(lua_State *L)
+{
+    struct apolo_envblock *block = luaL_checkudata(L, 1, APOLO_ENVBLOCK_MT);
+
+    lua_pushinteger(L, block->count);
+    return 1;
+}
+
+/* Everything a call to execute needs besides the strings themselves, which
+   are kept alive by the tables on the Lua stack: the argv of each stage and
+   the pids and exit codes of the stages. It's sized from the tables and
+   allocated all at once, as a userdata so errors raised while it's filled
+   don't leak it. The environment is used as is: either an envblock or the parent's */
+struct exec_arena
+{
+    const char ***argvs;
+    const char **envstrings;
+    int *stage_pids;
+    int *stage_codes;
+};
+
+/* Strings from a sequence; values that aren't strings are converted and
+   kept in the table at keep_index so they outlive the call */
+static const char **seq_to_strarray(lua_State *L, int index, const char **strarray,
+    int keep_index)
+{
+    index = lua_absindex(L, index);
+    lua_Integer len = luaL_len(L, index);
+
+    for (lua_Integer i = 1; i <= len; ++i) {
+        lua_geti(L, index, i);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            luaL_tolstring(L, -1, NULL);
+            lua_pushvalue(L, -1);
+            lua_seti(L, keep_index, luaL_len(L, keep_index) + 1);
+            lua_remove(L, -2);
+        }
+
+        *strarray++ = lua_tostring(L, -1);
+        lua_pop(L, 1);
+    }
+
+    // Sentinel indicating the end of the array
+    *strarray++ = NULL;
+    return strarray;
+}
+
+/* Pushes the memory of the arena and the table with the converted strings;
+   returns the index of the former */
+static int make_exec_arena(lua_State *L, int commands_index, int env_index, int len,
+    struct exec_arena *arena)
+{
+    size_t num_strings = 0;
+
+    for (int i = 1; i <= len; ++i) {
+        lua_geti(L, commands_index, i);
+        luaL_checktype(L, -1, LUA_TTABLE);
+        num_strings += luaL_len(L, -1) + 1;
+        lua_pop(L, 1);
+    }
+
+    // Pointers go first so the pids and codes stay aligned
+    char *mem = lua_newuserdata(L, len * sizeof(const char **)
+        + num_strings * sizeof(const char *) + 2 * len * sizeof(int));
+    int mem_index = lua_gettop(L);
 
-    native_curdir(dir);
-    lua_pushstring(L, dir);
-    return 1;
+    arena->argvs = (const char ***) mem;
+    const char **strings = (const char **) (arena->argvs + len);
+
+    lua_newtable(L);
+    int keep_index = lua_gettop(L);
+
+    for (int i = 0; i < len; ++i) {
+        lua_geti(L, commands_index, i + 1);
+        arena->argvs[i] = strings;
+        strings = seq_to_strarray(L, -1, strings, keep_index);
+        lua_pop(L, 1);
+    }
+
+    struct apolo_envblock *block = luaL_testudata(L, env_index, APOLO_ENVBLOCK_MT);
+    arena->envstrings = block ? block->strings : native_parent_env();
+
+    arena->stage_pids = (int *) strings;
+    arena->stage_codes = arena->stage_pids + len;
+
+    return mem_index;
 }
 
-static int apolocore_exists(lua_State *L)
+/* Output of a running eval, read as it's produced */
+struct apolo_stream
 {
-    check_argc(1);
-    check_arg_type(1, LUA_TSTRING);
+    struct native_run_result proc;
+    char *buf;
+    size_t start;
+    size_t len;
+    size_t capacity;
+    size_t chunk_size;  /* 0 means the stream is read by lines */
+    int is_eof;
+    int is_closed;
+};
 
-    lua_pushboolean(L, native_exists(lua_tostring(L, 1)));
-    return 1;
+#define APOLO_STREAM_MT "apolo.stream"
+
+/* The arena at arena_index holds the stage pids, so it's kept alive as the
+   user value of the stream */
+static void push_stream(lua_State *L, struct native_run_result proc, lua_Integer chunk_size,
+    int arena_index)
+{
+    struct apolo_stream *s = lua_newuserdata(L, sizeof(struct apolo_stream));
+    s->proc = proc;
+    s->buf = NULL;
+    s->start = 0;
+    s->len = 0;
+    s->capacity = 0;
+    s->chunk_size = chunk_size > 0 ? (size_t) chunk_size : 0;
+    s->is_eof = 0;
+    s->is_closed = 0;
+
+    luaL_setmetatable(L, APOLO_STREAM_MT);
+    lua_pushvalue(L, arena_index);
+    lua_setuservalue(L, -2);
 }
 
-static int apolocore_job_status(lua_State *L)
+static void stream_finish(struct apolo_stream *s, int is_wait)
 {
-    check_argc(2);
-    check_arg_type(1, LUA_TNUMBER);
-    check_arg_type(2, LUA_TBOOLEAN);
+    if (s->is_closed)
+        return;
 
-    struct native_job_result res = native_job_status(lua_tonumber(L, 1), lua_toboolean(L, 2));
+    s->proc = native_stream_close(s->proc, is_wait);
+    s->is_closed = 1;
+    s->is_eof = 1;
 
-    switch (res.tag) {
-        case NATIVE_ERR_NOTFOUND: 
-            lua_pushnil(L);
-            lua_pushstring(L, "Process not found");
-            return 2;
-        case NATIVE_ERR_BACKGROUND_UNCHANGED:
-            lua_pushnil(L);
-            return 1;
-        case NATIVE_ERR_BACKGROUND_FINISHED:
-            lua_pushstring(L, "finished");
-            lua_pushnumber(L, res.exit_code);
-            return 2;
-        case NATIVE_ERR_BACKGROUND_SUSPENDED:
-            lua_pushstring(L, "suspended");
-            return 1;
-        case NATIVE_ERR_BACKGROUND_RESUMED:
-            lua_pushstring(L, "running");
-            return 1;
-        case NATIVE_ERR_BACKGROUND_FAILED:
-            lua_pushstring(L, "failed");
-            // Failed processes don't have exit codes
-            return 1;
-        default:
-            lua_pushnil(L);
-            lua_pushstring(L, "Unknown error (most likely a bug in apolo)");
-            return 2;
-    }
+    free(s->buf);
+    s->buf = NULL;
+    s->start = s->len = s->capacity = 0;
 }
 
-static int apolocore_job_kill(lua_State *L)
+/* Append whatever the pipe has to the buffer, which only grows when a single
+   line doesn't fit in it. Returns 0 at EOF */
+static int stream_fill(lua_State *L, struct apolo_stream *s)
 {
-    check_argc(2);
-    check_arg_type(1, LUA_TNUMBER);
-    check_arg_type(2, LUA_TBOOLEAN);
-    
-    struct native_job_result res = native_job_kill(lua_tonumber(L, 1), lua_toboolean(L, 2));
+    if (s->start > 0) {
+        memmove(s->buf, s->buf + s->start, s->len - s->start);
+        s->len -= s->start;
+        s->start = 0;
+    }
 
-    switch (res.tag) {
-    case NATIVE_ERR_NOTFOUND: 
-        lua_pushnil(L);
-        lua_pushstring(L, "Process not found");
-        return 2;
-    case NATIVE_ERR_PERMISSION: 
-        lua_pushnil(L);
-        lua_pushstring(L, "Process doesn't have the permission to kill that process. Make sure process was started by this program");
-        return 2;
-    case NATIVE_ERR_SUCCESS:
-        lua_pushboolean(L, 1);
-        return 1;
-    default:
-        lua_pushnil(L);
-        lua_pushstring(L, "Unknown error (most likely a bug in apolo)");
+    if (s->len == s->capacity) {
+        size_t new_capacity = s->capacity ? s->capacity * 2 : LUAL_BUFFERSIZE;
+        char *new_buf = realloc(s->buf, new_capacity);
+        if (!new_buf)
+            return luaL_error(L, "Not enough memory for the eval stream");
 
-        return 2;
+        s->buf = new_buf;
+        s->capacity = new_capacity;
+    }
+
+    long num_bytes = native_stream_read(&s->proc, s->buf + s->len, s->capacity - s->len);
+    if (num_bytes < 0)
+        return luaL_error(L, "Failed to read from the eval stream");
+
+    if (num_bytes == 0) {
+        s->is_eof = 1;
+        return 0;
     }
+
+    s->len += num_bytes;
+    return 1;
 }
 
-static int apolocore_job_active(lua_State *L)
+static int stream_line(lua_State *L)
 {
-    check_argc(2);
-    check_arg_type(1, LUA_TNUMBER);
-    check_arg_type(2, LUA_TBOOLEAN);
-    
-    struct native_job_result res = native_job_set_active(lua_tonumber(L, 1), lua_toboolean(L, 2));
+    struct apolo_stream *s = luaL_checkudata(L, 1, APOLO_STREAM_MT);
 
-    switch (res.tag) {
-        case NATIVE_ERR_NOTFOUND: 
-            lua_pushnil(L);
-            lua_pushstring(L, "Process not found");
-            return 2;
-        case NATIVE_ERR_PERMISSION:
-            lua_pushnil(L);
-            lua_pushstring(L, "Process doesn't have the permission to change that process. Make sure process was started by this program");
-            return 2;
-        case NATIVE_ERR_SUCCESS:
-            lua_pushboolean(L, 1);
+    while (!s->is_closed) {
+        char *line = s->buf + s->start;
+        char *newline = s->len > s->start ? memchr(line, '\n', s->len - s->start) : NULL;
+
+        if (newline) {
+            lua_pushlstring(L, line, newline - line);
+            s->start += newline - line + 1;
             return 1;
-        default:
-            lua_pushnil(L);
-            lua_pushstring(L, "Unknown error (most likely a bug in apolo)");
+        }
 
-            return 2;
+        // The last line may not end in a newline
+        if (s->is_eof) {
+            if (s->start < s->len) {
+                lua_pushlstring(L, line, s->len - s->start);
+                s->start = s->len;
+                return 1;
+            }
+
+            stream_finish(s, 1);
+            break;
+        }
+
+        stream_fill(L, s);
     }
+
+    lua_pushnil(L);
+    return 1;
 }
 
-// To be called inside of native_fillentryarray
-void insert_direntry(lua_State *L, int index, const char *dirname, const char *type)
+static int stream_chunk(lua_State *L)
 {
-    lua_pushnumber(L, index);
+    struct apolo_stream *s = luaL_checkudata(L, 1, APOLO_STREAM_MT);
+    size_t size = (size_t) luaL_optinteger(L, 2, s->chunk_size ? s->chunk_size : LUAL_BUFFERSIZE);
+    luaL_argcheck(L, size > 0, 2, "chunk size must be positive");
+
+    // Data left over from reading lines goes first
+    if (s->start < s->len) {
+        size_t available = s->len - s->start;
+        if (size > available)
+            size = available;
+
+        lua_pushlstring(L, s->buf + s->start, size);
+        s->start += size;
+        return 1;
+    }
 
-    lua_createtable(L, 0, 2);
+    if (!s->is_closed && !s->is_eof) {
+        luaL_Buffer b;
+        char *chunk = luaL_buffinitsize(L, &b, size);
+        long num_bytes = native_stream_read(&s->proc, chunk, size);
 
-    lua_pushstring(L, "name");
-    lua_pushstring(L, dirname);
-    lua_settable(L, -3);
+        if (num_bytes < 0)
+            return luaL_error(L, "Failed to read from the eval stream");
 
-    lua_pushstring(L, "type");
-    lua_pushstring(L, type);
-    lua_settable(L, -3);
+        if (num_bytes > 0) {
+            luaL_pushresultsize(&b, num_bytes);
+            return 1;
+        }
 
-    lua_settable(L, -3);
+        s->is_eof = 1;
+    }
+
+    stream_finish(s, 1);
+    lua_pushnil(L);
+    return 1;
 }
 
-static int apolocore_listdirentries(lua_State *L)
+static int stream_close(lua_State *L)
 {
-    check_argc(1);
-    check_arg_type(1, LUA_TSTRING);
+    struct apolo_stream *s = luaL_checkudata(L, 1, APOLO_STREAM_MT);
 
-    // Push entries into a new lua table
-    lua_newtable(L);
-    native_fillentryarray(L, lua_tostring(L, 1));
+    stream_finish(s, 1);
 
-    // Return table pushed to the stack at lua_createtable
-    return 1;
+    lua_pushboolean(L, s->proc.exit_code == 0);
+    lua_pushinteger(L, s->proc.exit_code);
+    return 2;
 }
 
-static int apolocore_mkdir(lua_State *L)
+static int stream_call(lua_State *L)
 {
-    check_argc(1);
-    check_arg_type(1, LUA_TSTRING);
+    struct apolo_stream *s = luaL_checkudata(L, 1, APOLO_STREAM_MT);
 
-    // return native_mkdir's return
-    lua_pushboolean(L, native_mkdir(lua_tostring(L, 1)));
-    return 1;
+    // Generic for passes the control variable, which isn't a chunk size
+    lua_settop(L, 1);
+    return s->chunk_size ? stream_chunk(L) : stream_line(L);
 }
 
-static int apolocore_move(lua_State *L)
+static int stream_gc(lua_State *L)
 {
-    check_argc(2);
-    check_arg_type(1, LUA_TSTRING);
-    check_arg_type(2, LUA_TSTRING);
-    
-    lua_pushboolean(
-        L,
-        native_move(
-            lua_tostring(L, 1),
-            lua_tostring(L, 2)));
-    return 1;
+    struct apolo_stream *s = luaL_checkudata(L, 1, APOLO_STREAM_MT);
+
+    // Never block on a collection; the processes are reaped later
+    stream_finish(s, 0);
+    return 0;
 }
 
-static int apolocore_rmdir(lua_State *L)
+static const struct luaL_Reg apolo_stream_methods[] = {
+    {"line", stream_line},
+    {"chunk", stream_chunk},
+    {"close", stream_close},
+    {NULL, NULL}
+};
+
+/* apolo.core.run(exe_commands, envstrings, is_background, is_eval, pipe_length) */
+/* nil and the message for a command that couldn't be run */
+static int push_run_error(lua_State *L, enum native_err tag)
 {
-    check_argc(1);
-    check_arg_type(1, LUA_TSTRING);
+    switch (tag) {
+    case NATIVE_ERR_FORKFAILED:
+        lua_pushnil(L);
+        lua_pushstring(L, "Failed to fork");
 
-    lua_pushboolean(L, native_rmdir(lua_tostring(L, 1)));
-    return 1;
-}
+        return 2;
+    case NATIVE_ERR_NOTFOUND: 
+        lua_pushnil(L);
+        lua_pushstring(L, "Command not found");
 
-static void table_to_strarray(lua_State *L, int index, const char **strarray)
-{
-    int i = 0;
-    //Negative indices won't count the nil being added, so decrease to compensate
-    if (index < 0)
-        index--;
+        return 2;
+    case NATIVE_ERR_FILE_NOTFOUND:
+        lua_pushnil(L);
+        lua_pushstring(L, "File not found");
 
-    lua_pushnil(L);
-    while (lua_next(L, index) != 0) {
-        if (!lua_isnumber(L, -2))  /* if current index is not a number, ignore */
-            continue;
+        return 2;
+    case NATIVE_ERR_PIPE_FAILED:
+        lua_pushnil(L);
+        lua_pushstring(L, "Pipe creation failed");
 
-        strarray[i++] = lua_tostring(L, -1);
-        lua_pop(L, 1);
-    }
+        return 2;
+    case NATIVE_ERR_INTERRUPT:
+        lua_pushnil(L);
+        lua_pushstring(L, "Command interrupted before completion");
 
-    // Sentinel indicating the end of the array
-    strarray[i] = NULL;
+        return 2;
+    case NATIVE_ERR_PERMISSION:
+        lua_pushnil(L);
+        lua_pushstring(L, "Process doesn't have proper permissions to open file");
+
+        return 2;
+    case NATIVE_ERR_MAX:
+        lua_pushnil(L);
+        lua_pushstring(L, "Process has too many files/file descriptors open. Increase the maximum and try again");
+
+        return 2;
+    case NATIVE_ERR_VARIABLE_SIZE:
+        lua_pushnil(L);
+        lua_pushstring(L, "File name exceeded max length");
+
+        return 2;
+    case NATIVE_ERR_ARGS_TOO_BIG:
+        lua_pushnil(L);
+        lua_pushstring(L, "Argument list too long");
+
+        return 2;
+    default:
+        lua_pushnil(L);
+        lua_pushstring(L, "Unknown error (most likely a bug in apolo)");
+
+        return 2;
+    }
 }
 
-/* apolo.core.run(exe_commands, envstrings, is_background, is_eval, pipe_length) */
 static int apolocore_execute(lua_State *L)
 {
-    check_argc(12);
+    check_argc(18);
     check_arg_type(1, LUA_TTABLE);
-    check_arg_type(2, LUA_TTABLE);
+    // Either an envblock or false for the parent environment
+    if (lua_toboolean(L, 2)) {
+        luaL_checkudata(L, 2, APOLO_ENVBLOCK_MT);
+    } else {
+        check_arg_type(2, LUA_TBOOLEAN);
+    }
     check_arg_type(3, LUA_TBOOLEAN);
     check_arg_type(4, LUA_TBOOLEAN);
     check_arg_type(5, LUA_TNUMBER);
@@ -285,37 +2332,17 @@ static int apolocore_execute(lua_State *L)
     check_arg_type(10, LUA_TBOOLEAN);
     check_arg_type(11, LUA_TBOOLEAN);
     check_arg_type(12, LUA_TBOOLEAN);
+    check_arg_type(13, LUA_TNUMBER);
+    check_arg_type(14, LUA_TBOOLEAN);
+    check_arg_type(15, LUA_TNUMBER);
+    check_arg_type(16, LUA_TBOOLEAN);
+    check_arg_type(17, LUA_TNUMBER);
+    check_arg_type(18, LUA_TSTRING);
 
     {
         int len = lua_tonumber(L, 5);
-        const char *executable[MAX_PIPE_LENGTH];
-        const char *exeargs[MAX_PIPE_LENGTH][32];
-        const char *envstrings[512];  /* Make room for parent environment */
-
-        /* Build executable and exeargs for each table in the table at parameter 1 */
-        lua_pushvalue(L, 1);
-        lua_pushnil(L);
-        while (lua_next(L, -2) != 0) {
-            // copy the key so that lua_tostring does not modify the original
-            lua_pushvalue(L, -2);
-            const int key = (int) lua_tonumber(L, -1) - 1;
-            // Populate exeargs with inner table
-            table_to_strarray(L, -2, exeargs[key]);
-
-            // Read first value of inner table for executable
-            lua_pushnil(L);
-            lua_next(L, -3);
-
-            executable[key] = lua_tostring(L, -1);
-
-            // pop value + copy of key, leaving original key
-            lua_pop(L, 4);
-        }
-        // Pop table
-        lua_pop(L, 1);
-
-        /* Store env vars in an array */
-        table_to_strarray(L, 2, envstrings);
+        struct exec_arena arena;
+        int arena_index = make_exec_arena(L, 1, 2, len, &arena);
 
         /* Set up opts */
         enum exec_opts_t opts = EXEC_OPTS_INVALID;
@@ -331,10 +2358,13 @@ static int apolocore_execute(lua_State *L)
             opts = opts | EXEC_OPTS_ERR_TO_OUT;
         if (lua_toboolean(L, 12))
             opts = opts | EXEC_OPTS_OUT_TO_ERR;
+        if (lua_toboolean(L, 14))
+            opts = opts | EXEC_OPTS_STREAM;
 
         const char* source = lua_tostring(L, 6);
         const char* target = lua_tostring(L, 7);
         const char* err_target = lua_tostring(L, 9);
+        const char* tee = lua_tostring(L, 18);
 
         //If the IO-redirection files are empty strings, that means there should be no redirection
         if (source[0] == 0)
@@ -345,103 +2375,232 @@ static int apolocore_execute(lua_State *L)
             err_target = NULL;
 
         struct native_run_result proc = native_setup_proc_out(opts, target, err_target);
+        proc.stage_pids = arena.stage_pids;
+        proc.stage_codes = arena.stage_codes;
+
+        // Zero means the default threshold for moving eval output off the heap
+        lua_Integer spill_threshold = lua_tointeger(L, 13);
+        proc.spill_threshold =
+            spill_threshold > 0 ? (size_t) spill_threshold : EVAL_SPILL_THRESHOLD;
+
+        // Zero keeps the system's default pipe capacity
+        lua_Integer pipe_size = lua_tointeger(L, 17);
+        proc.pipe_size = pipe_size > 0 ? (size_t) pipe_size : 0;
+
+        if (proc.tag == NATIVE_ERR_IN_EXECUTE && tee[0] != 0)
+            proc = native_setup_tee(proc, tee);
+
         if (proc.tag == NATIVE_ERR_IN_EXECUTE) {
             for (int pipe=len-1; pipe >= 0; pipe--) {
                 if (proc.tag != NATIVE_ERR_IN_EXECUTE) {
                     break;
                 }
-                proc = native_execute(executable[pipe], exeargs[pipe], envstrings,
-                    opts, proc, pipe, source);
+                proc = native_execute(arena.argvs[pipe][0], arena.argvs[pipe],
+                    arena.envstrings, opts, proc, pipe, source);
             }
             if (proc.tag == NATIVE_ERR_IN_EXECUTE) {
                 proc = native_execute_begin(proc, opts);
             }
         }
 
-        switch (proc.tag) {
-        case NATIVE_ERR_FORKFAILED:
-            lua_pushnil(L);
-            lua_pushstring(L, "Failed to fork");
-
-            return 2;
-        case NATIVE_ERR_NOTFOUND: 
-            lua_pushnil(L);
-            lua_pushstring(L, "Command not found");
-
-            return 2;
-        case NATIVE_ERR_FILE_NOTFOUND:
-            lua_pushnil(L);
-            lua_pushstring(L, "File not found");
-
-            return 2;
-        case NATIVE_ERR_PIPE_FAILED:
-            lua_pushnil(L);
-            lua_pushstring(L, "Pipe creation failed");
+        // Streams still need the stage pids, so they keep the arena
+        if (proc.tag == NATIVE_ERR_STREAM_SUCCESS) {
+            push_stream(L, proc, lua_tointeger(L, 15), arena_index);
 
-            return 2;
-        case NATIVE_ERR_INTERRUPT:
-            lua_pushnil(L);
-            lua_pushstring(L, "Command interrupted before completion");
+            return 1;
+        }
 
-            return 2;
-        case NATIVE_ERR_PERMISSION:
-            lua_pushnil(L);
-            lua_pushstring(L, "Process doesn't have proper permissions to open file");
+        // The codes of all stages are returned after the one of the pipe, which
+        // is the code of the last stage that failed if pipefail is set
+        long unsigned pipe_code = proc.exit_code;
+        if (proc.tag == NATIVE_ERR_SUCCESS && !(opts & EXEC_OPTS_EVAL)) {
+            int is_pipefail = lua_toboolean(L, 16);
 
-            return 2;
-        case NATIVE_ERR_MAX:
-            lua_pushnil(L);
-            lua_pushstring(L, "Process has too many files/file descriptors open. Increase the maximum and try again");
+            lua_createtable(L, len, 0);
+            for (int i = 0; i < len; ++i) {
+                lua_pushinteger(L, arena.stage_codes[i]);
+                lua_seti(L, -2, i + 1);
 
-            return 2;
-        case NATIVE_ERR_VARIABLE_SIZE:
-            lua_pushnil(L);
-            lua_pushstring(L, "File name exceeded max length");
+                if (is_pipefail && arena.stage_codes[i] != 0)
+                    pipe_code = arena.stage_codes[i];
+            }
+        }
 
-            return 2;
+        switch (proc.tag) {
         case NATIVE_ERR_BACKGROUND_SUCCESS:
             lua_pushnumber(L, proc.pid);
             
             return 1;
         case NATIVE_ERR_SUCCESS:
             if (opts & EXEC_OPTS_EVAL) {
-                lua_pushstring(L, proc.out_string);
+                // The output may contain zeroes, so its length is what counts
+                lua_pushlstring(L, proc.out_len ? proc.out_string : "", proc.out_len);
+                native_release_output(&proc);
 
                 return 1;
             }
             else {
-                lua_pushboolean(L, proc.exit_code == 0);
-                lua_pushnumber(L, proc.exit_code);
+                lua_pushboolean(L, pipe_code == 0);
+                lua_pushnumber(L, pipe_code);
+                lua_rotate(L, -3, 2);
 
-                return 2;
+                return 3;
             }
         default:
-            lua_pushnil(L);
-            lua_pushstring(L, "Unknown error (most likely a bug in apolo)");
-
-            return 2;
+            return push_run_error(L, proc.tag);
         }
     }
 }
 
+/* Only returns if the command couldn't replace this process */
+static int apolocore_exec(lua_State *L)
+{
+    check_argc(9);
+    check_arg_type(1, LUA_TTABLE);
+    if (lua_toboolean(L, 2)) {
+        luaL_checkudata(L, 2, APOLO_ENVBLOCK_MT);
+    } else {
+        check_arg_type(2, LUA_TBOOLEAN);
+    }
+    check_arg_type(3, LUA_TSTRING);
+    check_arg_type(4, LUA_TSTRING);
+    check_arg_type(5, LUA_TBOOLEAN);
+    check_arg_type(6, LUA_TSTRING);
+    check_arg_type(7, LUA_TBOOLEAN);
+    check_arg_type(8, LUA_TBOOLEAN);
+    check_arg_type(9, LUA_TBOOLEAN);
+
+    struct exec_arena arena;
+    make_exec_arena(L, 1, 2, 1, &arena);
+
+    enum exec_opts_t opts = EXEC_OPTS_INVALID;
+    if (lua_toboolean(L, 5))
+        opts = opts | EXEC_OPTS_APPEND_TO;
+    if (lua_toboolean(L, 7))
+        opts = opts | EXEC_OPTS_APPEND_ERR;
+    if (lua_toboolean(L, 8))
+        opts = opts | EXEC_OPTS_ERR_TO_OUT;
+    if (lua_toboolean(L, 9))
+        opts = opts | EXEC_OPTS_OUT_TO_ERR;
+
+    // Empty strings mean no redirection, like in execute
+    const char *source = lua_tostring(L, 3);
+    const char *target = lua_tostring(L, 4);
+    const char *err_target = lua_tostring(L, 6);
+
+    struct native_run_result proc = native_setup_proc_out(opts,
+        target[0] ? target : NULL, err_target[0] ? err_target : NULL);
+    if (proc.tag == NATIVE_ERR_IN_EXECUTE)
+        proc.tag = native_exec(arena.argvs[0][0], arena.argvs[0], arena.envstrings, proc,
+            source[0] ? source : NULL);
+
+    return push_run_error(L, proc.tag);
+}
+
 static const struct luaL_Reg apolocore[] = {
     {"chdir", apolocore_chdir},
+    {"clock", apolocore_clock},
     {"copy", apolocore_copy},
+    {"cpu_count", apolocore_cpu_count},
     {"curdir", apolocore_curdir},
+    {"del", apolocore_del},
+    {"dir_iter", apolocore_dir_iter},
     {"exists", apolocore_exists},
+    {"glob_compile", apolocore_glob_compile},
+    {"hash_clear", apolocore_hash_clear},
     {"job_status", apolocore_job_status},
     {"job_kill", apolocore_job_kill},
     {"job_active", apolocore_job_active},
-    {"listdirentries", apolocore_listdirentries},
+    {"job_events", apolocore_job_events},
+    {"map", apolocore_map},
     {"mkdir", apolocore_mkdir},
     {"move", apolocore_move},
+    {"move_many", apolocore_move_many},
+    {"prefetch", apolocore_prefetch},
+    {"prefetch_close", prefetch_gc},
+    {"prefetch_wait", apolocore_prefetch_wait},
+    {"pump", apolocore_pump},
     {"rmdir", apolocore_rmdir},
+    {"envblock", apolocore_envblock},
+    {"exec", apolocore_exec},
     {"execute", apolocore_execute},
+    {"stat", apolocore_stat},
+    {"walk", apolocore_walk},
+    {"watch", apolocore_watch},
+    {"watch_close", watch_gc},
+    {"watch_wait", apolocore_watch_wait},
+    {"which", apolocore_which},
+    {"writef", apolocore_writef},
+    {"writef_many", apolocore_writef_many},
+    {"writer", apolocore_writer},
     {NULL, NULL}
 };
 
 int luaopen_apolocore(lua_State *L)
 {
+    luaL_newmetatable(L, APOLO_ENVBLOCK_MT);
+    lua_pushcfunction(L, envblock_len);
+    lua_setfield(L, -2, "__len");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, APOLO_DIR_ITER_MT);
+    lua_pushcfunction(L, dir_iter_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, APOLO_GLOB_MT);
+    lua_newtable(L);
+    luaL_setfuncs(L, apolo_glob_methods, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, glob_call);
+    lua_setfield(L, -2, "__call");
+    lua_pushcfunction(L, glob_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, APOLO_MAP_MT);
+    lua_newtable(L);
+    luaL_setfuncs(L, apolo_map_methods, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, map_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, map_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, APOLO_WALK_MT);
+    lua_pushcfunction(L, walk_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, APOLO_PREFETCH_MT);
+    lua_pushcfunction(L, prefetch_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, APOLO_WATCH_MT);
+    lua_pushcfunction(L, watch_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, APOLO_WRITER_MT);
+    lua_newtable(L);
+    luaL_setfuncs(L, apolo_writer_methods, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, writer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, APOLO_STREAM_MT);
+    lua_newtable(L);
+    luaL_setfuncs(L, apolo_stream_methods, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, stream_call);
+    lua_setfield(L, -2, "__call");
+    lua_pushcfunction(L, stream_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     lua_newtable(L);
 
     luaL_setfuncs(L, apolocore, 0);
@@ -29,8 +29,11 @@
     #include "apolocore.win.h"
 #endif
 
-#define EVAL_BUFFER_SIZE 1024
+/* Eval output bigger than this is moved out of the heap (if the platform
+   allows it) */
+#define EVAL_SPILL_THRESHOLD (4 * 1024 * 1024)
 
+#include <stdio.h>
 #include <lua.h>
 
 enum native_err {
@@ -45,8 +48,10 @@ enum native_err {
     NATIVE_ERR_INTERRUPT,
     NATIVE_ERR_MAX,
     NATIVE_ERR_VARIABLE_SIZE,
+    NATIVE_ERR_ARGS_TOO_BIG,
 
     NATIVE_ERR_BACKGROUND_SUCCESS,
+    NATIVE_ERR_STREAM_SUCCESS,
     NATIVE_ERR_IN_EXECUTE,
     NATIVE_ERR_SUCCESS,
     
@@ -57,6 +62,68 @@ enum native_err {
     NATIVE_ERR_BACKGROUND_FAILED
 };
 
+/* Types of directory entries; the Lua names are in apolocore.c */
+enum native_entry_type {
+    NATIVE_ENTRY_DIR,
+    NATIVE_ENTRY_FILE,
+    NATIVE_ENTRY_BLKDEV,
+    NATIVE_ENTRY_CHRDEV,
+    NATIVE_ENTRY_NAMEDPIPE,
+    NATIVE_ENTRY_SYMLINK,
+    NATIVE_ENTRY_UDSOCKET,
+    NATIVE_ENTRY_UNKNOWN,
+
+    NATIVE_ENTRY_TYPE_COUNT
+};
+
+/* Open directory being read a batch of entries at a time; defined by each
+   platform */
+struct native_dir;
+/* Recursive walk through a directory tree */
+struct native_walk;
+
+/* Metadata fields of native_stat, in the order of their Lua names in
+   apolocore.c; only the requested ones are fetched */
+enum native_stat_field {
+    NATIVE_STAT_TYPE = 0x1,
+    NATIVE_STAT_SIZE = 0x2,
+    NATIVE_STAT_MODE = 0x4,
+    NATIVE_STAT_MTIME = 0x8,
+    NATIVE_STAT_ATIME = 0x10,
+    NATIVE_STAT_CTIME = 0x20,
+    NATIVE_STAT_UID = 0x40,
+    NATIVE_STAT_GID = 0x80,
+
+    NATIVE_STAT_ALL = 0xff
+};
+
+struct native_stat
+{
+    unsigned fields;  /* the ones that were filled, which may be fewer than asked */
+    enum native_entry_type type;
+    long long size;
+    unsigned mode;  /* permission bits */
+    double mtime;  /* seconds since the epoch */
+    double atime;
+    double ctime;
+    long long uid;
+    long long gid;
+};
+
+/* Files and directories watched for changes */
+struct native_watch;
+/* File opened for writing */
+struct native_out_file;
+
+struct native_prefetch;
+
+enum native_watch_result {
+    NATIVE_WATCH_ERROR = -1,
+    NATIVE_WATCH_TIMEOUT,
+    NATIVE_WATCH_CHANGED,
+    NATIVE_WATCH_JOBS  /* some background job changed state first */
+};
+
 enum exec_opts_t {
     EXEC_OPTS_INVALID = 0x0,
     EXEC_OPTS_BG = 0x1,
@@ -65,30 +132,93 @@ enum exec_opts_t {
     EXEC_OPTS_APPEND_TO = 0x8,
     EXEC_OPTS_APPEND_ERR = 0x10,
     EXEC_OPTS_ERR_TO_OUT = 0x20,
-    EXEC_OPTS_OUT_TO_ERR = 0x40
+    EXEC_OPTS_OUT_TO_ERR = 0x40,
+    EXEC_OPTS_STREAM = 0x80
 };
 
 
-void insert_direntry(lua_State *L, int index, const char *dirname, const char *type);
-
 int native_chdir(const char *dir);
+double native_clock(void);
 int native_copy(const char *orig, const char *dest);
-void native_curdir(char *dir);
+int native_cpu_count(void);
+/* dir must have room for 512 bytes. Returns 0 if the path doesn't fit or
+   can't be found */
+int native_curdir(char *dir);
+/* 1 if path was deleted, 0 if it doesn't exist and -1 on failure */
+int native_del(const char *path, int num_threads);
+struct native_dir *native_dir_open(const char *path);
+/* 1 with the next entry (other than . and ..), 0 at the end and -1 on errors.
+   name is valid until the next call */
+int native_dir_next(struct native_dir *dir, const char **name, enum native_entry_type *type);
+void native_dir_close(struct native_dir *dir);
+/* Recursive listing of root, read by num_threads threads. Entries come out
+   in no particular order; directories are only read after being passed to
+   native_walk_descend right after native_walk_next returns them.
+   native_walk_next returns 0 at the end and -1 (with errno) if entries had
+   to be left out */
+struct native_walk *native_walk_open(const char *root, int num_threads, int follow_links);
+int native_walk_next(struct native_walk *walk, const char **path,
+    enum native_entry_type *type, int *depth, int *is_dir);
+void native_walk_descend(struct native_walk *walk);
+void native_walk_close(struct native_walk *walk);
 int native_exists(const char *path);
+/* Links are followed */
+int native_is_dir(const char *path);
+void native_hash_clear(void);
+/* 1 if path exists, 0 if it doesn't and -1 on other errors */
+int native_stat(const char *path, unsigned fields, int follow_links, struct native_stat *st);
 struct native_job_result native_job_status(const int pid, int is_wait);
 struct native_job_result native_job_kill(const int pid, int is_kill);
 struct native_job_result native_job_set_active(const int pid, int is_suspend);
-int native_fillentryarray(lua_State *L, const char *dir);
+/* Maps path read-only into memory (empty files give a pointer to nothing),
+   or NULL on errors */
+const char *native_map_file(const char *path, size_t *len);
+void native_unmap_file(const char *data, size_t len);
 int native_mkdir(const char *dir);
+long long native_pump(FILE *src, FILE *dst);
+/* Files being written, directly or (if atomic) through a temporary file that
+   takes the place of the real one once committed */
+struct native_out_file *native_out_open(const char *path, int is_append, int is_atomic);
+int native_out_write(struct native_out_file *f, const char *data, size_t len);
+/* Atomic files are synced and renamed if is_commit, and thrown away otherwise.
+   Returns 0 on failure */
+int native_out_close(struct native_out_file *f, int is_commit);
+const char **native_parent_env(void);
+/* Reads the files into the page cache from a background thread. The paths
+   are copied, and the files that can't be opened are skipped */
+struct native_prefetch *native_prefetch_start(const char **paths, size_t count);
+/* Waits up to timeout_ms (-1 waits forever) for all files to be read. Returns 1
+   and the number of bytes read once they are, 0 on timeout */
+int native_prefetch_wait(struct native_prefetch *prefetch, int timeout_ms, long long *bytes);
+/* Stops after the file being read and frees the prefetch */
+void native_prefetch_close(struct native_prefetch *prefetch);
 int native_move(const char *orig, const char *dest);
 int native_rmdir(const char *dir);
+struct native_watch *native_watch_open(void);
+/* Directories are watched along with everything inside them (and, if
+   recursive, the directories created in them later) */
+int native_watch_add(struct native_watch *watch, const char *path, int recursive);
+/* Waits up to timeout_ms (-1 for no limit) for changes, then gathers the ones
+   that keep coming until there are none for debounce_ms */
+enum native_watch_result native_watch_wait(struct native_watch *watch, int timeout_ms,
+    int debounce_ms, int wake_on_jobs);
+/* Paths changed in the last wait, in order and maybe repeated; NULL at the
+   end */
+const char *native_watch_changed(struct native_watch *watch, size_t index);
+void native_watch_close(struct native_watch *watch);
+const char *native_which(const char *name);
 
 struct native_run_result
 {
     enum native_err tag;
     long unsigned exit_code;
-    char out_string[EVAL_BUFFER_SIZE];
+    char *out_string;
+    size_t out_len;
+    size_t spill_threshold;
+    size_t pipe_size;  /* capacity of the pipes between stages, 0 for the default */
     int pid;
+    int *stage_pids;  /* room for the pid of each stage, owned by the caller */
+    int *stage_codes;  /* exit code of each stage in pipe order, likewise */
     
     struct native_pipe_info pipe_info;
 };
@@ -99,16 +229,39 @@ struct native_job_result
     long unsigned int exit_code;
 };
 
+struct native_job_event
+{
+    int pid;
+    struct native_job_result result;
+};
+
+/* Fills events with background jobs whose state changed, waiting up to
+   timeout_ms (-1 waits forever) if there are none yet. Returns -1 if no jobs
+   are being tracked */
+int native_job_events(int timeout_ms, struct native_job_event *events, int max_events);
+
 struct native_run_result native_setup_proc_out(enum exec_opts_t opts,
     const char *target_file, const char *err_target_file);
 
+struct native_run_result native_setup_tee(struct native_run_result proc, const char *tee_file);
+
 struct native_run_result native_execute(
     const char *executable, const char **exeargs, const char **envstrings,
     enum exec_opts_t opts, struct native_run_result prev_proc, int index, const char *source_file);
 
+/* Replaces this process with the command, its standard streams set up by
+   native_setup_proc_out. Only returns if that fails, with the reason */
+enum native_err native_exec(const char *executable, const char **exeargs,
+    const char **envstrings, struct native_run_result proc, const char *source_file);
+
 struct native_run_result native_execute_begin(struct native_run_result proc,
     enum exec_opts_t opts);
 
+void native_release_output(struct native_run_result *proc);
+
+long native_stream_read(struct native_run_result *proc, char *buf, size_t len);
+struct native_run_result native_stream_close(struct native_run_result proc, int is_wait);
+
 int luaopen_apolocore(lua_State *L);
 
 #endif
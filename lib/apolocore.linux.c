@@ -25,6 +25,7 @@
 #include "apolocore.h"
 
 #include <string.h>
+#include <stdio_ext.h>
 #include <dirent.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -32,7 +33,26 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <time.h>
 #include <unistd.h>
+#include <limits.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
 #include <lua.h>
 #include <lualib.h>
@@ -48,468 +68,3095 @@ int native_chdir(const char *dir)
     return chdir(dir) != -1;
 }
 
-int native_copy(const char *orig, const char *dest)
+/* Copies len bytes at off, at the same offset in the target. Not every pair
+   of filesystems supports copy_file_range (and old kernels don't support it
+   at all), so whatever is left goes through sendfile and, at last, by hand */
+static int copy_file_range_all(int in_fd, int out_fd, off_t off, off_t len)
 {
-    // noop, because Linux calls /bin/cp from Lua
-    return 0;
+    loff_t in_off = off, out_off = off;
+    ssize_t num_bytes;
+
+    while (len > 0) {
+        num_bytes = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+        if (num_bytes < 0 && errno == EINTR)
+            continue;
+        if (num_bytes <= 0)
+            break;
+        len -= num_bytes;
+    }
+
+    // sendfile writes at the current position of the target
+    if (len > 0 && lseek(out_fd, out_off, SEEK_SET) < 0)
+        return 0;
+    while (len > 0) {
+        num_bytes = sendfile(out_fd, in_fd, &in_off, len);
+        if (num_bytes < 0 && errno == EINTR)
+            continue;
+        if (num_bytes <= 0)
+            break;
+        len -= num_bytes;
+        out_off += num_bytes;
+    }
+
+    char buf[65536];
+    while (len > 0) {
+        num_bytes = pread(in_fd, buf, len < (off_t) sizeof(buf) ? (size_t) len : sizeof(buf), in_off);
+        if (num_bytes < 0 && errno == EINTR)
+            continue;
+        if (num_bytes < 0)
+            return 0;
+        // The file got shorter while being copied
+        if (num_bytes == 0)
+            break;
+
+        for (ssize_t written = 0; written < num_bytes;) {
+            ssize_t n = pwrite(out_fd, buf + written, num_bytes - written, out_off + written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return 0;
+            written += n;
+        }
+        len -= num_bytes;
+        in_off += num_bytes;
+        out_off += num_bytes;
+    }
+
+    return 1;
 }
 
-void native_curdir(char *dir)
+/* A reflink shares the blocks with the original, so nothing is copied at all.
+   Otherwise only the parts with data are copied, so holes stay holes */
+static int copy_file_data(int in_fd, int out_fd, off_t size)
 {
-    getcwd(dir, 512);
+    if (ioctl(out_fd, FICLONE, in_fd) == 0)
+        return 1;
+
+    off_t data = 0;
+    while (data < size) {
+        off_t hole;
+
+        data = lseek(in_fd, data, SEEK_DATA);
+        if (data < 0) {
+            // Nothing but a hole until the end
+            if (errno == ENXIO)
+                break;
+            // The filesystem can't tell where the holes are
+            if (errno != EINVAL)
+                return 0;
+            data = 0;
+            hole = size;
+        } else {
+            hole = lseek(in_fd, data, SEEK_HOLE);
+            if (hole < 0 || hole > size)
+                hole = size;
+        }
+
+        if (!copy_file_range_all(in_fd, out_fd, data, hole - data))
+            return 0;
+        data = hole;
+    }
+
+    // Holes at the end are made by setting the size
+    return ftruncate(out_fd, size) == 0;
 }
 
-int native_exists(const char *path)
+/* Extended attributes (ACLs and security labels included) are copied on a
+   best effort basis, like the rest of the metadata that needs privileges */
+static void copy_xattrs(int in_fd, int out_fd)
 {
-    struct stat st = {0};
+    ssize_t names_len = flistxattr(in_fd, NULL, 0);
+    if (names_len <= 0)
+        return;
 
-    return stat(path, &st) != -1;
+    char *names = malloc(names_len);
+    if (!names)
+        return;
+    names_len = flistxattr(in_fd, names, names_len);
+
+    for (char *name = names; names_len > 0 && name < names + names_len;
+            name += strlen(name) + 1) {
+        ssize_t value_len = fgetxattr(in_fd, name, NULL, 0);
+        if (value_len < 0)
+            continue;
+
+        char *value = malloc(value_len ? value_len : 1);
+        if (!value)
+            continue;
+        value_len = fgetxattr(in_fd, name, value, value_len);
+        if (value_len >= 0)
+            fsetxattr(out_fd, name, value, value_len, 0);
+        free(value);
+    }
+
+    free(names);
 }
 
-int native_fillentryarray(lua_State *L, const char *dirname)
+/* Owner first, since changing it clears the setuid and setgid bits, and times
+   last, since everything else changes them */
+static void copy_metadata(int fd, int in_fd, const struct stat *st)
 {
-    DIR *dir;
-    struct dirent *entry;
-    int i;
-    const char *type;
+    // Only root can give files away; the group may still be kept
+    if (fchown(fd, st->st_uid, st->st_gid) < 0)
+        fchown(fd, -1, st->st_gid);
+    if (in_fd >= 0)
+        copy_xattrs(in_fd, fd);
+    fchmod(fd, st->st_mode & 07777);
+
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    futimens(fd, times);
+}
+
+/* The directory where the copy of a tree is made, which is skipped if it
+   turns up inside the tree anyway (through a bind mount, say) */
+struct copy_root
+{
+    int is_set;
+    dev_t dev;
+    ino_t ino;
+};
+
+static int copy_entry(int src_dir, const char *src_name, int dst_dir,
+    const char *dst_name, struct copy_root *root);
 
-    errno = 0;
+static int same_file(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
 
-    if ((dir = opendir(dirname)) == NULL)
+/* Whether the directory fd is the one of st or is somewhere below it. fd is
+   closed */
+static int dir_is_inside(int fd, const struct stat *st)
+{
+    struct stat cur_st;
+    if (fstat(fd, &cur_st) < 0) {
+        close(fd);
         return 0;
+    }
 
-    for (i = 1; (entry = readdir(dir)) != NULL; ++i) {
-        switch (entry->d_type) {
-        // stantdard, multi-platform types
-        case DT_DIR:
-            type = "dir";
-            break;
-        case DT_REG:
-            type = "file";
-            break;
+    for (;;) {
+        if (same_file(&cur_st, st)) {
+            close(fd);
+            return 1;
+        }
 
-        // exterded types for linux
-        case DT_BLK:
-            type = "blkdev";
-            break;
-        case DT_CHR:
-            type = "chrdev";
-            break;
-        case DT_FIFO:
-            type = "namedpipe";
-            break;
-        case DT_LNK:
-            type = "symlink";
-            break;
-        case DT_SOCK:
-            type = "udsocket";
-            break;
-        default:
-            type = "unknown";
-            break;
+        int parent = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        if (parent < 0)
+            return 0;
+
+        struct stat parent_st;
+        // The root is its own parent
+        if (fstat(parent, &parent_st) < 0 || same_file(&parent_st, &cur_st)) {
+            close(parent);
+            return 0;
         }
 
-        insert_direntry(L, i, entry->d_name, type);
+        fd = parent;
+        cur_st = parent_st;
     }
-
-    closedir(dir);
-    return 1;
 }
 
-struct native_job_result native_job_status(const int pid, int is_wait)
+static int copy_regular(int src_dir, const char *src_name, int dst_dir,
+    const char *dst_name, const struct stat *st)
 {
-    int status_code;
-    int opts = 0;
-    if (!is_wait) {
-        opts = opts | WNOHANG | WUNTRACED | WCONTINUED;
+    // Opening the file itself as the copy would truncate it, like cp refuses to
+    struct stat dst_st;
+    if (fstatat(dst_dir, dst_name, &dst_st, 0) == 0 && same_file(&dst_st, st)) {
+        errno = EINVAL;
+        return 0;
     }
-    
-    pid_t result = waitpid(pid, &status_code, opts);
 
-    struct native_job_result res = {NATIVE_ERR_BACKGROUND_UNCHANGED, 0};
-    if (result == 0) {
-        // Nothing has changed
-        return res;
-    } else if (result == -1) {
-        // Error
-        switch (errno) {
-            case ECHILD:
-                res.tag = NATIVE_ERR_NOTFOUND;
-                return res;
-            default:
-                res.tag = NATIVE_ERR_INVALID;
-                return res;
-        }
-    } else {
-        // Default return: error termination (failed)
-        res.tag = NATIVE_ERR_BACKGROUND_FAILED;
-        res.exit_code = 0;
-        if (WIFEXITED(status_code)) {
-            // Test if the process exited normally. If this returns false, the process errored out
-            res.tag = NATIVE_ERR_BACKGROUND_FINISHED;
-            res.exit_code = WEXITSTATUS(status_code);
-        } else if (WIFSTOPPED(status_code)) {
-            res.tag = NATIVE_ERR_BACKGROUND_SUSPENDED;
-        } else if (WIFCONTINUED(status_code)) {
-            res.tag = NATIVE_ERR_BACKGROUND_RESUMED;
-        }
-        return res;
+    int in_fd = openat(src_dir, src_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (in_fd < 0)
+        return 0;
+
+    int out_fd = openat(dst_dir, dst_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        S_IRUSR | S_IWUSR);
+    if (out_fd < 0) {
+        close(in_fd);
+        return 0;
     }
+
+    int ok = copy_file_data(in_fd, out_fd, st->st_size);
+    if (ok)
+        copy_metadata(out_fd, in_fd, st);
+
+    close(in_fd);
+    if (close(out_fd) < 0)
+        ok = 0;
+
+    return ok;
 }
 
-static struct native_job_result native_job_signal(const int pid, int signal)
+static int copy_dir(int src_dir, const char *src_name, int dst_dir,
+    const char *dst_name, const struct stat *st, struct copy_root *root)
 {
-    int status = kill(pid, signal);
-    if (status < 0) {
-        struct native_job_result res = {NATIVE_ERR_INVALID, 0};
-        switch (errno) {
-            case EPERM:
-                res.tag = NATIVE_ERR_PERMISSION;
-                return res;
-            case ESRCH:
-                res.tag = NATIVE_ERR_NOTFOUND;
-                return res;
-            default:
-                return res;
+    // Copying into an existing directory merges both
+    int made = mkdirat(dst_dir, dst_name, S_IRWXU) == 0;
+    if (!made && errno != EEXIST)
+        return 0;
+
+    int out_fd = openat(dst_dir, dst_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (out_fd < 0)
+        return 0;
+
+    if (!root->is_set) {
+        // Copying a directory into itself, like cp, is refused
+        int check_fd = dup(out_fd);
+        if (check_fd < 0 || dir_is_inside(check_fd, st)) {
+            close(out_fd);
+            if (made)
+                unlinkat(dst_dir, dst_name, AT_REMOVEDIR);
+            errno = EINVAL;
+            return 0;
+        }
+
+        struct stat root_st;
+        if (fstat(out_fd, &root_st) == 0) {
+            root->is_set = 1;
+            root->dev = root_st.st_dev;
+            root->ino = root_st.st_ino;
         }
-    } else {
-        struct native_job_result res = {NATIVE_ERR_SUCCESS, 1};
-        return res;
     }
-}
 
-struct native_job_result native_job_kill(const int pid, int is_kill)
-{
-    int signal;
-    if (is_kill) {
-        signal = SIGKILL;
-    } else {
-        signal = SIGTERM;
+    int in_fd = openat(src_dir, src_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = in_fd < 0 ? NULL : fdopendir(in_fd);
+    if (!dir) {
+        if (in_fd >= 0)
+            close(in_fd);
+        close(out_fd);
+        return 0;
     }
-    return native_job_signal(pid, signal);
+
+    // A failed entry doesn't stop the others from being copied
+    int ok = 1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        if (!copy_entry(in_fd, entry->d_name, out_fd, entry->d_name, root))
+            ok = 0;
+    }
+
+    copy_metadata(out_fd, in_fd, st);
+
+    closedir(dir);
+    close(out_fd);
+
+    return ok;
 }
 
-struct native_job_result native_job_set_active(const int pid, int is_suspend)
+static int copy_special(int src_dir, const char *src_name, int dst_dir,
+    const char *dst_name, const struct stat *st)
 {
-    int signal;
-    if (is_suspend) {
-        signal = SIGSTOP;
+    // Links are copied as links, like cp -r does
+    if (S_ISLNK(st->st_mode)) {
+        char *target = malloc(st->st_size + 1);
+        if (!target)
+            return 0;
+
+        ssize_t len = readlinkat(src_dir, src_name, target, st->st_size + 1);
+        if (len < 0 || len > st->st_size) {
+            free(target);
+            return 0;
+        }
+        target[len] = 0;
+
+        int res = symlinkat(target, dst_dir, dst_name);
+        if (res < 0 && errno == EEXIST && unlinkat(dst_dir, dst_name, 0) == 0)
+            res = symlinkat(target, dst_dir, dst_name);
+        free(target);
+        if (res < 0)
+            return 0;
     } else {
-        signal = SIGCONT;
+        // Devices, FIFOs and sockets are made again
+        if (mknodat(dst_dir, dst_name, st->st_mode, st->st_rdev) < 0)
+            return 0;
+        fchmodat(dst_dir, dst_name, st->st_mode & 07777, 0);
     }
-    return native_job_signal(pid, signal);
+
+    fchownat(dst_dir, dst_name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    utimensat(dst_dir, dst_name, times, AT_SYMLINK_NOFOLLOW);
+
+    return 1;
 }
 
-int native_mkdir(const char *dir)
+static int copy_entry(int src_dir, const char *src_name, int dst_dir,
+    const char *dst_name, struct copy_root *root)
 {
-    // If directory already exists, return false
-    if (native_exists(dir))
+    struct stat st;
+    if (fstatat(src_dir, src_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
         return 0;
 
-    // rwx permissions to owner
-    // rx to everyone else
-    mkdir(dir, 0755);
-    return 1;
+    if (root->is_set && st.st_dev == root->dev && st.st_ino == root->ino)
+        return 1;
+
+    if (S_ISDIR(st.st_mode))
+        return copy_dir(src_dir, src_name, dst_dir, dst_name, &st, root);
+    if (S_ISREG(st.st_mode))
+        return copy_regular(src_dir, src_name, dst_dir, dst_name, &st);
+
+    return copy_special(src_dir, src_name, dst_dir, dst_name, &st);
 }
 
-int native_move(const char *orig, const char *dest)
+/* dir/name, where name is the last component of path */
+static char *path_in_dir(const char *dir, const char *path)
 {
-    // noop, because Linux calls /bin/mv from Lua
-    return 0;
+    size_t path_len = strlen(path);
+    while (path_len > 1 && path[path_len - 1] == '/')
+        --path_len;
+    size_t base = path_len;
+    while (base > 0 && path[base - 1] != '/')
+        --base;
+
+    char *res = malloc(strlen(dir) + path_len - base + 2);
+    if (res)
+        sprintf(res, "%s/%.*s", dir, (int) (path_len - base), path + base);
+
+    return res;
 }
 
-int native_rmdir(const char *dir)
+/* Recursive copy that keeps the metadata, like cp -r --preserve=all, without
+   spawning it for every file. If dest is a directory, orig is copied into it */
+int native_copy(const char *orig, const char *dest)
 {
-    // noop, since Linux uses Lua's os.remove instead
-    return 0;
-}
+    struct copy_root root = {0};
+    struct stat st;
+
+    if (stat(dest, &st) < 0 || !S_ISDIR(st.st_mode))
+        return copy_entry(AT_FDCWD, orig, AT_FDCWD, dest, &root);
 
-#define close_files(out_file, err_file) \
-{\
-    if(err_file)\
-        close(err_file);\
-    if(out_file)\
-        close(out_file);\
+    char *target = path_in_dir(dest, orig);
+    if (!target)
+        return 0;
+
+    int ok = copy_entry(AT_FDCWD, orig, AT_FDCWD, target, &root);
+    free(target);
+
+    return ok;
 }
 
-struct native_run_result native_setup_proc_out(enum exec_opts_t opts,
-    const char *target_file, const char *err_target_file)
+int native_curdir(char *dir)
 {
-    struct native_run_result res;
-    res.tag = NATIVE_ERR_SUCCESS;
+    return getcwd(dir, 512) != NULL;
+}
 
-    // Open files before fork so that they can be closed in parent process
-    int eval_pipe_fd[2]; int out_target; int out_file = 0;
-    
-    if (opts & EXEC_OPTS_EVAL) {
-        pipe(eval_pipe_fd);
-    } else if (target_file) {
-        if (opts & EXEC_OPTS_APPEND_TO)
-            out_target = open(target_file, O_CREAT | O_APPEND | O_WRONLY, S_IRWXU);
-        else
-            out_target = open(target_file, O_CREAT | O_WRONLY | O_TRUNC, S_IRWXU);
+static int remove_dir(int dir_fd, const char *name);
+static int remove_tree(int dir_fd, const char *name);
 
-        if (out_target < 0) {
-            int execvpe_errno = errno;
-            switch (execvpe_errno) {
-                case EACCES:
-                    res.tag = NATIVE_ERR_PERMISSION;
-                    return res;
-                case EINTR:
-                    res.tag = NATIVE_ERR_INTERRUPT;
-                    return res;
-                case EMFILE: case ENFILE:
-                    res.tag = NATIVE_ERR_MAX;
-                    return res;
-                case ENAMETOOLONG:
-                    res.tag = NATIVE_ERR_VARIABLE_SIZE;
-                    return res;
-                default:
-                    return res;
-            }
-        }
-        out_file = out_target;
-    } else {
-        //Run statement without a target file just goes to stdout
-        out_target = STDOUT_FILENO;
+/* Removes everything inside the directory fd, which is closed. Nothing here
+   depends on the current directory, so it's never changed */
+static int remove_contents(int fd)
+{
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return 0;
     }
 
-    //Set err target
-    int err_target; int err_file = 0;
-    if (err_target_file) {
-        if (opts & EXEC_OPTS_APPEND_ERR)
-            err_target = open(err_target_file, O_CREAT | O_APPEND | O_WRONLY, S_IRWXU);
-        else
-            err_target = open(err_target_file, O_CREAT | O_WRONLY | O_TRUNC, S_IRWXU);
+    // A failed entry doesn't stop the others from being removed
+    int ok = 1, error = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
 
-        if (err_target < 0) {
-            int execvpe_errno = errno;
-            switch (execvpe_errno) {
-                case EACCES:
-                    res.tag = NATIVE_ERR_PERMISSION;
-                    if(out_file)
-                        close(out_file);
-                    return res;
-                case EINTR:
-                    res.tag = NATIVE_ERR_INTERRUPT;
-                    if(out_file)
-                        close(out_file);
-                    return res;
-                case EMFILE: case ENFILE:
-                    res.tag = NATIVE_ERR_MAX;
-                    if(out_file)
-                        close(out_file);
-                    return res;
-                case ENAMETOOLONG:
-                    res.tag = NATIVE_ERR_VARIABLE_SIZE;
-                    if(out_file)
-                        close(out_file);
-                    return res;
-                default:
-                    if(out_file)
-                        close(out_file);
-                    return res;
-            }
+        // The type saves trying to unlink directories first
+        int removed = entry->d_type == DT_DIR ?
+            remove_dir(fd, entry->d_name) : remove_tree(fd, entry->d_name);
+        if (!removed) {
+            ok = 0;
+            error = errno;
         }
-        err_file = err_target;
-    } else {
-        //Run statement without a target file just goes to stdout
-        err_target = STDERR_FILENO;
     }
+    closedir(dir);
 
-    /* Create pipe to communicate execvpe failure in the child */
-    int err_pipe_fd[2];
-    if (!(opts & EXEC_OPTS_BG))
-        pipe(err_pipe_fd);
+    errno = error;
+    return ok;
+}
 
-    //Create process that reads and prepares output
-    pid_t fork_res = fork();
-    if (fork_res < 0) {
-        res.tag = NATIVE_ERR_FORKFAILED;
-        close_files(out_file, err_file);
-        return res;
-    }
+static int remove_dir(int dir_fd, const char *name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
 
-    if (fork_res != 0) {
+    return remove_contents(fd) && unlinkat(dir_fd, name, AT_REMOVEDIR) == 0;
+}
 
-        if (!(opts & EXEC_OPTS_BG)) {
-            int execvpe_errno = 0;
-            close(err_pipe_fd[1]);
-            read(err_pipe_fd[0], &execvpe_errno, sizeof(execvpe_errno));
+/* Removes name and, if it's a directory, everything inside it. Links are
+   removed, never followed */
+static int remove_tree(int dir_fd, const char *name)
+{
+    if (unlinkat(dir_fd, name, 0) == 0)
+        return 1;
+    if (errno != EISDIR && errno != EPERM)
+        return 0;
 
-            switch (execvpe_errno) {
-            case 0:  // success
-                break;
-            case ENOMEM: case EAGAIN: case ENOSYS:
-                res.tag = NATIVE_ERR_FORKFAILED;
-                close_files(out_file, err_file);
-                return res;
-            case ENOENT:
-                res.tag = NATIVE_ERR_NOTFOUND;
-                close_files(out_file, err_file);
-                return res;
-            // TODO treat other exec errors
-            default:
-                close_files(out_file, err_file);
-                return res;
-            }
+    return remove_dir(dir_fd, name);
+}
 
-            int exit_code;
-            waitpid(fork_res, &exit_code, 0);
+/* More threads than this only fight over the same disk */
+#define DEL_MAX_THREADS 64
 
-            // Process is finished. Close files
-            close_files(out_file, err_file);
+/* Subdirectories of the directory being deleted, taken one by one by the
+   threads that remove them */
+struct del_work
+{
+    int dir_fd;
+    char **names;
+    size_t count;
+    size_t next;
+    int error;
+    pthread_mutex_t lock;
+};
 
-            // Get output from process
-            if (opts & EXEC_OPTS_EVAL) {
-                close(eval_pipe_fd[1]);
-                // Read bytes
-                int num_bytes = read(eval_pipe_fd[0] , res.out_string , EVAL_BUFFER_SIZE);
-                if (num_bytes >= 0) {
-                    res.out_string[num_bytes] = 0;
-                }
-                else {
-                    res.tag = NATIVE_ERR_INVALID;
-                    execvpe_errno = errno;
-                    switch (execvpe_errno) {
-                    case EINTR:
-                        res.tag = NATIVE_ERR_INTERRUPT;
-                        return res;
-                    default:
-                        return res;
-                    }
-                }
-            }
+static void *del_worker(void *arg)
+{
+    struct del_work *work = arg;
 
-            // Get exit code from last process
-            res.tag = NATIVE_ERR_SUCCESS;
-            res.exit_code = WEXITSTATUS(exit_code);
-        } else {
-            res.tag = NATIVE_ERR_BACKGROUND_SUCCESS;
-            res.pid = fork_res;
-        }
-        return res;
-    }
+    for (;;) {
+        pthread_mutex_lock(&work->lock);
+        size_t i = work->next < work->count ? work->next++ : work->count;
+        pthread_mutex_unlock(&work->lock);
+        if (i == work->count)
+            break;
 
-    // We're the child. Prepare to start processes
-    if (!(opts & EXEC_OPTS_BG)) {
-        close(err_pipe_fd[0]);
-        res.pipe_info.err_pipe_fd = err_pipe_fd[1];
+        if (!remove_tree(work->dir_fd, work->names[i])) {
+            int error = errno;
+            pthread_mutex_lock(&work->lock);
+            work->error = error;
+            pthread_mutex_unlock(&work->lock);
+        }
     }
 
-    if (opts & EXEC_OPTS_EVAL) {
-        close(eval_pipe_fd[0]);
-        out_target = eval_pipe_fd[1];
-    }
+    return NULL;
+}
 
-    if (opts & EXEC_OPTS_ERR_TO_OUT) {
-        res.pipe_info.error_fd = out_target;
-    } else {
-        res.pipe_info.error_fd = err_target;
-    }
-    
-    if (opts & EXEC_OPTS_OUT_TO_ERR) {
-        res.pipe_info.write_fd = err_target;
-    } else {
-        res.pipe_info.write_fd = out_target;
+/* Files right inside path are removed here; its subdirectories are split
+   among num_threads threads (this one included, 2 to DEL_MAX_THREADS) */
+static int remove_tree_threaded(const char *path, int num_threads)
+{
+    int fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0)
+            close(fd);
+        return 0;
     }
-    res.tag = NATIVE_ERR_IN_EXECUTE;
 
-    return res;
-}
+    struct del_work work = {dirfd(dir), NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
 
-struct native_run_result native_execute(
-    const char *executable, const char **exeargs, const char **envstrings,
-    enum exec_opts_t opts, struct native_run_result res, int index, const char *source_file)
-{
-    res.tag = NATIVE_ERR_IN_EXECUTE;
-    /* Execute setup run at beginning of recursive run */
-    const char **env = envstrings;
-    char **parent_env = environ;
-
-    for (; *env; ++env);  /* go to end of array */
-
-    /* Copy parent env to child env array */
-    for (; *parent_env; ++parent_env, ++env)
-        *env = *parent_env;
-    *env = NULL;
-
-    //Make pipe
-    int new_pipe[2];
-    pipe(new_pipe);
-
-    /* Fork the process to avoid the script being replaced by execvp */
-    pid_t fork_res = fork();
-    if (fork_res < 0) {
-        int execvpe_errno = 0;
-        execvpe_errno = errno;
-        //Errors in execute_pipe need to message the proc_out listener to clean up run execution
-        write(res.pipe_info.err_pipe_fd, &execvpe_errno, sizeof(execvpe_errno));
-        exit(0);
-    }
-
-    //Fork into two processes
-    if (fork_res != 0) {
-        //We're the parent. Start new process
-        dup2(res.pipe_info.write_fd, STDOUT_FILENO);
+        if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) {
+            if (unlinkat(work.dir_fd, entry->d_name, 0) < 0)
+                work.error = errno;
+            continue;
+        }
 
-        //Pipe to next process if this is not the first process
-        if (index > 0) {
-            close(new_pipe[1]);
-            dup2(new_pipe[0], STDIN_FILENO);
-        }
-        else if (source_file) {
-            int source;
-            source = open(source_file, O_RDONLY);
-            if (source < 0) {
-                int execvpe_errno = errno;
-                switch (execvpe_errno) {
-                    case EACCES:
-                        res.tag = NATIVE_ERR_PERMISSION;
-                        return res;
-                    case EINTR:
-                        res.tag = NATIVE_ERR_INTERRUPT;
-                        return res;
-                    case EMFILE: case ENFILE:
-                        res.tag = NATIVE_ERR_MAX;
-                        return res;
-                    case ENAMETOOLONG:
-                        res.tag = NATIVE_ERR_VARIABLE_SIZE;
-                        return res;
-                    case ENOENT: case ENOTDIR:
-                        res.tag = NATIVE_ERR_FILE_NOTFOUND;
-                        return res;
-                    default:
-                        return res;
-                }
+        if (work.count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 64;
+            char **new_names = realloc(work.names, new_capacity * sizeof(char *));
+            if (!new_names) {
+                work.error = ENOMEM;
+                break;
             }
-            //Set input of this first process to the source file
-            dup2(source, STDIN_FILENO);
+            work.names = new_names;
+            capacity = new_capacity;
         }
 
-        dup2(res.pipe_info.error_fd, STDERR_FILENO);
+        if (!(work.names[work.count] = strdup(entry->d_name))) {
+            work.error = ENOMEM;
+            break;
+        }
+        ++work.count;
+    }
 
-        //Start process
-        execvpe(executable, (char* const*) exeargs, (char* const*) envstrings);  /* should never return */
+    pthread_t threads[DEL_MAX_THREADS - 1];
+    int num_started = 0;
+    while ((size_t) num_started < work.count && num_started < num_threads - 1 &&
+            pthread_create(&threads[num_started], NULL, del_worker, &work) == 0)
+        ++num_started;
 
-        if (!(opts & EXEC_OPTS_BG)) {
-            // If execvpe ever returns, an error occurred:
-            int execvpe_errno = 0;
-            execvpe_errno = errno;
-            write(res.pipe_info.err_pipe_fd, &execvpe_errno, sizeof(execvpe_errno));
-        }
+    del_worker(&work);
+    for (int i = 0; i < num_started; ++i)
+        pthread_join(threads[i], NULL);
 
-        exit(0);
-    } else {
-        close(new_pipe[0]);
-        res.pipe_info.write_fd = new_pipe[1];
+    for (size_t i = 0; i < work.count; ++i)
+        free(work.names[i]);
+    free(work.names);
+    closedir(dir);
 
-        return res;
+    if (work.error) {
+        errno = work.error;
+        return 0;
     }
+
+    return unlinkat(AT_FDCWD, path, AT_REMOVEDIR) == 0;
+}
+
+int native_del(const char *path, int num_threads)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    if (num_threads > DEL_MAX_THREADS)
+        num_threads = DEL_MAX_THREADS;
+
+    int ok;
+    if (S_ISDIR(st.st_mode) && num_threads > 1)
+        ok = remove_tree_threaded(path, num_threads);
+    else
+        ok = remove_tree(AT_FDCWD, path);
+
+    return ok ? 1 : -1;
+}
+
+int native_exists(const char *path)
+{
+    struct stat st = {0};
+
+    return stat(path, &st) != -1;
+}
+
+int native_is_dir(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* The whole struct is one allocation; entries are read straight from the
+   kernel, many at a time */
+struct native_dir
+{
+    int fd;
+    size_t pos;
+    size_t len;
+    char buf[256 * 1024];
+};
+
+/* What getdents64 fills the buffer with */
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct native_dir *native_dir_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct native_dir *dir = malloc(sizeof(struct native_dir));
+    if (!dir) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    dir->fd = fd;
+    dir->pos = 0;
+    dir->len = 0;
+    return dir;
+}
+
+static enum native_entry_type entry_type_from_mode(mode_t mode)
+{
+    switch (mode & S_IFMT) {
+    case S_IFDIR: return NATIVE_ENTRY_DIR;
+    case S_IFREG: return NATIVE_ENTRY_FILE;
+    case S_IFBLK: return NATIVE_ENTRY_BLKDEV;
+    case S_IFCHR: return NATIVE_ENTRY_CHRDEV;
+    case S_IFIFO: return NATIVE_ENTRY_NAMEDPIPE;
+    case S_IFLNK: return NATIVE_ENTRY_SYMLINK;
+    case S_IFSOCK: return NATIVE_ENTRY_UDSOCKET;
+    default: return NATIVE_ENTRY_UNKNOWN;
+    }
+}
+
+int native_dir_next(struct native_dir *dir, const char **name, enum native_entry_type *type)
+{
+    for (;;) {
+        if (dir->pos >= dir->len) {
+            long len = syscall(SYS_getdents64, dir->fd, dir->buf, sizeof(dir->buf));
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len <= 0)
+                return len < 0 ? -1 : 0;
+
+            dir->pos = 0;
+            dir->len = len;
+        }
+
+        struct linux_dirent64 *entry = (struct linux_dirent64 *) (dir->buf + dir->pos);
+        dir->pos += entry->d_reclen;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        *name = entry->d_name;
+        switch (entry->d_type) {
+        case DT_DIR: *type = NATIVE_ENTRY_DIR; break;
+        case DT_REG: *type = NATIVE_ENTRY_FILE; break;
+        case DT_BLK: *type = NATIVE_ENTRY_BLKDEV; break;
+        case DT_CHR: *type = NATIVE_ENTRY_CHRDEV; break;
+        case DT_FIFO: *type = NATIVE_ENTRY_NAMEDPIPE; break;
+        case DT_LNK: *type = NATIVE_ENTRY_SYMLINK; break;
+        case DT_SOCK: *type = NATIVE_ENTRY_UDSOCKET; break;
+        default: {
+            // Some filesystems don't tell the type in the listing
+            struct stat st;
+            *type = fstatat(dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 ?
+                entry_type_from_mode(st.st_mode) : NATIVE_ENTRY_UNKNOWN;
+            break;
+        }
+        }
+
+        return 1;
+    }
+}
+
+void native_dir_close(struct native_dir *dir)
+{
+    close(dir->fd);
+    free(dir);
+}
+
+/* Fills the requested fields that stat always gets, for kernels without
+   statx */
+static void fill_native_stat(const struct stat *sb, unsigned fields, struct native_stat *st)
+{
+    st->fields = fields;
+    st->type = entry_type_from_mode(sb->st_mode);
+    st->size = sb->st_size;
+    st->mode = sb->st_mode & 07777;
+    st->mtime = sb->st_mtim.tv_sec + sb->st_mtim.tv_nsec / 1e9;
+    st->atime = sb->st_atim.tv_sec + sb->st_atim.tv_nsec / 1e9;
+    st->ctime = sb->st_ctim.tv_sec + sb->st_ctim.tv_nsec / 1e9;
+    st->uid = sb->st_uid;
+    st->gid = sb->st_gid;
+}
+
+int native_stat(const char *path, unsigned fields, int follow_links, struct native_stat *st)
+{
+    int flags = follow_links ? 0 : AT_SYMLINK_NOFOLLOW;
+
+#ifdef STATX_TYPE
+    // Only what was asked for is fetched, which spares the filesystem from
+    // working out the rest (like the times on network filesystems)
+    static const unsigned statx_masks[][2] = {
+        {NATIVE_STAT_TYPE, STATX_TYPE},
+        {NATIVE_STAT_SIZE, STATX_SIZE},
+        {NATIVE_STAT_MODE, STATX_MODE},
+        {NATIVE_STAT_MTIME, STATX_MTIME},
+        {NATIVE_STAT_ATIME, STATX_ATIME},
+        {NATIVE_STAT_CTIME, STATX_CTIME},
+        {NATIVE_STAT_UID, STATX_UID},
+        {NATIVE_STAT_GID, STATX_GID}
+    };
+    const size_t num_masks = sizeof(statx_masks) / sizeof(statx_masks[0]);
+
+    unsigned mask = 0;
+    for (size_t i = 0; i < num_masks; ++i) {
+        if (fields & statx_masks[i][0])
+            mask |= statx_masks[i][1];
+    }
+
+    struct statx stx;
+    if (statx(AT_FDCWD, path, flags, mask, &stx) == 0) {
+        st->fields = 0;
+        for (size_t i = 0; i < num_masks; ++i) {
+            if ((fields & statx_masks[i][0]) && (stx.stx_mask & statx_masks[i][1]))
+                st->fields |= statx_masks[i][0];
+        }
+
+        st->type = entry_type_from_mode(stx.stx_mode);
+        st->size = stx.stx_size;
+        st->mode = stx.stx_mode & 07777;
+        st->mtime = stx.stx_mtime.tv_sec + stx.stx_mtime.tv_nsec / 1e9;
+        st->atime = stx.stx_atime.tv_sec + stx.stx_atime.tv_nsec / 1e9;
+        st->ctime = stx.stx_ctime.tv_sec + stx.stx_ctime.tv_nsec / 1e9;
+        st->uid = stx.stx_uid;
+        st->gid = stx.stx_gid;
+        return 1;
+    }
+
+    if (errno != ENOSYS)
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+#endif
+
+    struct stat sb;
+    if (fstatat(AT_FDCWD, path, &sb, flags) < 0)
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+
+    fill_native_stat(&sb, fields, st);
+    return 1;
+}
+
+const char *native_map_file(const char *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // mmap refuses empty mappings
+    *len = st.st_size;
+    if (*len == 0) {
+        close(fd);
+        return "";
+    }
+
+    // The mapping keeps the file alive by itself
+    void *data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    return data;
+}
+
+void native_unmap_file(const char *data, size_t len)
+{
+    if (len > 0)
+        munmap((void *) data, len);
+}
+
+/* An entry found by the walk; directories that are descended into go back to
+   the workers the same way */
+struct walk_entry
+{
+    struct walk_entry *next;
+    int depth;
+    enum native_entry_type type;
+    int is_dir;
+    dev_t dev;
+    ino_t ino;
+    size_t rel;  /* where the part of path relative to the root starts */
+    char path[];
+};
+
+struct walk_link
+{
+    dev_t dev;
+    ino_t ino;
+};
+
+/* Workers read the directories in dirs and queue what they find in results,
+   which is drained by the thread that runs Lua. That thread decides which
+   directories are descended into, so it can ask the prune predicate */
+struct native_walk
+{
+    int root_fd;
+    int follow_links;
+    size_t root_len;
+
+    pthread_mutex_t lock;
+    pthread_cond_t has_dirs;
+    pthread_cond_t has_results;
+    pthread_cond_t has_room;
+    struct walk_entry *dirs;
+    struct walk_entry *results;
+    struct walk_entry *results_tail;
+    size_t result_count;
+    int busy;  /* workers reading a directory */
+    int stop;
+    int error;  /* errno of a failure that left entries out, reported by native_walk_next */
+
+    struct walk_entry *last;  /* returned by native_walk_next */
+
+    /* Directories already reached through links, so loops end */
+    struct walk_link *linked_dirs;
+    size_t linked_count;
+    size_t linked_capacity;
+
+    int num_threads;
+    pthread_t threads[];
+};
+
+#define WALK_QUEUE_MAX 4096
+#define WALK_BATCH 256
+
+static struct walk_entry *make_walk_entry(struct native_walk *walk,
+    const struct walk_entry *parent, const char *name)
+{
+    size_t parent_len = strlen(parent->path);
+    size_t name_len = strlen(name);
+    int has_sep = parent_len > 0 && parent->path[parent_len - 1] != '/';
+
+    struct walk_entry *entry = malloc(
+        sizeof(struct walk_entry) + parent_len + has_sep + name_len + 1);
+    if (!entry)
+        return NULL;
+
+    memcpy(entry->path, parent->path, parent_len);
+    if (has_sep)
+        entry->path[parent_len] = '/';
+    memcpy(entry->path + parent_len + has_sep, name, name_len + 1);
+
+    entry->next = NULL;
+    entry->depth = parent->depth + 1;
+    entry->is_dir = 0;
+    entry->rel = parent->depth == 0 ? walk->root_len + has_sep : parent->rel;
+    return entry;
+}
+
+/* Queues a batch of results, waiting while the queue is full */
+static int push_walk_results(struct native_walk *walk, struct walk_entry *first,
+    struct walk_entry *last, size_t count)
+{
+    pthread_mutex_lock(&walk->lock);
+    while (walk->result_count >= WALK_QUEUE_MAX && !walk->stop)
+        pthread_cond_wait(&walk->has_room, &walk->lock);
+
+    int stop = walk->stop;
+    if (!stop) {
+        if (walk->results_tail)
+            walk->results_tail->next = first;
+        else
+            walk->results = first;
+        walk->results_tail = last;
+        walk->result_count += count;
+        pthread_cond_signal(&walk->has_results);
+    }
+    pthread_mutex_unlock(&walk->lock);
+
+    // Nobody will read them
+    while (stop && first) {
+        struct walk_entry *next = first->next;
+        free(first);
+        first = next;
+    }
+
+    return !stop;
+}
+
+static void set_walk_error(struct native_walk *walk, int error)
+{
+    pthread_mutex_lock(&walk->lock);
+    walk->error = error;
+    pthread_cond_signal(&walk->has_results);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+/* Unreadable directories are skipped */
+static void read_walk_dir(struct native_walk *walk, struct native_dir *dir,
+    const struct walk_entry *parent)
+{
+    const char *rel = parent->depth == 0 ? "." : parent->path + parent->rel;
+    int fd = openat(walk->root_fd, rel,
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC | (walk->follow_links ? 0 : O_NOFOLLOW));
+    if (fd < 0)
+        return;
+
+    dir->fd = fd;
+    dir->pos = 0;
+    dir->len = 0;
+
+    struct walk_entry *first = NULL, *last = NULL;
+    size_t count = 0;
+    const char *name;
+    enum native_entry_type type;
+
+    while (native_dir_next(dir, &name, &type) > 0) {
+        struct walk_entry *entry = make_walk_entry(walk, parent, name);
+        if (!entry) {
+            set_walk_error(walk, ENOMEM);
+            break;
+        }
+
+        entry->type = type;
+        entry->is_dir = type == NATIVE_ENTRY_DIR;
+        if (type == NATIVE_ENTRY_SYMLINK && walk->follow_links) {
+            struct stat st;
+            if (fstatat(fd, name, &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+                entry->is_dir = 1;
+                entry->dev = st.st_dev;
+                entry->ino = st.st_ino;
+            }
+        }
+
+        if (last)
+            last->next = entry;
+        else
+            first = entry;
+        last = entry;
+
+        if (++count == WALK_BATCH) {
+            if (!push_walk_results(walk, first, last, count))
+                break;
+            first = last = NULL;
+            count = 0;
+        }
+    }
+    close(fd);
+
+    if (first)
+        push_walk_results(walk, first, last, count);
+}
+
+static void *walk_worker(void *arg)
+{
+    struct native_walk *walk = arg;
+    struct native_dir *dir = malloc(sizeof(struct native_dir));
+
+    pthread_mutex_lock(&walk->lock);
+    if (!dir)
+        walk->error = ENOMEM;
+    for (;;) {
+        while (!walk->dirs && !walk->stop)
+            pthread_cond_wait(&walk->has_dirs, &walk->lock);
+        if (walk->stop)
+            break;
+
+        struct walk_entry *parent = walk->dirs;
+        walk->dirs = parent->next;
+        ++walk->busy;
+        pthread_mutex_unlock(&walk->lock);
+
+        if (dir)
+            read_walk_dir(walk, dir, parent);
+        free(parent);
+
+        pthread_mutex_lock(&walk->lock);
+        --walk->busy;
+        // The walk may be over
+        pthread_cond_signal(&walk->has_results);
+    }
+    pthread_mutex_unlock(&walk->lock);
+
+    free(dir);
+    return NULL;
+}
+
+struct native_walk *native_walk_open(const char *root, int num_threads, int follow_links)
+{
+    if (num_threads < 1)
+        num_threads = 1;
+
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    size_t root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/')
+        --root_len;
+
+    struct native_walk *walk = calloc(1, sizeof(struct native_walk) +
+        num_threads * sizeof(pthread_t));
+    struct walk_entry *start = malloc(sizeof(struct walk_entry) + root_len + 1);
+    if (!walk || !start) {
+        free(walk);
+        free(start);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memcpy(start->path, root, root_len);
+    start->path[root_len] = 0;
+    start->next = NULL;
+    start->depth = 0;
+    start->rel = root_len;
+
+    walk->root_fd = fd;
+    walk->follow_links = follow_links;
+    walk->root_len = root_len;
+    walk->dirs = start;
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->has_dirs, NULL);
+    pthread_cond_init(&walk->has_results, NULL);
+    pthread_cond_init(&walk->has_room, NULL);
+
+    for (int i = 0; i < num_threads; ++i) {
+        if (pthread_create(&walk->threads[walk->num_threads], NULL, walk_worker, walk) == 0)
+            ++walk->num_threads;
+    }
+
+    if (walk->num_threads == 0) {
+        native_walk_close(walk);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    return walk;
+}
+
+int native_walk_next(struct native_walk *walk, const char **path,
+    enum native_entry_type *type, int *depth, int *is_dir)
+{
+    free(walk->last);
+    walk->last = NULL;
+
+    pthread_mutex_lock(&walk->lock);
+    while (!walk->results && !walk->error) {
+        // Nothing left to read and nobody reading
+        if (!walk->dirs && walk->busy == 0) {
+            pthread_mutex_unlock(&walk->lock);
+            return 0;
+        }
+        pthread_cond_wait(&walk->has_results, &walk->lock);
+    }
+
+    // Entries were left out, so the walk can't go on as if it was complete
+    if (walk->error) {
+        errno = walk->error;
+        pthread_mutex_unlock(&walk->lock);
+        return -1;
+    }
+
+    struct walk_entry *entry = walk->results;
+    walk->results = entry->next;
+    if (!walk->results)
+        walk->results_tail = NULL;
+    if (walk->result_count-- == WALK_QUEUE_MAX)
+        pthread_cond_broadcast(&walk->has_room);
+    pthread_mutex_unlock(&walk->lock);
+
+    entry->next = NULL;
+    walk->last = entry;
+    *path = entry->path;
+    *type = entry->type;
+    *depth = entry->depth;
+    *is_dir = entry->is_dir;
+    return 1;
+}
+
+void native_walk_descend(struct native_walk *walk)
+{
+    struct walk_entry *entry = walk->last;
+    if (!entry || !entry->is_dir)
+        return;
+
+    if (entry->type == NATIVE_ENTRY_SYMLINK) {
+        for (size_t i = 0; i < walk->linked_count; ++i) {
+            if (walk->linked_dirs[i].dev == entry->dev &&
+                    walk->linked_dirs[i].ino == entry->ino)
+                return;
+        }
+
+        if (walk->linked_count == walk->linked_capacity) {
+            size_t new_capacity = walk->linked_capacity ? walk->linked_capacity * 2 : 16;
+            struct walk_link *new_dirs =
+                realloc(walk->linked_dirs, new_capacity * sizeof(struct walk_link));
+            if (!new_dirs) {
+                set_walk_error(walk, ENOMEM);
+                return;
+            }
+            walk->linked_dirs = new_dirs;
+            walk->linked_capacity = new_capacity;
+        }
+        walk->linked_dirs[walk->linked_count].dev = entry->dev;
+        walk->linked_dirs[walk->linked_count].ino = entry->ino;
+        ++walk->linked_count;
+    }
+
+    // The workers own it now
+    walk->last = NULL;
+    pthread_mutex_lock(&walk->lock);
+    entry->next = walk->dirs;
+    walk->dirs = entry;
+    pthread_cond_signal(&walk->has_dirs);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void free_walk_entries(struct walk_entry *entry)
+{
+    while (entry) {
+        struct walk_entry *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+}
+
+void native_walk_close(struct native_walk *walk)
+{
+    pthread_mutex_lock(&walk->lock);
+    walk->stop = 1;
+    pthread_cond_broadcast(&walk->has_dirs);
+    pthread_cond_broadcast(&walk->has_room);
+    pthread_mutex_unlock(&walk->lock);
+
+    for (int i = 0; i < walk->num_threads; ++i)
+        pthread_join(walk->threads[i], NULL);
+
+    free_walk_entries(walk->dirs);
+    free_walk_entries(walk->results);
+    free(walk->last);
+    free(walk->linked_dirs);
+    close(walk->root_fd);
+
+    pthread_mutex_destroy(&walk->lock);
+    pthread_cond_destroy(&walk->has_dirs);
+    pthread_cond_destroy(&walk->has_results);
+    pthread_cond_destroy(&walk->has_room);
+    free(walk);
+}
+
+static struct native_job_result job_result_from_status(int status_code)
+{
+    // Default return: error termination (failed)
+    struct native_job_result res = {NATIVE_ERR_BACKGROUND_FAILED, 0};
+
+    if (WIFEXITED(status_code)) {
+        // Test if the process exited normally. If this returns false, the process errored out
+        res.tag = NATIVE_ERR_BACKGROUND_FINISHED;
+        res.exit_code = WEXITSTATUS(status_code);
+    } else if (WIFSTOPPED(status_code)) {
+        res.tag = NATIVE_ERR_BACKGROUND_SUSPENDED;
+    } else if (WIFCONTINUED(status_code)) {
+        res.tag = NATIVE_ERR_BACKGROUND_RESUMED;
+    }
+
+    return res;
+}
+
+/* Children that outlive the call that spawned them (background jobs, the
+   other stages of their pipelines and the stages of eval streams) are
+   tracked here, so they can be reaped as soon as they finish instead of
+   being polled one by one. Each child gets a pidfd in an epoll set; on
+   kernels without pidfd_open, SIGCHLD is read from a signalfd instead and
+   the children that changed are found with waitid(P_ALL) */
+enum job_kind {
+    JOB_KIND_JOB,
+    JOB_KIND_STAGE,
+    JOB_KIND_STREAM
+};
+
+struct job_record
+{
+    pid_t pid;
+    int pidfd;
+    enum job_kind kind;
+    int is_finished;
+    int status_code;
+    struct native_job_result result;
+    struct job_record *next;
+};
+
+#define JOB_BUCKETS 256
+
+static struct job_record *job_buckets[JOB_BUCKETS];
+static int num_tracked_jobs = 0;
+static int reaper_epfd = -1;
+static int reaper_sigfd = -1;
+static int reaper_has_pidfd = 1;
+
+/* pids of jobs whose state changed and wasn't reported yet */
+static pid_t *changed_jobs = NULL;
+static int changed_jobs_len = 0;
+static int changed_jobs_cap = 0;
+
+static struct job_record *find_job(pid_t pid)
+{
+    struct job_record *rec = job_buckets[pid % JOB_BUCKETS];
+    for (; rec && rec->pid != pid; rec = rec->next);
+
+    return rec;
+}
+
+static void forget_job(struct job_record *rec)
+{
+    struct job_record **link = &job_buckets[rec->pid % JOB_BUCKETS];
+    for (; *link != rec; link = &(*link)->next);
+    *link = rec->next;
+
+    // Closing the pidfd also takes it out of the epoll set
+    if (rec->pidfd >= 0)
+        close(rec->pidfd);
+    if (rec->kind == JOB_KIND_JOB)
+        --num_tracked_jobs;
+
+    free(rec);
+}
+
+static int reaper_init(void)
+{
+    if (reaper_epfd >= 0)
+        return 1;
+
+    reaper_epfd = epoll_create1(EPOLL_CLOEXEC);
+    return reaper_epfd >= 0;
+}
+
+static int reaper_init_sigfd(void)
+{
+    if (reaper_sigfd >= 0)
+        return 1;
+
+    // SIGCHLD has to be blocked to be read from the signalfd. Children get
+    // their mask reset by native_execute
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    reaper_sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (reaper_sigfd < 0)
+        return 0;
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    return epoll_ctl(reaper_epfd, EPOLL_CTL_ADD, reaper_sigfd, &ev) == 0;
+}
+
+static void queue_changed_job(pid_t pid)
+{
+    if (changed_jobs_len == changed_jobs_cap) {
+        int new_cap = changed_jobs_cap ? changed_jobs_cap * 2 : 16;
+        pid_t *new_changed = realloc(changed_jobs, new_cap * sizeof(pid_t));
+        if (!new_changed)
+            return;
+
+        changed_jobs = new_changed;
+        changed_jobs_cap = new_cap;
+    }
+
+    changed_jobs[changed_jobs_len++] = pid;
+}
+
+static void record_job_status(struct job_record *rec, int status_code)
+{
+    struct native_job_result result = job_result_from_status(status_code);
+    rec->status_code = status_code;
+    rec->result = result;
+
+    if (result.tag == NATIVE_ERR_BACKGROUND_FINISHED ||
+            result.tag == NATIVE_ERR_BACKGROUND_FAILED) {
+        rec->is_finished = 1;
+        if (rec->pidfd >= 0) {
+            close(rec->pidfd);
+            rec->pidfd = -1;
+        }
+    }
+
+    switch (rec->kind) {
+    case JOB_KIND_JOB:
+        queue_changed_job(rec->pid);
+        break;
+    case JOB_KIND_STAGE:
+        // Nobody is interested in how stages end
+        if (rec->is_finished)
+            forget_job(rec);
+        break;
+    case JOB_KIND_STREAM:
+        // Kept until the stream is closed
+        break;
+    }
+}
+
+static void track_child(pid_t pid, enum job_kind kind)
+{
+    struct job_record *rec = malloc(sizeof(struct job_record));
+
+    // If it can't be tracked, it will only be reaped by waitpid
+    if (!rec || !reaper_init()) {
+        free(rec);
+        return;
+    }
+
+    rec->pid = pid;
+    rec->pidfd = -1;
+    rec->kind = kind;
+    rec->is_finished = 0;
+    rec->status_code = 0;
+    rec->result.tag = NATIVE_ERR_BACKGROUND_RESUMED;
+    rec->result.exit_code = 0;
+
+    if (reaper_has_pidfd) {
+        rec->pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (rec->pidfd < 0 && errno == ENOSYS)
+            reaper_has_pidfd = 0;
+    }
+
+    if (rec->pidfd >= 0) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = rec;
+        if (epoll_ctl(reaper_epfd, EPOLL_CTL_ADD, rec->pidfd, &ev) < 0) {
+            close(rec->pidfd);
+            rec->pidfd = -1;
+        }
+    }
+
+    // Without a pidfd (even if others have one, e.g. when out of
+    // descriptors) the child is only noticed through SIGCHLD
+    if (rec->pidfd < 0)
+        reaper_init_sigfd();
+
+    rec->next = job_buckets[pid % JOB_BUCKETS];
+    job_buckets[pid % JOB_BUCKETS] = rec;
+
+    if (kind == JOB_KIND_JOB)
+        ++num_tracked_jobs;
+
+    // Its SIGCHLD may have been consumed before it was tracked
+    int status_code;
+    if (rec->pidfd < 0 &&
+            waitpid(pid, &status_code, WNOHANG | WUNTRACED | WCONTINUED) > 0)
+        record_job_status(rec, status_code);
+}
+
+static void reap_sigchld(void)
+{
+    struct signalfd_siginfo sig;
+    while (read(reaper_sigfd, &sig, sizeof(sig)) > 0);
+
+    // Signals are merged, so one SIGCHLD may stand for many children. Only
+    // tracked children are checked, as the others are waited on elsewhere,
+    // and the ones with a pidfd are left to their own event: a stage reaped
+    // here would be freed while that event may still be pending
+    for (int i = 0; i < JOB_BUCKETS; ++i) {
+        struct job_record *rec = job_buckets[i];
+        while (rec) {
+            struct job_record *next = rec->next;
+            int status_code;
+
+            if (!rec->is_finished && rec->pidfd < 0 &&
+                    waitpid(rec->pid, &status_code, WNOHANG | WUNTRACED | WCONTINUED) > 0)
+                record_job_status(rec, status_code);
+
+            rec = next;
+        }
+    }
+}
+
+/* Wait up to timeout_ms (-1 for no limit) for children to change state */
+static void reap_events(int timeout_ms)
+{
+    struct epoll_event events[64];
+
+    if (reaper_epfd < 0)
+        return;
+
+    int num_events = epoll_wait(reaper_epfd, events, 64, timeout_ms);
+    for (int i = 0; i < num_events; ++i) {
+        struct job_record *rec = events[i].data.ptr;
+
+        if (!rec) {
+            reap_sigchld();
+            continue;
+        }
+
+        int status_code;
+        if (waitpid(rec->pid, &status_code, WNOHANG | WUNTRACED | WCONTINUED) > 0)
+            record_job_status(rec, status_code);
+    }
+}
+
+int native_job_events(int timeout_ms, struct native_job_event *events, int max_events)
+{
+    int num_events = 0;
+    double deadline = native_clock() + timeout_ms / 1000.0;
+    int wait_ms = 0;
+
+    for (;;) {
+        reap_events(wait_ms);
+
+        int kept = 0;
+        for (int i = 0; i < changed_jobs_len; ++i) {
+            struct job_record *rec = find_job(changed_jobs[i]);
+
+            // Reported by native_job_status in the meantime
+            if (!rec || rec->kind != JOB_KIND_JOB)
+                continue;
+
+            if (num_events == max_events) {
+                changed_jobs[kept++] = changed_jobs[i];
+                continue;
+            }
+
+            events[num_events].pid = rec->pid;
+            events[num_events].result = rec->result;
+            ++num_events;
+
+            if (rec->is_finished)
+                forget_job(rec);
+        }
+        changed_jobs_len = kept;
+
+        // Stages of pipelines also wake us up; keep waiting until a job
+        // changes, unless there's nothing left to wait for
+        if (num_events > 0 || timeout_ms == 0 || num_tracked_jobs == 0)
+            break;
+
+        if (timeout_ms < 0) {
+            wait_ms = -1;
+        } else {
+            wait_ms = (deadline - native_clock()) * 1000;
+            if (wait_ms <= 0)
+                break;
+        }
+    }
+
+    if (num_events == 0 && num_tracked_jobs == 0)
+        return -1;
+
+    return num_events;
+}
+
+struct native_job_result native_job_status(const int pid, int is_wait)
+{
+    int status_code;
+    int opts = 0;
+
+    // It may have been reaped already
+    struct job_record *rec = find_job(pid);
+    if (rec && rec->is_finished) {
+        struct native_job_result res = rec->result;
+        forget_job(rec);
+        return res;
+    }
+
+    if (!is_wait) {
+        opts = opts | WNOHANG | WUNTRACED | WCONTINUED;
+    }
+    
+    pid_t result = waitpid(pid, &status_code, opts);
+
+    struct native_job_result res = {NATIVE_ERR_BACKGROUND_UNCHANGED, 0};
+    if (result == 0) {
+        // Nothing has changed
+        return res;
+    } else if (result == -1) {
+        // Error
+        switch (errno) {
+            case ECHILD:
+                res.tag = NATIVE_ERR_NOTFOUND;
+                return res;
+            default:
+                res.tag = NATIVE_ERR_INVALID;
+                return res;
+        }
+    } else {
+        res = job_result_from_status(status_code);
+        if (rec) {
+            rec->status_code = status_code;
+            if (res.tag == NATIVE_ERR_BACKGROUND_FINISHED ||
+                    res.tag == NATIVE_ERR_BACKGROUND_FAILED)
+                forget_job(rec);
+            else
+                rec->result = res;
+        }
+
+        return res;
+    }
+}
+
+static struct native_job_result native_job_signal(const int pid, int signal)
+{
+    int status = kill(pid, signal);
+    if (status < 0) {
+        struct native_job_result res = {NATIVE_ERR_INVALID, 0};
+        switch (errno) {
+            case EPERM:
+                res.tag = NATIVE_ERR_PERMISSION;
+                return res;
+            case ESRCH:
+                res.tag = NATIVE_ERR_NOTFOUND;
+                return res;
+            default:
+                return res;
+        }
+    } else {
+        struct native_job_result res = {NATIVE_ERR_SUCCESS, 1};
+        return res;
+    }
+}
+
+struct native_job_result native_job_kill(const int pid, int is_kill)
+{
+    int signal;
+    if (is_kill) {
+        signal = SIGKILL;
+    } else {
+        signal = SIGTERM;
+    }
+    return native_job_signal(pid, signal);
+}
+
+struct native_job_result native_job_set_active(const int pid, int is_suspend)
+{
+    int signal;
+    if (is_suspend) {
+        signal = SIGSTOP;
+    } else {
+        signal = SIGCONT;
+    }
+    return native_job_signal(pid, signal);
+}
+
+int native_cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? count : 1;
+}
+
+double native_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int native_mkdir(const char *dir)
+{
+    // If directory already exists, return false
+    if (native_exists(dir))
+        return 0;
+
+    // rwx permissions to owner
+    // rx to everyone else
+    mkdir(dir, 0755);
+    return 1;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+
+        buf += written;
+        len -= written;
+    }
+
+    return 1;
+}
+
+/* Moves everything left in src to dst in the kernel: copy_file_range between
+   regular files (which may share the blocks on filesystems that support it),
+   splice if either of them is a pipe and sendfile from regular files. Other
+   files are copied by hand */
+long long native_pump(FILE *src, FILE *dst)
+{
+    char buf[65536];
+    int in_fd = fileno(src);
+    int out_fd = fileno(dst);
+    struct stat in_st, out_st;
+    long long total = 0;
+
+    // Whatever the streams have buffered comes first. Seekable sources just
+    // go back to where they were read up to
+    if (fflush(dst) != 0)
+        return -1;
+    off_t pos = ftello(src);
+    if (pos >= 0) {
+        lseek(in_fd, pos, SEEK_SET);
+    } else {
+#ifdef __GLIBC__
+        // Pipes can't go back, so what was read into the buffer is written
+        // out from it
+        size_t buffered = src->_IO_read_end - src->_IO_read_ptr;
+        if (buffered > 0) {
+            if (!write_all(out_fd, src->_IO_read_ptr, buffered))
+                return -1;
+            src->_IO_read_ptr = src->_IO_read_end;
+            total += buffered;
+        }
+#else
+        // There's no telling what's buffered, so it could be lost
+        if (__freading(src)) {
+            errno = EINVAL;
+            return -1;
+        }
+#endif
+    }
+
+    if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0)
+        return -1;
+
+    int can_copy_range = S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode);
+    int can_splice = S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode);
+    int can_sendfile = S_ISREG(in_st.st_mode);
+
+    for (;;) {
+        ssize_t num_bytes;
+
+        if (can_copy_range) {
+            num_bytes = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0);
+
+            // Some filesystems (like procfs) claim to be empty; let the
+            // other methods make sure
+            if ((num_bytes < 0 && errno != EINTR) || (num_bytes == 0 && total == 0)) {
+                can_copy_range = 0;
+                continue;
+            }
+        } else if (can_splice) {
+            num_bytes = splice(in_fd, NULL, out_fd, NULL, 1 << 20, SPLICE_F_MOVE);
+            if (num_bytes < 0 && errno == EINVAL) {
+                can_splice = 0;
+                continue;
+            }
+        } else if (can_sendfile) {
+            num_bytes = sendfile(out_fd, in_fd, NULL, 1 << 30);
+            if (num_bytes < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                can_sendfile = 0;
+                continue;
+            }
+        } else {
+            num_bytes = read(in_fd, buf, sizeof(buf));
+            if (num_bytes > 0 && !write_all(out_fd, buf, num_bytes))
+                return -1;
+        }
+
+        if (num_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (num_bytes == 0)
+            break;
+
+        total += num_bytes;
+    }
+
+    // The streams have to continue from where the descriptors are now
+    pos = lseek(in_fd, 0, SEEK_CUR);
+    if (pos >= 0)
+        fseeko(src, pos, SEEK_SET);
+    pos = lseek(out_fd, 0, SEEK_CUR);
+    if (pos >= 0)
+        fseeko(dst, pos, SEEK_SET);
+
+    return total;
+}
+
+struct native_out_file
+{
+    int fd;
+    char *path;
+    char *tmp_path;  /* where atomic files are written until committed */
+};
+
+struct native_out_file *native_out_open(const char *path, int is_append, int is_atomic)
+{
+    struct native_out_file *f = calloc(1, sizeof(struct native_out_file));
+    if (!f)
+        return NULL;
+
+    if (!is_atomic) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (is_append ? O_APPEND : O_TRUNC);
+        f->fd = open(path, flags, 0666);
+        if (f->fd < 0) {
+            free(f);
+            return NULL;
+        }
+
+        return f;
+    }
+
+    // The temporary file goes next to the real one, so the rename can't
+    // cross filesystems
+    static unsigned num_tmp_files = 0;
+    f->path = strdup(path);
+    f->tmp_path = malloc(strlen(path) + 32);
+    f->fd = -1;
+    if (f->path && f->tmp_path) {
+        do {
+            sprintf(f->tmp_path, "%s.tmp%d.%u", path, (int) getpid(), num_tmp_files++);
+            f->fd = open(f->tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        } while (f->fd < 0 && errno == EEXIST);
+    }
+
+    if (f->fd < 0) {
+        int error = f->path && f->tmp_path ? errno : ENOMEM;
+        free(f->path);
+        free(f->tmp_path);
+        free(f);
+        errno = error;
+        return NULL;
+    }
+
+    // The file being replaced keeps its permissions
+    struct stat st;
+    if (stat(path, &st) == 0)
+        fchmod(f->fd, st.st_mode & 07777);
+
+    return f;
+}
+
+int native_out_write(struct native_out_file *f, const char *data, size_t len)
+{
+    return write_all(f->fd, data, len);
+}
+
+/* The rename is only durable once the directory is synced too */
+static void sync_parent_dir(const char *path)
+{
+    const char *sep = strrchr(path, '/');
+    char *dir = sep ? strndup(path, sep == path ? 1 : (size_t) (sep - path)) : strdup(".");
+    if (!dir)
+        return;
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+int native_out_close(struct native_out_file *f, int is_commit)
+{
+    int ok = 1;
+    if (f->tmp_path && is_commit)
+        ok = fsync(f->fd) == 0;
+    ok = close(f->fd) == 0 && ok;
+
+    if (f->tmp_path) {
+        if (ok && is_commit)
+            ok = rename(f->tmp_path, f->path) == 0;
+
+        if (ok && is_commit) {
+            sync_parent_dir(f->path);
+        } else {
+            int error = errno;
+            unlink(f->tmp_path);
+            errno = error;
+        }
+    }
+
+    free(f->path);
+    free(f->tmp_path);
+    free(f);
+    return ok;
+}
+
+const char **native_parent_env(void)
+{
+    return (const char **) environ;
+}
+
+/* Like mv: a rename, unless orig and dest are on different filesystems, in
+   which case orig is copied and then removed. If dest is a directory, orig
+   is moved into it */
+int native_move(const char *orig, const char *dest)
+{
+    struct stat st;
+    char *target = NULL;
+
+    if (stat(dest, &st) == 0 && S_ISDIR(st.st_mode)) {
+        target = path_in_dir(dest, orig);
+        if (!target)
+            return 0;
+        dest = target;
+    }
+
+    int ok = renameat2(AT_FDCWD, orig, AT_FDCWD, dest, 0) == 0;
+    if (!ok && errno == EXDEV) {
+        struct copy_root root = {0};
+
+        // Nothing is removed unless everything was copied
+        ok = copy_entry(AT_FDCWD, orig, AT_FDCWD, dest, &root) &&
+            remove_tree(AT_FDCWD, orig);
+    }
+
+    free(target);
+    return ok;
+}
+
+int native_rmdir(const char *dir)
+{
+    // noop, since Linux uses Lua's os.remove instead
+    return 0;
+}
+
+/* Absolute paths of the commands found in PATH, like the shell's hash. It's
+   thrown away when PATH changes */
+struct hashed_command
+{
+    const char *name;
+    const char *path;
+    struct hashed_command *next;
+};
+
+#define COMMAND_BUCKETS 128
+
+static struct hashed_command *command_buckets[COMMAND_BUCKETS];
+static char *hashed_path_var = NULL;
+
+static unsigned command_hash(const char *name)
+{
+    unsigned hash = 2166136261u;
+    for (; *name; ++name)
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+
+    return hash % COMMAND_BUCKETS;
+}
+
+void native_hash_clear(void)
+{
+    for (int i = 0; i < COMMAND_BUCKETS; ++i) {
+        while (command_buckets[i]) {
+            struct hashed_command *cmd = command_buckets[i];
+            command_buckets[i] = cmd->next;
+            free(cmd);
+        }
+    }
+
+    free(hashed_path_var);
+    hashed_path_var = NULL;
+}
+
+static void forget_command(const char *name)
+{
+    struct hashed_command **link = &command_buckets[command_hash(name)];
+    for (; *link; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            struct hashed_command *cmd = *link;
+            *link = cmd->next;
+            free(cmd);
+            return;
+        }
+    }
+}
+
+static const char *hash_command(const char *name, const char *path)
+{
+    size_t name_size = strlen(name) + 1;
+    size_t path_size = strlen(path) + 1;
+
+    // The strings go in the same allocation as the entry
+    struct hashed_command *cmd = malloc(sizeof(struct hashed_command) + name_size + path_size);
+    if (!cmd)
+        return NULL;
+
+    char *strings = (char *) (cmd + 1);
+    memcpy(strings, name, name_size);
+    memcpy(strings + name_size, path, path_size);
+    cmd->name = strings;
+    cmd->path = strings + name_size;
+
+    unsigned bucket = command_hash(name);
+    cmd->next = command_buckets[bucket];
+    command_buckets[bucket] = cmd;
+
+    return cmd->path;
+}
+
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+    IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_EXCL_UNLINK)
+
+/* Watch descriptors are small and handed out in order, so they index the
+   watched paths directly */
+struct native_watch
+{
+    int fd;
+    char **paths;  /* by watch descriptor */
+    unsigned char *recursive;
+    int num_wds;
+    char **roots;  /* what was passed to native_watch_add, reported on overflow */
+    size_t num_roots;
+    char **changed;
+    size_t num_changed;
+    size_t changed_cap;
+};
+
+struct native_watch *native_watch_open(void)
+{
+    struct native_watch *watch = calloc(1, sizeof(struct native_watch));
+    if (!watch)
+        return NULL;
+
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0) {
+        free(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+static int remember_watch(struct native_watch *watch, int wd, const char *path, int recursive)
+{
+    if (wd >= watch->num_wds) {
+        int num_wds = wd * 2 + 16;
+        char **paths = realloc(watch->paths, num_wds * sizeof(char *));
+        if (!paths)
+            return 0;
+        watch->paths = paths;
+
+        unsigned char *rec = realloc(watch->recursive, num_wds);
+        if (!rec)
+            return 0;
+        watch->recursive = rec;
+
+        memset(watch->paths + watch->num_wds, 0, (num_wds - watch->num_wds) * sizeof(char *));
+        watch->num_wds = num_wds;
+    }
+
+    // The same directory may be reached twice, which gives back the same wd
+    char *copy = strdup(path);
+    if (!copy)
+        return 0;
+    free(watch->paths[wd]);
+    watch->paths[wd] = copy;
+    watch->recursive[wd] = recursive;
+
+    return 1;
+}
+
+static int add_watch_tree(struct native_watch *watch, const char *path, int recursive)
+{
+    int wd = inotify_add_watch(watch->fd, path, WATCH_EVENTS);
+    if (wd < 0 || !remember_watch(watch, wd, path, recursive))
+        return 0;
+
+    if (!recursive)
+        return 1;
+
+    // Plain files can't be opened as directories, which ends the recursion
+    struct native_dir *dir = native_dir_open(path);
+    if (!dir)
+        return 1;
+
+    const char *name;
+    enum native_entry_type type;
+    int ok = 1;
+    while (ok && native_dir_next(dir, &name, &type) > 0) {
+        if (type != NATIVE_ENTRY_DIR)
+            continue;
+
+        char *sub = malloc(strlen(path) + strlen(name) + 2);
+        if (!sub) {
+            ok = 0;
+            break;
+        }
+        sprintf(sub, "%s/%s", path, name);
+
+        // Directories removed in the meantime are no loss
+        if (!add_watch_tree(watch, sub, 1) && errno != ENOENT)
+            ok = 0;
+        free(sub);
+    }
+
+    native_dir_close(dir);
+    return ok;
+}
+
+int native_watch_add(struct native_watch *watch, const char *path, int recursive)
+{
+    char **roots = realloc(watch->roots, (watch->num_roots + 1) * sizeof(char *));
+    if (!roots)
+        return 0;
+    watch->roots = roots;
+
+    if (!(roots[watch->num_roots] = strdup(path)))
+        return 0;
+    ++watch->num_roots;
+
+    return add_watch_tree(watch, path, recursive);
+}
+
+static int add_watch_change(struct native_watch *watch, const char *dir, const char *name)
+{
+    if (watch->num_changed == watch->changed_cap) {
+        size_t cap = watch->changed_cap * 2 + 16;
+        char **changed = realloc(watch->changed, cap * sizeof(char *));
+        if (!changed)
+            return 0;
+
+        watch->changed = changed;
+        watch->changed_cap = cap;
+    }
+
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (!path)
+        return 0;
+
+    if (*name)
+        sprintf(path, "%s/%s", dir, name);
+    else
+        strcpy(path, dir);
+
+    watch->changed[watch->num_changed++] = path;
+    return 1;
+}
+
+/* Reads all the events that are already queued */
+static int read_watch_events(struct native_watch *watch)
+{
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(watch->fd, buf, sizeof(buf));
+        if (len < 0)
+            return errno == EAGAIN || errno == EINTR;
+
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were lost, so anything may have changed
+                for (size_t i = 0; i < watch->num_roots; ++i) {
+                    if (!add_watch_change(watch, watch->roots[i], ""))
+                        return 0;
+                }
+                continue;
+            }
+
+            if (ev->wd < 0 || ev->wd >= watch->num_wds || !watch->paths[ev->wd])
+                continue;
+
+            const char *dir = watch->paths[ev->wd];
+            if (ev->mask & IN_IGNORED) {
+                free(watch->paths[ev->wd]);
+                watch->paths[ev->wd] = NULL;
+                continue;
+            }
+
+            const char *name = ev->len ? ev->name : "";
+            if (!add_watch_change(watch, dir, name))
+                return 0;
+
+            int is_new_dir = (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO));
+            if (is_new_dir && watch->recursive[ev->wd]) {
+                // Its path was the last change added
+                char *sub = watch->changed[watch->num_changed - 1];
+                if (!add_watch_tree(watch, sub, 1) && errno != ENOENT)
+                    return 0;
+            }
+        }
+    }
+}
+
+enum native_watch_result native_watch_wait(struct native_watch *watch, int timeout_ms,
+    int debounce_ms, int wake_on_jobs)
+{
+    for (size_t i = 0; i < watch->num_changed; ++i)
+        free(watch->changed[i]);
+    watch->num_changed = 0;
+
+    struct pollfd fds[2] = {
+        {.fd = watch->fd, .events = POLLIN},
+        {.fd = wake_on_jobs && num_tracked_jobs > 0 ? reaper_epfd : -1, .events = POLLIN}
+    };
+
+    double deadline = native_clock() + timeout_ms / 1000.0;
+    int wait_ms = timeout_ms;
+    for (;;) {
+        int res = poll(fds, 2, wait_ms);
+        if (res < 0 && errno != EINTR)
+            return NATIVE_WATCH_ERROR;
+
+        if (res > 0 && (fds[0].revents & POLLIN)) {
+            if (!read_watch_events(watch))
+                return NATIVE_WATCH_ERROR;
+            if (watch->num_changed > 0)
+                break;
+        }
+        if (res > 0 && (fds[1].revents & POLLIN))
+            return NATIVE_WATCH_JOBS;
+
+        if (timeout_ms >= 0) {
+            wait_ms = (deadline - native_clock()) * 1000;
+            if (wait_ms <= 0)
+                return NATIVE_WATCH_TIMEOUT;
+        }
+    }
+
+    // Saving a file, or building a tree, comes as a burst of events; gather
+    // them until things calm down, but don't let a file that never stops
+    // changing hold the others back for too long
+    double burst_end = native_clock() + debounce_ms * 10 / 1000.0;
+    while (native_clock() < burst_end) {
+        int res = poll(fds, 1, debounce_ms);
+        if (res == 0)
+            break;
+        if (res < 0 && errno != EINTR)
+            return NATIVE_WATCH_ERROR;
+
+        if (res > 0 && !read_watch_events(watch))
+            return NATIVE_WATCH_ERROR;
+    }
+
+    return NATIVE_WATCH_CHANGED;
+}
+
+const char *native_watch_changed(struct native_watch *watch, size_t index)
+{
+    return index < watch->num_changed ? watch->changed[index] : NULL;
+}
+
+void native_watch_close(struct native_watch *watch)
+{
+    close(watch->fd);
+
+    for (int i = 0; i < watch->num_wds; ++i)
+        free(watch->paths[i]);
+    for (size_t i = 0; i < watch->num_roots; ++i)
+        free(watch->roots[i]);
+    for (size_t i = 0; i < watch->num_changed; ++i)
+        free(watch->changed[i]);
+
+    free(watch->paths);
+    free(watch->recursive);
+    free(watch->roots);
+    free(watch->changed);
+    free(watch);
+}
+
+struct native_prefetch
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    int is_done;
+    int is_stopped;
+    long long bytes;
+    size_t count;
+    char **paths;  /* allocated along with the prefetch */
+};
+
+static void *prefetch_thread(void *arg)
+{
+    struct native_prefetch *prefetch = arg;
+    long long bytes = 0;
+
+    for (size_t i = 0; i < prefetch->count; ++i) {
+        pthread_mutex_lock(&prefetch->lock);
+        int is_stopped = prefetch->is_stopped;
+        pthread_mutex_unlock(&prefetch->lock);
+        if (is_stopped)
+            break;
+
+        int fd = open(prefetch->paths[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        // The kernel caps each readahead to the device's readahead window (a
+        // few megabytes), so big files are queued a window at a time. Each
+        // call only returns once its reads are queued, which is why this is
+        // done here. Filesystems that don't support it may still take the hint
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            const off_t window = 2 * 1024 * 1024;
+            for (off_t offset = 0; offset < st.st_size; offset += window) {
+                if (readahead(fd, offset, window) < 0) {
+                    posix_fadvise(fd, offset, 0, POSIX_FADV_WILLNEED);
+                    break;
+                }
+
+                pthread_mutex_lock(&prefetch->lock);
+                is_stopped = prefetch->is_stopped;
+                pthread_mutex_unlock(&prefetch->lock);
+                if (is_stopped)
+                    break;
+            }
+            bytes += st.st_size;
+        }
+
+        close(fd);
+    }
+
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->bytes = bytes;
+    prefetch->is_done = 1;
+    pthread_cond_broadcast(&prefetch->finished);
+    pthread_mutex_unlock(&prefetch->lock);
+
+    return NULL;
+}
+
+struct native_prefetch *native_prefetch_start(const char **paths, size_t count)
+{
+    size_t size = sizeof(struct native_prefetch) + count * sizeof(char *);
+    for (size_t i = 0; i < count; ++i)
+        size += strlen(paths[i]) + 1;
+
+    struct native_prefetch *prefetch = calloc(1, size);
+    if (!prefetch)
+        return NULL;
+
+    prefetch->count = count;
+    prefetch->paths = (char **) (prefetch + 1);
+    char *strings = (char *) (prefetch->paths + count);
+    for (size_t i = 0; i < count; ++i) {
+        prefetch->paths[i] = strings;
+        strings = stpcpy(strings, paths[i]) + 1;
+    }
+
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->finished, NULL);
+
+    // The thread must not take signals meant for the reaper
+    sigset_t all_signals, old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    int error = pthread_create(&prefetch->thread, NULL, prefetch_thread, prefetch);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (error != 0) {
+        pthread_mutex_destroy(&prefetch->lock);
+        pthread_cond_destroy(&prefetch->finished);
+        free(prefetch);
+        errno = error;
+        return NULL;
+    }
+
+    return prefetch;
+}
+
+int native_prefetch_wait(struct native_prefetch *prefetch, int timeout_ms, long long *bytes)
+{
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&prefetch->lock);
+    while (!prefetch->is_done) {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&prefetch->finished, &prefetch->lock);
+        else if (pthread_cond_timedwait(&prefetch->finished, &prefetch->lock,
+                &deadline) == ETIMEDOUT)
+            break;
+    }
+    int is_done = prefetch->is_done;
+    *bytes = prefetch->bytes;
+    pthread_mutex_unlock(&prefetch->lock);
+
+    return is_done;
+}
+
+void native_prefetch_close(struct native_prefetch *prefetch)
+{
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->is_stopped = 1;
+    pthread_mutex_unlock(&prefetch->lock);
+
+    pthread_join(prefetch->thread, NULL);
+    pthread_mutex_destroy(&prefetch->lock);
+    pthread_cond_destroy(&prefetch->finished);
+    free(prefetch);
+}
+
+const char *native_which(const char *name)
+{
+    static char found[PATH_MAX];
+
+    // Paths aren't looked up
+    if (strchr(name, '/'))
+        return name;
+
+    const char *path_var = getenv("PATH");
+    if (!path_var)
+        path_var = "/bin:/usr/bin";
+
+    if (!hashed_path_var || strcmp(hashed_path_var, path_var) != 0) {
+        native_hash_clear();
+        hashed_path_var = strdup(path_var);
+    }
+
+    for (struct hashed_command *cmd = command_buckets[command_hash(name)]; cmd; cmd = cmd->next) {
+        if (strcmp(cmd->name, name) == 0)
+            return cmd->path;
+    }
+
+    size_t name_len = strlen(name);
+    const char *dir = path_var;
+    for (;;) {
+        const char *dir_end = strchrnul(dir, ':');
+        size_t dir_len = dir_end - dir;
+
+        // An empty entry means the current directory
+        if (dir_len == 0) {
+            dir = ".";
+            dir_len = 1;
+        }
+
+        if (dir_len + name_len + 2 <= sizeof(found)) {
+            struct stat st;
+
+            memcpy(found, dir, dir_len);
+            found[dir_len] = '/';
+            memcpy(found + dir_len + 1, name, name_len + 1);
+
+            if (stat(found, &st) == 0 && S_ISREG(st.st_mode) && access(found, X_OK) == 0) {
+                // Relative entries depend on the current directory
+                const char *hashed = found[0] == '/' ? hash_command(name, found) : NULL;
+                return hashed ? hashed : found;
+            }
+        }
+
+        if (*dir_end == '\0')
+            return NULL;
+        dir = dir_end + 1;
+    }
+}
+
+static enum native_err open_error_tag(int open_errno)
+{
+    switch (open_errno) {
+    case EACCES:
+        return NATIVE_ERR_PERMISSION;
+    case EINTR:
+        return NATIVE_ERR_INTERRUPT;
+    case EMFILE: case ENFILE:
+        return NATIVE_ERR_MAX;
+    case ENAMETOOLONG:
+        return NATIVE_ERR_VARIABLE_SIZE;
+    case ENOENT: case ENOTDIR:
+        return NATIVE_ERR_FILE_NOTFOUND;
+    default:
+        return NATIVE_ERR_INVALID;
+    }
+}
+
+static enum native_err spawn_error_tag(int spawn_errno)
+{
+    switch (spawn_errno) {
+    case ENOMEM: case EAGAIN: case ENOSYS:
+        return NATIVE_ERR_FORKFAILED;
+    case ENOENT:
+        return NATIVE_ERR_NOTFOUND;
+    case EACCES:
+        return NATIVE_ERR_PERMISSION;
+    case E2BIG:
+        return NATIVE_ERR_ARGS_TOO_BIG;
+    // TODO treat other exec errors
+    default:
+        return NATIVE_ERR_INVALID;
+    }
+}
+
+static void close_fd(int *fd)
+{
+    if (*fd > STDERR_FILENO)
+        close(*fd);
+    *fd = -1;
+}
+
+static void close_tee(struct native_pipe_info *info)
+{
+    close_fd(&info->tee_fds[0]);
+    close_fd(&info->tee_fds[1]);
+    close_fd(&info->tee_file_fd);
+    close_fd(&info->tee_out_fd);
+}
+
+static void close_pipe_info(struct native_pipe_info *info)
+{
+    close_fd(&info->pipe_fd);
+    close_fd(&info->read_fd);
+    for (int i = 0; i < 3; ++i)
+        close_fd(&info->file_fds[i]);
+    close_tee(info);
+}
+
+static void set_pipe_size(int fd, size_t size)
+{
+    // Sizes above the system's limit are refused; the pipe keeps its size
+    if (size > 0)
+        fcntl(fd, F_SETPIPE_SZ, (int) size);
+}
+
+/* Give up on a partially started pipeline. Closing our ends of the pipes lets
+   the stages that were already spawned see EOF and finish */
+static struct native_run_result abort_execute(struct native_run_result res,
+    enum native_err tag)
+{
+    close_pipe_info(&res.pipe_info);
+    for (int i = 0; i < res.pipe_info.stage_count; ++i)
+        waitpid(res.stage_pids[i], NULL, 0);
+
+    res.tag = tag;
+    return res;
+}
+
+static int open_target(const char *filename, int append)
+{
+    int flags = O_CREAT | O_WRONLY | O_CLOEXEC;
+    flags |= append ? O_APPEND : O_TRUNC;
+
+    return open(filename, flags, S_IRWXU);
+}
+
+struct native_run_result native_setup_proc_out(enum exec_opts_t opts,
+    const char *target_file, const char *err_target_file)
+{
+    struct native_run_result res;
+    res.tag = NATIVE_ERR_SUCCESS;
+    res.exit_code = 0;
+    res.pid = 0;
+    res.out_string = NULL;
+    res.stage_pids = NULL;
+    res.stage_codes = NULL;
+    res.out_len = 0;
+    res.spill_threshold = EVAL_SPILL_THRESHOLD;
+    res.pipe_size = 0;
+
+    res.pipe_info.read_fd = -1;
+    res.pipe_info.out_fd = -1;
+    res.pipe_info.pipe_fd = -1;
+    for (int i = 0; i < 3; ++i)
+        res.pipe_info.file_fds[i] = -1;
+    res.pipe_info.tee_fds[0] = res.pipe_info.tee_fds[1] = -1;
+    res.pipe_info.tee_file_fd = res.pipe_info.tee_out_fd = -1;
+    res.pipe_info.final_process = 0;
+    res.pipe_info.stage_count = 0;
+
+    // Every descriptor we open is close-on-exec; stages only get the ones
+    // that are dup2'ed into their standard streams
+    int out_target;
+    if (opts & EXEC_OPTS_EVAL) {
+        int eval_pipe_fd[2];
+        if (pipe2(eval_pipe_fd, O_CLOEXEC) < 0) {
+            res.tag = NATIVE_ERR_PIPE_FAILED;
+            return res;
+        }
+
+        res.pipe_info.read_fd = eval_pipe_fd[0];
+        res.pipe_info.file_fds[1] = eval_pipe_fd[1];
+        out_target = eval_pipe_fd[1];
+    } else if (target_file) {
+        out_target = open_target(target_file, opts & EXEC_OPTS_APPEND_TO);
+        if (out_target < 0) {
+            res.tag = open_error_tag(errno);
+            return res;
+        }
+
+        res.pipe_info.file_fds[1] = out_target;
+    } else {
+        //Run statement without a target file just goes to stdout
+        out_target = STDOUT_FILENO;
+    }
+
+    //Set err target
+    int err_target;
+    if (err_target_file) {
+        err_target = open_target(err_target_file, opts & EXEC_OPTS_APPEND_ERR);
+        if (err_target < 0) {
+            res.tag = open_error_tag(errno);
+            close_pipe_info(&res.pipe_info);
+            return res;
+        }
+
+        res.pipe_info.file_fds[2] = err_target;
+    } else {
+        //Run statement without a target file just goes to stderr
+        err_target = STDERR_FILENO;
+    }
+
+    if (opts & EXEC_OPTS_ERR_TO_OUT) {
+        res.pipe_info.error_fd = out_target;
+    } else {
+        res.pipe_info.error_fd = err_target;
+    }
+    
+    if (opts & EXEC_OPTS_OUT_TO_ERR) {
+        res.pipe_info.write_fd = err_target;
+    } else {
+        res.pipe_info.write_fd = out_target;
+    }
+    res.tag = NATIVE_ERR_IN_EXECUTE;
+
+    return res;
+}
+
+/* The stages' output goes to a pipe instead, from which native_execute_begin
+   copies it to tee_file and to where it would go otherwise */
+struct native_run_result native_setup_tee(struct native_run_result res, const char *tee_file)
+{
+    res.pipe_info.tee_file_fd = open_target(tee_file, 0);
+    if (res.pipe_info.tee_file_fd < 0) {
+        res.tag = open_error_tag(errno);
+        close_pipe_info(&res.pipe_info);
+        return res;
+    }
+
+    // The original target may be closed before the copying is done
+    res.pipe_info.tee_out_fd = fcntl(res.pipe_info.write_fd, F_DUPFD_CLOEXEC, 3);
+    if (res.pipe_info.tee_out_fd < 0 || pipe2(res.pipe_info.tee_fds, O_CLOEXEC) < 0) {
+        res.tag = NATIVE_ERR_PIPE_FAILED;
+        close_pipe_info(&res.pipe_info);
+        return res;
+    }
+
+    // Errors merged with the output are copied as well
+    if (res.pipe_info.error_fd == res.pipe_info.write_fd)
+        res.pipe_info.error_fd = res.pipe_info.tee_fds[1];
+    res.pipe_info.write_fd = res.pipe_info.tee_fds[1];
+
+    return res;
+}
+
+/* argv to run path as a shell script with args, like execvp does for files
+   in no known format (ENOEXEC): sh path args[1]... Free it with free */
+static char **sh_script_argv(const char *path, const char **args)
+{
+    size_t num_args = 0;
+    while (args[num_args])
+        ++num_args;
+
+    char **argv = malloc((num_args + 2) * sizeof(char *));
+    if (!argv)
+        return NULL;
+
+    argv[0] = "sh";
+    argv[1] = (char *) path;
+    for (size_t i = 1; i <= num_args; ++i)
+        argv[i + 1] = (char *) args[i];
+
+    return argv;
+}
+
+static int spawn_command(pid_t *pid, const char *path,
+    const posix_spawn_file_actions_t *actions, const posix_spawnattr_t *attr,
+    const char **exeargs, const char **envstrings)
+{
+    int spawn_errno = posix_spawn(pid, path, actions, attr,
+        (char* const*) exeargs, (char* const*) envstrings);
+    if (spawn_errno != ENOEXEC)
+        return spawn_errno;
+
+    // Unlike posix_spawnp, posix_spawn doesn't fall back to the shell
+    char **sh_argv = sh_script_argv(path, exeargs);
+    if (!sh_argv)
+        return ENOMEM;
+
+    spawn_errno = posix_spawn(pid, "/bin/sh", actions, attr, sh_argv,
+        (char* const*) envstrings);
+    free(sh_argv);
+    return spawn_errno;
+}
+
+/* Stages are spawned from the last to the first one, straight from this
+   process. posix_spawn is implemented with clone(CLONE_VM | CLONE_VFORK), so,
+   unlike fork, its cost doesn't grow with the size of the Lua heap */
+struct native_run_result native_execute(
+    const char *executable, const char **exeargs, const char **envstrings,
+    enum exec_opts_t opts, struct native_run_result res, int index, const char *source_file)
+{
+    res.tag = NATIVE_ERR_IN_EXECUTE;
+
+    // The pipes made by native_setup_proc_out and native_setup_tee, which
+    // the last stage (the first one spawned) writes to
+    if (res.pipe_info.stage_count == 0) {
+        if (res.pipe_info.read_fd >= 0)
+            set_pipe_size(res.pipe_info.read_fd, res.pipe_size);
+        if (res.pipe_info.tee_fds[0] >= 0)
+            set_pipe_size(res.pipe_info.tee_fds[0], res.pipe_size);
+    }
+
+    //Set up this stage's input: either the previous stage or the source file
+    int in_fd = -1;
+    int new_pipe[2] = {-1, -1};
+    if (index > 0) {
+        if (pipe2(new_pipe, O_CLOEXEC) < 0)
+            return abort_execute(res, NATIVE_ERR_PIPE_FAILED);
+
+        set_pipe_size(new_pipe[0], res.pipe_size);
+        in_fd = new_pipe[0];
+    } else if (source_file) {
+        in_fd = open(source_file, O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0)
+            return abort_execute(res, open_error_tag(errno));
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    if (in_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+
+    // If stderr goes to our stdout, it has to be duplicated before stdout
+    // is replaced
+    if (res.pipe_info.error_fd == STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, res.pipe_info.error_fd, STDERR_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, res.pipe_info.write_fd, STDOUT_FILENO);
+    } else {
+        posix_spawn_file_actions_adddup2(&actions, res.pipe_info.write_fd, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, res.pipe_info.error_fd, STDERR_FILENO);
+    }
+
+    // SIGCHLD may be blocked by the reaper; children start with a clean mask
+    posix_spawnattr_t attr;
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &empty_mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    //Start process
+    pid_t pid;
+    const char *path = native_which(executable);
+    int spawn_errno = path ?
+        spawn_command(&pid, path, &actions, &attr, exeargs, envstrings) : ENOENT;
+
+    // The hashed command may have been moved or removed since it was found
+    if (spawn_errno == ENOENT && path && path != executable) {
+        forget_command(executable);
+        path = native_which(executable);
+        if (path)
+            spawn_errno = spawn_command(&pid, path, &actions, &attr, exeargs, envstrings);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    // The stage has its own copies of these now
+    close_fd(&in_fd);
+    close_fd(&res.pipe_info.pipe_fd);
+
+    if (spawn_errno != 0) {
+        close_fd(&new_pipe[1]);
+        return abort_execute(res, spawn_error_tag(spawn_errno));
+    }
+
+    res.stage_pids[res.pipe_info.stage_count++] = pid;
+
+    // The first stage spawned is the last one in the pipe
+    if (res.pipe_info.final_process == 0)
+        res.pipe_info.final_process = pid;
+
+    //The previous stage will write to this one
+    if (index > 0) {
+        res.pipe_info.pipe_fd = new_pipe[1];
+        res.pipe_info.write_fd = new_pipe[1];
+    }
+
+    return res;
+}
+
+/* Only returns on failure, with errno set */
+static void exec_command(const char *path, const char **exeargs, const char **envstrings)
+{
+    execve(path, (char* const*) exeargs, (char* const*) envstrings);
+    if (errno != ENOEXEC)
+        return;
+
+    char **sh_argv = sh_script_argv(path, exeargs);
+    if (!sh_argv) {
+        errno = ENOMEM;
+        return;
+    }
+
+    execve("/bin/sh", sh_argv, (char* const*) envstrings);
+    int exec_errno = errno;
+    free(sh_argv);
+    errno = exec_errno;
+}
+
+/* Like native_execute for a single stage, but the command replaces this
+   process instead of being spawned. The redirections are applied to our own
+   standard streams first, and undone if execve fails */
+enum native_err native_exec(const char *executable, const char **exeargs,
+    const char **envstrings, struct native_run_result res, const char *source_file)
+{
+    int in_fd = -1;
+    if (source_file) {
+        in_fd = open(source_file, O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0) {
+            enum native_err tag = open_error_tag(errno);
+            close_pipe_info(&res.pipe_info);
+            return tag;
+        }
+    }
+
+    const char *path = native_which(executable);
+    if (!path) {
+        close_fd(&in_fd);
+        close_pipe_info(&res.pipe_info);
+        return NATIVE_ERR_NOTFOUND;
+    }
+
+    // Whatever Lua still has buffered belongs to the old streams
+    fflush(NULL);
+
+    // Copies of the standard streams to restore if execve fails; a stream
+    // that was closed (-2) is closed again
+    int saved_fds[3];
+    for (int i = 0; i < 3; ++i) {
+        saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+        if (saved_fds[i] < 0 && errno == EBADF)
+            saved_fds[i] = -2;
+    }
+
+    if (in_fd >= 0)
+        dup2(in_fd, STDIN_FILENO);
+
+    // If stderr goes to our stdout, it has to be duplicated before stdout
+    // is replaced
+    if (res.pipe_info.error_fd == STDOUT_FILENO) {
+        dup2(res.pipe_info.error_fd, STDERR_FILENO);
+        dup2(res.pipe_info.write_fd, STDOUT_FILENO);
+    } else {
+        dup2(res.pipe_info.write_fd, STDOUT_FILENO);
+        dup2(res.pipe_info.error_fd, STDERR_FILENO);
+    }
+
+    // The mask survives execve, and SIGCHLD may be blocked by the reaper
+    sigset_t empty_mask, old_mask;
+    sigemptyset(&empty_mask);
+    sigprocmask(SIG_SETMASK, &empty_mask, &old_mask);
+
+    exec_command(path, exeargs, envstrings);
+
+    // The hashed command may have been moved or removed since it was found
+    if (errno == ENOENT && path != executable) {
+        forget_command(executable);
+        path = native_which(executable);
+        if (path)
+            exec_command(path, exeargs, envstrings);
+        else
+            errno = ENOENT;
+    }
+
+    enum native_err tag = spawn_error_tag(errno);
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    for (int i = 0; i < 3; ++i) {
+        if (saved_fds[i] >= 0) {
+            dup2(saved_fds[i], i);
+            close(saved_fds[i]);
+        } else if (saved_fds[i] == -2) {
+            close(i);
+        }
+    }
+
+    close_fd(&in_fd);
+    close_pipe_info(&res.pipe_info);
+    return tag;
+}
+
+/* Move len bytes out of a pipe. Some targets (like files opened for
+   appending, on older kernels) can't be spliced into, so they get a copy */
+static int drain_pipe(int pipe_fd, int out_fd, size_t len)
+{
+    char buf[65536];
+
+    while (len > 0) {
+        ssize_t num_bytes = splice(pipe_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+        if (num_bytes < 0 && errno == EINVAL) {
+            num_bytes = read(pipe_fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+            if (num_bytes > 0 && !write_all(out_fd, buf, num_bytes))
+                return 0;
+        }
+
+        if (num_bytes < 0 && errno == EINTR)
+            continue;
+        if (num_bytes <= 0)
+            return 0;
+
+        len -= num_bytes;
+    }
+
+    return 1;
+}
+
+/* tee(2) duplicates what's in the output pipe into a second one without
+   consuming it; then each of them is spliced into its target, so the output
+   never goes through this process' memory */
+static enum native_err copy_tee_output(struct native_run_result *res)
+{
+    struct native_pipe_info *info = &res->pipe_info;
+    enum native_err tag = NATIVE_ERR_SUCCESS;
+    int copy_pipe[2];
+
+    if (pipe2(copy_pipe, O_CLOEXEC) < 0)
+        return NATIVE_ERR_PIPE_FAILED;
+    set_pipe_size(copy_pipe[0], res->pipe_size);
+
+    for (;;) {
+        ssize_t len = tee(info->tee_fds[0], copy_pipe[1], INT_MAX, 0);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            if (len < 0)
+                tag = NATIVE_ERR_INVALID;
+            break;
+        }
+
+        if (!drain_pipe(info->tee_fds[0], info->tee_file_fd, len) ||
+                !drain_pipe(copy_pipe[0], info->tee_out_fd, len)) {
+            tag = NATIVE_ERR_INVALID;
+            break;
+        }
+    }
+
+    close(copy_pipe[0]);
+    close(copy_pipe[1]);
+
+    // Stages still writing get SIGPIPE if the copy was cut short
+    close_tee(info);
+    return tag;
+}
+
+/* Move everything buffered so far into a memfd; the rest of the output is
+   spliced straight into it, so big outputs never need a huge heap buffer */
+static int spill_eval_output(struct native_run_result *res)
+{
+    int fd = memfd_create("apolo-eval", MFD_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    if (!write_all(fd, res->out_string, res->out_len)) {
+        close(fd);
+        return 0;
+    }
+
+    free(res->out_string);
+    res->out_string = NULL;
+    res->pipe_info.out_fd = fd;
+
+    return 1;
+}
+
+static ssize_t read_into_spill(struct native_run_result *res)
+{
+    char buf[65536];
+
+    ssize_t num_bytes = splice(res->pipe_info.read_fd, NULL, res->pipe_info.out_fd,
+        NULL, 1 << 20, SPLICE_F_MOVE);
+    if (num_bytes >= 0 || errno != EINVAL)
+        return num_bytes;
+
+    // Not spliceable; copy it by hand
+    num_bytes = read(res->pipe_info.read_fd, buf, sizeof(buf));
+    if (num_bytes > 0 && !write_all(res->pipe_info.out_fd, buf, num_bytes))
+        return -1;
+
+    return num_bytes;
+}
+
+/* Read everything the eval pipe has until EOF. The output is kept in a heap
+   buffer that grows geometrically up to spill_threshold, then in a memfd that
+   is mapped at the end, so either way the caller gets one contiguous string */
+static enum native_err read_eval_output(struct native_run_result *res)
+{
+    size_t capacity = 0;
+    int can_spill = 1;
+
+    for (;;) {
+        ssize_t num_bytes;
+
+        if (res->pipe_info.out_fd >= 0) {
+            num_bytes = read_into_spill(res);
+        } else {
+            if (res->out_len == capacity) {
+                if (can_spill && capacity >= res->spill_threshold) {
+                    // If there's no memfd, just keep growing the buffer
+                    can_spill = spill_eval_output(res);
+                    continue;
+                }
+
+                size_t new_capacity = capacity ? capacity * 2 : 4096;
+                if (can_spill && new_capacity > res->spill_threshold)
+                    new_capacity = res->spill_threshold;
+
+                char *new_string = realloc(res->out_string, new_capacity);
+                if (!new_string)
+                    return NATIVE_ERR_INVALID;
+
+                res->out_string = new_string;
+                capacity = new_capacity;
+            }
+
+            num_bytes = read(res->pipe_info.read_fd,
+                res->out_string + res->out_len, capacity - res->out_len);
+        }
+
+        if (num_bytes == 0)
+            break;
+
+        if (num_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return NATIVE_ERR_INVALID;
+        }
+
+        res->out_len += num_bytes;
+    }
+
+    if (res->pipe_info.out_fd >= 0 && res->out_len > 0) {
+        void *map = mmap(NULL, res->out_len, PROT_READ, MAP_PRIVATE,
+            res->pipe_info.out_fd, 0);
+        if (map == MAP_FAILED)
+            return NATIVE_ERR_INVALID;
+
+        res->out_string = map;
+    }
+
+    return NATIVE_ERR_SUCCESS;
+}
+
+/* Wait for every stage and return the exit code of the last one. Codes of
+   stages killed by signals follow the shell's convention */
+static int wait_stages(struct native_run_result *res)
+{
+    int exit_code = 0;
+    for (int i = 0; i < res->pipe_info.stage_count; ++i) {
+        pid_t pid = res->stage_pids[i];
+        int status = 0;
+
+        // Stream stages may have been reaped while the output was read
+        struct job_record *rec = find_job(pid);
+        if (rec && rec->is_finished)
+            status = rec->status_code;
+        else
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+
+        if (rec)
+            forget_job(rec);
+
+        int code = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+
+        // Stages were spawned from the last one to the first
+        if (res->stage_codes)
+            res->stage_codes[res->pipe_info.stage_count - 1 - i] = code;
+
+        if (pid == res->pipe_info.final_process)
+            exit_code = code;
+    }
+
+    return exit_code;
 }
 
-struct native_run_result native_execute_begin(struct native_run_result proc,
+struct native_run_result native_execute_begin(struct native_run_result res,
     enum exec_opts_t opts)
 {
-    exit(0);
+    // Keep only the read end of the eval pipe; the stages have everything else
+    close_fd(&res.pipe_info.pipe_fd);
+    close_fd(&res.pipe_info.tee_fds[1]);
+    for (int i = 0; i < 3; ++i)
+        close_fd(&res.pipe_info.file_fds[i]);
+
+    reap_events(0);
+
+    // Only commands that are waited for get their output copied
+    if (opts & (EXEC_OPTS_STREAM | EXEC_OPTS_BG))
+        close_tee(&res.pipe_info);
+
+    // The caller reads the output at its own pace through native_stream_read
+    if (opts & EXEC_OPTS_STREAM) {
+        for (int i = 0; i < res.pipe_info.stage_count; ++i)
+            track_child(res.stage_pids[i], JOB_KIND_STREAM);
+
+        res.tag = NATIVE_ERR_STREAM_SUCCESS;
+        res.pid = res.pipe_info.final_process;
+        return res;
+    }
+
+    if (opts & EXEC_OPTS_BG) {
+        for (int i = 0; i < res.pipe_info.stage_count; ++i) {
+            pid_t pid = res.stage_pids[i];
+            track_child(pid,
+                pid == res.pipe_info.final_process? JOB_KIND_JOB : JOB_KIND_STAGE);
+        }
+
+        res.tag = NATIVE_ERR_BACKGROUND_SUCCESS;
+        res.pid = res.pipe_info.final_process;
+        return res;
+    }
+
+    res.tag = NATIVE_ERR_SUCCESS;
+
+    // Get output from process. It has to be read before waiting, or else a
+    // child that fills the pipe would never finish
+    if (opts & EXEC_OPTS_EVAL) {
+        res.tag = read_eval_output(&res);
+        close_fd(&res.pipe_info.read_fd);
+    }
+
+    if (res.pipe_info.tee_fds[0] >= 0)
+        res.tag = copy_tee_output(&res);
+
+    int exit_code = wait_stages(&res);
+
+    if (res.tag != NATIVE_ERR_SUCCESS) {
+        native_release_output(&res);
+        return res;
+    }
+
+    // Get exit code from last process
+    res.exit_code = exit_code;
+
+    return res;
+}
+
+void native_release_output(struct native_run_result *res)
+{
+    if (res->pipe_info.out_fd >= 0) {
+        if (res->out_string)
+            munmap(res->out_string, res->out_len);
+        close_fd(&res->pipe_info.out_fd);
+    } else {
+        free(res->out_string);
+    }
+
+    res->out_string = NULL;
+    res->out_len = 0;
+}
+
+long native_stream_read(struct native_run_result *res, char *buf, size_t len)
+{
+    ssize_t num_bytes;
+
+    while ((num_bytes = read(res->pipe_info.read_fd, buf, len)) < 0 && errno == EINTR);
+    return num_bytes;
+}
+
+struct native_run_result native_stream_close(struct native_run_result res, int is_wait)
+{
+    // Stages still writing get SIGPIPE from now on
+    close_fd(&res.pipe_info.read_fd);
+
+    if (!is_wait) {
+        // Nobody will read what's left; let the reaper take care of them
+        for (int i = 0; i < res.pipe_info.stage_count; ++i) {
+            struct job_record *rec = find_job(res.stage_pids[i]);
+            if (!rec)
+                continue;
+
+            if (rec->is_finished)
+                forget_job(rec);
+            else
+                rec->kind = JOB_KIND_STAGE;
+        }
+
+        res.pipe_info.stage_count = 0;
+        res.tag = NATIVE_ERR_BACKGROUND_SUCCESS;
+        return res;
+    }
+
+    res.exit_code = wait_stages(&res);
+    res.pipe_info.stage_count = 0;
+    res.tag = NATIVE_ERR_SUCCESS;
+
+    return res;
 }
@@ -1,7 +1,16 @@
+#include <sys/types.h>
 
 struct native_pipe_info
 {
     int write_fd;
     int error_fd;
-    int err_pipe_fd;
-};
\ No newline at end of file
+    int read_fd;
+    int pipe_fd;  /* write end of the pipe feeding the last spawned stage */
+    int file_fds[3];
+    int out_fd;  /* memfd holding eval output that got too big for the heap */
+    int tee_fds[2];  /* pipe carrying the output that is copied to tee_file_fd */
+    int tee_file_fd;
+    int tee_out_fd;  /* where the output goes after being copied */
+    pid_t final_process;
+    int stage_count;
+};
@@ -25,6 +25,9 @@
 
 #include "apolocore.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <windows.h>
 #include <shlwapi.h>
@@ -77,48 +80,338 @@ int native_copy(const char *orig, const char *dest)
     return native_file_operation(orig, dest, FO_COPY);
 }
 
-void native_curdir(char *dir)
+int native_cpu_count(void)
 {
-    GetCurrentDirectory(512, dir);
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
 }
 
-int native_exists(const char *path)
+double native_clock(void)
 {
-    return GetFileAttributes(path) != INVALID_FILE_ATTRIBUTES;
+    return GetTickCount64() / 1000.0;
 }
 
-int native_fillentryarray(lua_State *L, const char *dir)
+int native_curdir(char *dir)
 {
+    DWORD len = GetCurrentDirectory(512, dir);
+    return len > 0 && len < 512;
+}
+
+/* Removes path and everything inside it. Reparse points (like junctions) are
+   removed, never followed */
+static int remove_tree(const char *path)
+{
+    DWORD attrs = GetFileAttributes(path);
+    if (attrs == INVALID_FILE_ATTRIBUTES)
+        return 0;
+
+    if (!(attrs & FILE_ATTRIBUTE_DIRECTORY) || (attrs & FILE_ATTRIBUTE_REPARSE_POINT)) {
+        if (attrs & FILE_ATTRIBUTE_READONLY)
+            SetFileAttributes(path, attrs & ~FILE_ATTRIBUTE_READONLY);
+        return (attrs & FILE_ATTRIBUTE_DIRECTORY) ?
+            RemoveDirectory(path) : DeleteFile(path);
+    }
+
     WIN32_FIND_DATA file_info;
-    HANDLE hfind;
-    char dir_pattern[512];
-    int i = 1;
+    char pattern[MAX_PATH];
+    snprintf(pattern, MAX_PATH, "%s\\*", path);
+
+    int ok = 1;
+    HANDLE hfind = FindFirstFile(pattern, &file_info);
+    if (hfind != INVALID_HANDLE_VALUE) {
+        do {
+            if (strcmp(file_info.cFileName, ".") == 0 ||
+                    strcmp(file_info.cFileName, "..") == 0)
+                continue;
+
+            char entry[MAX_PATH];
+            snprintf(entry, MAX_PATH, "%s\\%s", path, file_info.cFileName);
+            if (!remove_tree(entry))
+                ok = 0;
+        } while (FindNextFile(hfind, &file_info) != 0);
+        FindClose(hfind);
+    }
 
-    strcpy(dir_pattern, dir);
-    strcat(dir_pattern, "\\*");
+    return ok && RemoveDirectory(path);
+}
 
-    hfind = FindFirstFile(dir_pattern, &file_info);
+int native_del(const char *path, int num_threads)
+{
+    (void) num_threads;
 
-    if (hfind == INVALID_HANDLE_VALUE)
+    if (GetFileAttributes(path) == INVALID_FILE_ATTRIBUTES)
         return 0;
 
-    do {
-        const char *type;
+    if (!remove_tree(path)) {
+        errno = EACCES;
+        return -1;
+    }
 
-        if (file_info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-            type = "dir";
-        else
-            type = "file";
+    return 1;
+}
 
-        insert_direntry(L, i, file_info.cFileName, type);
-        ++i;
-    } while (FindNextFile(hfind, &file_info) != 0);
+int native_exists(const char *path)
+{
+    return GetFileAttributes(path) != INVALID_FILE_ATTRIBUTES;
+}
+
+int native_is_dir(const char *path)
+{
+    DWORD attrs = GetFileAttributes(path);
 
-    FindClose(hfind);
+    return attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+/* FILETIME counts 100ns intervals since 1601 */
+static double filetime_seconds(FILETIME ft)
+{
+    ULARGE_INTEGER t;
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+
+    return (t.QuadPart - 116444736000000000ULL) / 1e7;
+}
+
+int native_stat(const char *path, unsigned fields, int follow_links, struct native_stat *st)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &data)) {
+        DWORD err = GetLastError();
+        if (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND)
+            return 0;
+
+        errno = err == ERROR_ACCESS_DENIED ? EACCES : EIO;
+        return -1;
+    }
+
+    // There are no owners or permission bits to report; ctime is the
+    // creation time, like in the C runtime's stat
+    st->fields = fields & ~(NATIVE_STAT_MODE | NATIVE_STAT_UID | NATIVE_STAT_GID);
+    if (!follow_links && (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+        st->type = NATIVE_ENTRY_SYMLINK;
+    else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        st->type = NATIVE_ENTRY_DIR;
+    else
+        st->type = NATIVE_ENTRY_FILE;
+    st->size = ((long long) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    st->mtime = filetime_seconds(data.ftLastWriteTime);
+    st->atime = filetime_seconds(data.ftLastAccessTime);
+    st->ctime = filetime_seconds(data.ftCreationTime);
 
     return 1;
 }
 
+void native_hash_clear(void)
+{
+    // Commands are looked up by CreateProcess, which has no cache to clear
+}
+
+struct native_dir
+{
+    HANDLE hfind;
+    int has_entry;  /* file_info holds an entry that wasn't returned yet */
+    WIN32_FIND_DATA file_info;
+};
+
+struct native_dir *native_dir_open(const char *path)
+{
+    char dir_pattern[MAX_PATH];
+    snprintf(dir_pattern, MAX_PATH, "%s\\*", path);
+
+    struct native_dir *dir = malloc(sizeof(struct native_dir));
+    if (!dir) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    dir->hfind = FindFirstFile(dir_pattern, &dir->file_info);
+    if (dir->hfind == INVALID_HANDLE_VALUE) {
+        free(dir);
+        errno = ENOENT;
+        return NULL;
+    }
+
+    dir->has_entry = 1;
+    return dir;
+}
+
+int native_dir_next(struct native_dir *dir, const char **name, enum native_entry_type *type)
+{
+    for (;;) {
+        if (!dir->has_entry && !FindNextFile(dir->hfind, &dir->file_info))
+            return GetLastError() == ERROR_NO_MORE_FILES ? 0 : -1;
+        dir->has_entry = 0;
+
+        const char *entry_name = dir->file_info.cFileName;
+        if (strcmp(entry_name, ".") == 0 || strcmp(entry_name, "..") == 0)
+            continue;
+
+        *name = entry_name;
+        *type = (dir->file_info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ?
+            NATIVE_ENTRY_DIR : NATIVE_ENTRY_FILE;
+        return 1;
+    }
+}
+
+void native_dir_close(struct native_dir *dir)
+{
+    FindClose(dir->hfind);
+    free(dir);
+}
+
+/* Directories waiting to be read */
+struct walk_dir
+{
+    struct walk_dir *next;
+    int depth;
+    char path[];
+};
+
+/* Without threads: the directories are read one at a time, as the entries
+   are consumed */
+struct native_walk
+{
+    struct walk_dir *dirs;
+    struct walk_dir *current;
+    struct native_dir *dir;
+    int last_depth;
+    int last_is_dir;
+    int error;  /* errno of a failure that left entries out */
+    char last_path[MAX_PATH];
+};
+
+static struct walk_dir *make_walk_dir(const char *path, int depth)
+{
+    size_t len = strlen(path);
+    struct walk_dir *dir = malloc(sizeof(struct walk_dir) + len + 1);
+    if (!dir)
+        return NULL;
+
+    memcpy(dir->path, path, len + 1);
+    dir->depth = depth;
+    dir->next = NULL;
+    return dir;
+}
+
+struct native_walk *native_walk_open(const char *root, int num_threads, int follow_links)
+{
+    (void) num_threads;
+    (void) follow_links;
+
+    DWORD attrs = GetFileAttributes(root);
+    if (attrs == INVALID_FILE_ATTRIBUTES || !(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    struct native_walk *walk = calloc(1, sizeof(struct native_walk));
+    if (!walk || !(walk->dirs = make_walk_dir(root, 0))) {
+        free(walk);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return walk;
+}
+
+int native_walk_next(struct native_walk *walk, const char **path,
+    enum native_entry_type *type, int *depth, int *is_dir)
+{
+    const char *name;
+
+    for (;;) {
+        if (walk->error) {
+            errno = walk->error;
+            return -1;
+        }
+
+        if (!walk->dir) {
+            free(walk->current);
+            walk->current = walk->dirs;
+            if (!walk->current)
+                return 0;
+            walk->dirs = walk->current->next;
+
+            // Unreadable directories are skipped
+            walk->dir = native_dir_open(walk->current->path);
+            if (!walk->dir)
+                continue;
+        }
+
+        if (native_dir_next(walk->dir, &name, type) <= 0) {
+            native_dir_close(walk->dir);
+            walk->dir = NULL;
+            continue;
+        }
+
+        snprintf(walk->last_path, MAX_PATH, "%s\\%s", walk->current->path, name);
+        walk->last_depth = walk->current->depth + 1;
+        // Junctions and links aren't followed
+        walk->last_is_dir = *type == NATIVE_ENTRY_DIR &&
+            !(walk->dir->file_info.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT);
+
+        *path = walk->last_path;
+        *depth = walk->last_depth;
+        *is_dir = walk->last_is_dir;
+        return 1;
+    }
+}
+
+void native_walk_descend(struct native_walk *walk)
+{
+    if (!walk->last_is_dir)
+        return;
+
+    struct walk_dir *dir = make_walk_dir(walk->last_path, walk->last_depth);
+    if (dir) {
+        dir->next = walk->dirs;
+        walk->dirs = dir;
+    } else {
+        walk->error = ENOMEM;
+    }
+    walk->last_is_dir = 0;
+}
+
+void native_walk_close(struct native_walk *walk)
+{
+    if (walk->dir)
+        native_dir_close(walk->dir);
+    free(walk->current);
+    while (walk->dirs) {
+        struct walk_dir *next = walk->dirs->next;
+        free(walk->dirs);
+        walk->dirs = next;
+    }
+    free(walk);
+}
+
+/* Handles of the background jobs that weren't seen finishing yet */
+static HANDLE tracked_handles[MAXIMUM_WAIT_OBJECTS];
+static int tracked_pids[MAXIMUM_WAIT_OBJECTS];
+static DWORD num_tracked = 0;
+
+static void track_job(int pid, HANDLE hProcess)
+{
+    if (num_tracked == MAXIMUM_WAIT_OBJECTS) {
+        CloseHandle(hProcess);
+        return;
+    }
+
+    tracked_pids[num_tracked] = pid;
+    tracked_handles[num_tracked] = hProcess;
+    ++num_tracked;
+}
+
+static void untrack_job(DWORD index)
+{
+    CloseHandle(tracked_handles[index]);
+    --num_tracked;
+    tracked_pids[index] = tracked_pids[num_tracked];
+    tracked_handles[index] = tracked_handles[num_tracked];
+}
+
 struct native_job_result native_job_status(const int pid, int is_wait)
 {
     struct native_job_result res = {NATIVE_ERR_INVALID, 0};
@@ -178,6 +471,16 @@ struct native_job_result native_job_status(const int pid, int is_wait)
         }
     }
     CloseHandle(hProcess);
+
+    if (res.tag == NATIVE_ERR_BACKGROUND_FINISHED || res.tag == NATIVE_ERR_BACKGROUND_FAILED) {
+        for (DWORD i = 0; i < num_tracked; ++i) {
+            if (tracked_pids[i] == pid) {
+                untrack_job(i);
+                break;
+            }
+        }
+    }
+
     return res;
 }
 
@@ -267,6 +570,87 @@ struct native_job_result native_job_set_active(const int pid, int is_suspend)
     return res ;
 }
 
+int native_job_events(int timeout_ms, struct native_job_event *events, int max_events)
+{
+    int num_events = 0;
+
+    if (num_tracked == 0)
+        return -1;
+
+    DWORD timeout = timeout_ms < 0 ? INFINITE : (DWORD) timeout_ms;
+    while (num_events < max_events && num_tracked > 0) {
+        DWORD result = WaitForMultipleObjects(num_tracked, tracked_handles, FALSE, timeout);
+        if (result >= WAIT_OBJECT_0 + num_tracked)
+            break;
+
+        DWORD index = result - WAIT_OBJECT_0;
+        DWORD exit_code;
+        GetExitCodeProcess(tracked_handles[index], &exit_code);
+
+        events[num_events].pid = tracked_pids[index];
+        if ((exit_code >= 1 && exit_code <= 15841) || exit_code >= 0xC0000000) {
+            events[num_events].result.tag = NATIVE_ERR_BACKGROUND_FAILED;
+            events[num_events].result.exit_code = 0;
+        } else {
+            events[num_events].result.tag = NATIVE_ERR_BACKGROUND_FINISHED;
+            events[num_events].result.exit_code = exit_code;
+        }
+        ++num_events;
+
+        untrack_job(index);
+
+        // Only block for the first one
+        timeout = 0;
+    }
+
+    return num_events;
+}
+
+const char *native_map_file(const char *path, size_t *len)
+{
+    HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        errno = EIO;
+        return NULL;
+    }
+
+    // Empty files can't be mapped
+    *len = (size_t) size.QuadPart;
+    if (*len == 0) {
+        CloseHandle(file);
+        return "";
+    }
+
+    // The view keeps the mapping (and the file) alive by itself
+    HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        errno = EIO;
+        return NULL;
+    }
+
+    const char *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data)
+        errno = ENOMEM;
+
+    return data;
+}
+
+void native_unmap_file(const char *data, size_t len)
+{
+    if (len > 0)
+        UnmapViewOfFile(data);
+}
+
 int native_mkdir(const char *dir)
 {
     SECURITY_ATTRIBUTES sec;
@@ -277,11 +661,117 @@ int native_mkdir(const char *dir)
     return CreateDirectory(dir, &sec) != 0;
 }
 
+struct native_out_file
+{
+    HANDLE handle;
+    char *path;
+    char *tmp_path;  /* where atomic files are written until committed */
+};
+
+struct native_out_file *native_out_open(const char *path, int is_append, int is_atomic)
+{
+    struct native_out_file *f = calloc(1, sizeof(struct native_out_file));
+    if (!f) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    f->handle = INVALID_HANDLE_VALUE;
+    if (!is_atomic) {
+        f->handle = CreateFile(path, is_append ? FILE_APPEND_DATA : GENERIC_WRITE,
+            FILE_SHARE_READ, NULL, is_append ? OPEN_ALWAYS : CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+    } else if ((f->path = strdup(path)) && (f->tmp_path = malloc(strlen(path) + 32))) {
+        // Next to the real file, so it can be moved in its place
+        static unsigned num_tmp_files = 0;
+        do {
+            sprintf(f->tmp_path, "%s.tmp%lu.%u", path, GetCurrentProcessId(), num_tmp_files++);
+            f->handle = CreateFile(f->tmp_path, GENERIC_WRITE, 0, NULL, CREATE_NEW,
+                FILE_ATTRIBUTE_NORMAL, NULL);
+        } while (f->handle == INVALID_HANDLE_VALUE && GetLastError() == ERROR_FILE_EXISTS);
+    }
+
+    if (f->handle == INVALID_HANDLE_VALUE) {
+        free(f->path);
+        free(f->tmp_path);
+        free(f);
+        errno = EACCES;
+        return NULL;
+    }
+
+    return f;
+}
+
+int native_out_write(struct native_out_file *f, const char *data, size_t len)
+{
+    while (len > 0) {
+        DWORD written;
+        DWORD chunk = len > 0x40000000 ? 0x40000000 : (DWORD) len;
+        if (!WriteFile(f->handle, data, chunk, &written, NULL)) {
+            errno = EIO;
+            return 0;
+        }
+
+        data += written;
+        len -= written;
+    }
+
+    return 1;
+}
+
+int native_out_close(struct native_out_file *f, int is_commit)
+{
+    int ok = 1;
+    if (f->tmp_path && is_commit)
+        ok = FlushFileBuffers(f->handle);
+    ok = CloseHandle(f->handle) && ok;
+
+    if (f->tmp_path) {
+        if (ok && is_commit) {
+            ok = MoveFileEx(f->tmp_path, f->path,
+                MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+        }
+        if (!ok || !is_commit)
+            DeleteFile(f->tmp_path);
+    }
+
+    if (!ok)
+        errno = EIO;
+
+    free(f->path);
+    free(f->tmp_path);
+    free(f);
+    return ok;
+}
+
+const char **native_parent_env(void)
+{
+    return (const char **) _environ;
+}
+
 int native_move(const char *orig, const char *dest)
 {
     return native_file_operation(orig, dest, FO_MOVE);
 }
 
+long long native_pump(FILE *src, FILE *dst)
+{
+    char buf[65536];
+    long long total = 0;
+    size_t len;
+
+    while ((len = fread(buf, 1, sizeof(buf), src)) > 0) {
+        if (fwrite(buf, 1, len, dst) != len)
+            return -1;
+        total += len;
+    }
+
+    if (ferror(src) || fflush(dst) != 0)
+        return -1;
+
+    return total;
+}
+
 int native_rmdir(const char *dir)
 {
     return RemoveDirectory(dir);
@@ -291,6 +781,15 @@ struct native_run_result native_setup_proc_out(enum exec_opts_t opts,
     const char *target_file, const char *err_target_file)
 {
     struct native_run_result res;
+    res.out_string = NULL;
+    res.stage_pids = NULL;
+    res.stage_codes = NULL;
+    res.out_len = 0;
+    res.pipe_size = 0;
+    for (int i = 0; i < 3; i++)
+        res.pipe_info.file_handles[i] = NULL;
+    for (int i = 0; i < 4; i++)
+        res.pipe_info.tee_handles[i] = NULL;
 
     //Prepare the eval pipe
     HANDLE write_handle, pipe_eval_rd;
@@ -312,6 +811,8 @@ struct native_run_result native_setup_proc_out(enum exec_opts_t opts,
             res.tag = NATIVE_ERR_PIPE_FAILED;
             return res;
         }
+        // Closed once every process has its own copy of the write end
+        res.pipe_info.file_handles[1] = write_handle;
     } else if (target_file) {
         SECURITY_ATTRIBUTES file_sa; 
         file_sa.nLength = sizeof(SECURITY_ATTRIBUTES); 
@@ -401,49 +902,87 @@ struct native_run_result native_setup_proc_out(enum exec_opts_t opts,
     }
     res.pipe_info.read_handle = pipe_eval_rd;
     res.pipe_info.final_process = NULL;
+    res.pipe_info.stage_count = 0;
     res.tag = NATIVE_ERR_IN_EXECUTE;
     return res;
 }
 
-// Returning pipe_fail error from execute_in_pipe
-struct native_run_result native_execute(
-    const char *executable, const char **exeargs, const char **envstrings,
-    enum exec_opts_t opts, struct native_run_result res, int index,
-    const char *source_file)
+static void close_tee(struct native_pipe_info *info)
 {
-    char cmdline[1024];
-    char env[4096];
-    char *env_ptr = env;
-    char *parent_env = GetEnvironmentStrings();
-    char *parent_env_ptr = parent_env;
+    // The original output belongs to file_handles or to the console
+    for (int i = 0; i < 3; i++) {
+        if (info->tee_handles[i])
+            CloseHandle(info->tee_handles[i]);
+        info->tee_handles[i] = NULL;
+    }
+    info->tee_handles[3] = NULL;
+}
 
-    cmdline[0] = '\0';
-    strcpy(cmdline, "\"");
-    strcat(cmdline, executable);
-    strcat(cmdline, "\" ");
+struct native_run_result native_setup_tee(struct native_run_result res, const char *tee_file)
+{
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+    sa.bInheritHandle = TRUE;
+    sa.lpSecurityDescriptor = NULL;
+
+    HANDLE tee_file_handle = CreateFile(tee_file,
+                FILE_WRITE_DATA, 0, NULL,
+                CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                NULL);
+    if (tee_file_handle == INVALID_HANDLE_VALUE) {
+        res.tag = GetLastError() == ERROR_PATH_NOT_FOUND?
+            NATIVE_ERR_FILE_NOTFOUND : NATIVE_ERR_INVALID;
+        return res;
+    }
 
-    for (int i=1; exeargs[i] != NULL && i<32; i++) {
-        strcat(cmdline, "\"");
-        strcat(cmdline, exeargs[i]);
-        strcat(cmdline, "\" ");
+    HANDLE pipe_tee_rd, pipe_tee_wr;
+    if (! CreatePipe(&pipe_tee_rd, &pipe_tee_wr, &sa, (DWORD) res.pipe_size)) {
+        CloseHandle(tee_file_handle);
+        res.tag = NATIVE_ERR_PIPE_FAILED;
+        return res;
     }
+    SetHandleInformation(pipe_tee_rd, HANDLE_FLAG_INHERIT, 0);
+
+    // The write end is closed once every process has its own copy
+    res.pipe_info.tee_handles[0] = pipe_tee_rd;
+    res.pipe_info.tee_handles[1] = pipe_tee_wr;
+    res.pipe_info.tee_handles[2] = tee_file_handle;
+    res.pipe_info.tee_handles[3] = res.pipe_info.write_handle;
+
+    // Errors merged with the output are copied as well
+    if (res.pipe_info.error_handle == res.pipe_info.write_handle)
+        res.pipe_info.error_handle = pipe_tee_wr;
+    res.pipe_info.write_handle = pipe_tee_wr;
+    return res;
+}
 
-    // Copy envstrings to env
-    for (; *envstrings; ++envstrings, ++env_ptr) {
-        for (const char *cur = *envstrings; *cur; ++cur, ++env_ptr)
-            *env_ptr = *cur;
-        *env_ptr = '\0';
+// Copies the output of the last stage to the tee file and the original output
+static enum native_err copy_tee_output(struct native_run_result *res)
+{
+    struct native_pipe_info *info = &res->pipe_info;
+    enum native_err tag = NATIVE_ERR_SUCCESS;
+    char buf[65536];
+    DWORD bytes_read, bytes_written;
+
+    while (ReadFile(info->tee_handles[0], buf, sizeof(buf), &bytes_read, NULL) &&
+            bytes_read > 0) {
+        if (!WriteFile(info->tee_handles[2], buf, bytes_read, &bytes_written, NULL) ||
+                !WriteFile(info->tee_handles[3], buf, bytes_read, &bytes_written, NULL)) {
+            tag = NATIVE_ERR_INVALID;
+            break;
+        }
     }
 
-    // Copy parent_env to env until current and next characters are both zero
-    for (; !(parent_env_ptr[0] == '\0' && parent_env_ptr[1] == '\0'); ++parent_env_ptr, ++env_ptr)
-        *env_ptr = *parent_env_ptr;
-    *env_ptr = '\0';
-    ++env_ptr;
-    *env_ptr = '\0';
+    close_tee(info);
+    return tag;
+}
 
-    FreeEnvironmentStrings(parent_env);
-    
+// Returning pipe_fail error from execute_in_pipe
+struct native_run_result native_execute(
+    const char *executable, const char **exeargs, const char **envstrings,
+    enum exec_opts_t opts, struct native_run_result res, int index,
+    const char *source_file)
+{
     //Create new startup info
     STARTUPINFO suinfo;
     memset(&suinfo, 0, sizeof(suinfo));
@@ -461,7 +1000,7 @@ struct native_run_result native_execute(
     //Set input depending on if this is/isn't the first process in the pipe
     if (index > 0) {
         HANDLE pipe_out_rd, pipe_out_wr;
-        if (! CreatePipe(&pipe_out_rd, &pipe_out_wr, &sa, 0)) {
+        if (! CreatePipe(&pipe_out_rd, &pipe_out_wr, &sa, (DWORD) res.pipe_size)) {
             CloseHandle(pipe_out_wr);
             CloseHandle(pipe_out_rd);
             res.tag = NATIVE_ERR_PIPE_FAILED;
@@ -499,11 +1038,53 @@ struct native_run_result native_execute(
     }
     suinfo.dwFlags = STARTF_USESTDHANDLES;
 
+    // The command line and the environment block share a buffer sized from
+    // the arguments; envstrings already has the parent environment in it
+    size_t cmdline_size = strlen(executable) + 4;
+    for (int i = 1; exeargs[i] != NULL; i++)
+        cmdline_size += strlen(exeargs[i]) + 3;
+
+    size_t env_size = 2;
+    for (const char **cur = envstrings; *cur; ++cur)
+        env_size += strlen(*cur) + 1;
+
+    char *cmdline = malloc(cmdline_size + env_size);
+    if (!cmdline) {
+        res.tag = NATIVE_ERR_FORKFAILED;
+        return res;
+    }
+    char *env = cmdline + cmdline_size;
+    char *env_ptr = env;
+
+    cmdline[0] = '\0';
+    strcpy(cmdline, "\"");
+    strcat(cmdline, executable);
+    strcat(cmdline, "\" ");
+
+    for (int i=1; exeargs[i] != NULL; i++) {
+        strcat(cmdline, "\"");
+        strcat(cmdline, exeargs[i]);
+        strcat(cmdline, "\" ");
+    }
+
+    // Copy envstrings to env
+    for (; *envstrings; ++envstrings, ++env_ptr) {
+        for (const char *cur = *envstrings; *cur; ++cur, ++env_ptr)
+            *env_ptr = *cur;
+        *env_ptr = '\0';
+    }
+    *env_ptr = '\0';
+    if (env_ptr == env)
+        *++env_ptr = '\0';
+
     //Create new process info
     PROCESS_INFORMATION pinfo;
     //Return whether creating process succeeds
-    if (!CreateProcess(NULL, cmdline, NULL, NULL,
-        TRUE, 0, env, NULL, &suinfo, &pinfo)) {
+    BOOL is_created = CreateProcess(NULL, cmdline, NULL, NULL,
+        TRUE, 0, env, NULL, &suinfo, &pinfo);
+    free(cmdline);
+
+    if (!is_created) {
         switch (GetLastError()) {
         case ERROR_FILE_NOT_FOUND:
             res.tag = NATIVE_ERR_NOTFOUND;
@@ -513,6 +1094,11 @@ struct native_run_result native_execute(
         }
     }
 
+    CloseHandle(pinfo.hThread);
+
+    // Handles are guaranteed to fit in 32 bits
+    res.stage_pids[res.pipe_info.stage_count++] = HandleToLong(pinfo.hProcess);
+
     // If no final process has been set, that means THIS is the final process
     if (res.pipe_info.final_process == NULL) {
         res.pipe_info.final_process = pinfo.hProcess;
@@ -522,27 +1108,97 @@ struct native_run_result native_execute(
     return res;
 }
 
+/* Waits for all the stages (if is_wait is set) and closes their handles,
+   except for the final process' one */
+static void finish_stages(struct native_run_result *res, int is_wait)
+{
+    for (int i = 0; i < res->pipe_info.stage_count; ++i) {
+        HANDLE hProcess = LongToHandle(res->stage_pids[i]);
+
+        if (is_wait) {
+            DWORD exit_code;
+
+            WaitForSingleObject(hProcess, INFINITE);
+            GetExitCodeProcess(hProcess, &exit_code);
+
+            // Stages were created from the last one to the first
+            if (res->stage_codes)
+                res->stage_codes[res->pipe_info.stage_count - 1 - i] = exit_code;
+        }
+
+        if (hProcess != res->pipe_info.final_process)
+            CloseHandle(hProcess);
+    }
+
+    res->pipe_info.stage_count = 0;
+}
+
 struct native_run_result native_execute_begin(struct native_run_result res,
     enum exec_opts_t opts)
 {
+    if (res.pipe_info.tee_handles[1]) {
+        CloseHandle(res.pipe_info.tee_handles[1]);
+        res.pipe_info.tee_handles[1] = NULL;
+    }
+
+    // Only commands that are waited for get their output copied
+    if (opts & (EXEC_OPTS_STREAM | EXEC_OPTS_BG))
+        close_tee(&res.pipe_info);
+
+    if (opts & EXEC_OPTS_STREAM) {
+        // The output is read later, through native_stream_read
+        CloseHandle(res.pipe_info.file_handles[1]);
+        res.pipe_info.file_handles[1] = NULL;
+
+        res.tag = NATIVE_ERR_STREAM_SUCCESS;
+        return res;
+    }
+
     if (!(opts & EXEC_OPTS_BG)) {
-        WaitForSingleObject(res.pipe_info.final_process, INFINITE);
         res.tag = NATIVE_ERR_SUCCESS;
         res.exit_code = 0;
 
-        //Get output from process
+        //Get output from process until all writers are gone
         if (opts & EXEC_OPTS_EVAL) {
+            size_t capacity = 0;
             DWORD bytes_read;
-            
-            ReadFile(res.pipe_info.read_handle, res.out_string, EVAL_BUFFER_SIZE, &bytes_read, NULL);
-            res.out_string[bytes_read] = 0;
+
+            CloseHandle(res.pipe_info.file_handles[1]);
+            res.pipe_info.file_handles[1] = NULL;
+
+            for (;;) {
+                if (res.out_len == capacity) {
+                    size_t new_capacity = capacity ? capacity * 2 : 4096;
+                    char *new_string = realloc(res.out_string, new_capacity);
+                    if (!new_string) {
+                        res.tag = NATIVE_ERR_INVALID;
+                        break;
+                    }
+
+                    res.out_string = new_string;
+                    capacity = new_capacity;
+                }
+
+                if (!ReadFile(res.pipe_info.read_handle, res.out_string + res.out_len,
+                        capacity - res.out_len, &bytes_read, NULL) || bytes_read == 0)
+                    break;
+
+                res.out_len += bytes_read;
+            }
             CloseHandle(res.pipe_info.read_handle);
         }
 
+        if (res.pipe_info.tee_handles[0])
+            res.tag = copy_tee_output(&res);
+
+        finish_stages(&res, 1);
+
         //Get exit code from hProcess of last process
         GetExitCodeProcess(res.pipe_info.final_process, (PDWORD) &res.exit_code);
         CloseHandle(res.pipe_info.final_process);
     } else {
+        finish_stages(&res, 0);
+        track_job(res.pid, res.pipe_info.final_process);
         res.tag = NATIVE_ERR_BACKGROUND_SUCCESS;
         return res;
     }
@@ -553,11 +1209,379 @@ struct native_run_result native_execute_begin(struct native_run_result res,
         res.pipe_info.file_handles[i] = NULL;
     }
 
-    //Close all files
-    for(int i=0; i<3; i++) {
-        CloseHandle(res.pipe_info.file_handles[i]);
+    return res;
+}
+
+/* Windows can't replace a process with another one (its _exec starts a new
+   process and exits right away, so whoever waits for us stops waiting), so the
+   command is run as the only stage of a pipe and its exit code becomes ours */
+enum native_err native_exec(const char *executable, const char **exeargs,
+    const char **envstrings, struct native_run_result res, const char *source_file)
+{
+    int stage_pid, stage_code;
+    res.stage_pids = &stage_pid;
+    res.stage_codes = &stage_code;
+
+    fflush(NULL);
+
+    res = native_execute(executable, exeargs, envstrings, EXEC_OPTS_INVALID, res, 0,
+        source_file);
+    if (res.tag == NATIVE_ERR_IN_EXECUTE)
+        res = native_execute_begin(res, EXEC_OPTS_INVALID);
+
+    if (res.tag != NATIVE_ERR_SUCCESS)
+        return res.tag;
+
+    ExitProcess((UINT) res.exit_code);
+}
+
+void native_release_output(struct native_run_result *res)
+{
+    free(res->out_string);
+    res->out_string = NULL;
+    res->out_len = 0;
+}
+
+long native_stream_read(struct native_run_result *res, char *buf, size_t len)
+{
+    DWORD bytes_read;
+
+    if (!ReadFile(res->pipe_info.read_handle, buf, len, &bytes_read, NULL)) {
+        // The write end was closed: that's the end of the output
+        if (GetLastError() == ERROR_BROKEN_PIPE)
+            return 0;
+        return -1;
+    }
+
+    return bytes_read;
+}
+
+struct native_run_result native_stream_close(struct native_run_result res, int is_wait)
+{
+    CloseHandle(res.pipe_info.read_handle);
+
+    finish_stages(&res, is_wait);
+    GetExitCodeProcess(res.pipe_info.final_process, (PDWORD) &res.exit_code);
+    CloseHandle(res.pipe_info.final_process);
+
+    for (int i = 0; i < 3; i++) {
+        if (res.pipe_info.file_handles[i])
+            CloseHandle(res.pipe_info.file_handles[i]);
         res.pipe_info.file_handles[i] = NULL;
     }
 
+    res.tag = NATIVE_ERR_SUCCESS;
     return res;
-}
\ No newline at end of file
+}
+
+#define WATCH_FILTER (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | \
+    FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE)
+
+/* Half of the wait slots are left for the background jobs */
+#define WATCH_MAX_DIRS (MAXIMUM_WAIT_OBJECTS / 2)
+
+/* Watching a file means watching its directory for changes to it only */
+struct watch_dir
+{
+    HANDLE dir;
+    OVERLAPPED ov;
+    char *path;
+    char *only_name;
+    int recursive;
+    DWORD buf[16 * 1024];
+};
+
+struct native_watch
+{
+    struct watch_dir *dirs[WATCH_MAX_DIRS];
+    DWORD num_dirs;
+    char **changed;
+    size_t num_changed;
+    size_t changed_cap;
+};
+
+struct native_watch *native_watch_open(void)
+{
+    return calloc(1, sizeof(struct native_watch));
+}
+
+static int watch_dir_read(struct watch_dir *wdir)
+{
+    ResetEvent(wdir->ov.hEvent);
+    return ReadDirectoryChangesW(wdir->dir, wdir->buf, sizeof(wdir->buf), wdir->recursive,
+        WATCH_FILTER, NULL, &wdir->ov, NULL);
+}
+
+static void free_watch_dir(struct watch_dir *wdir)
+{
+    if (wdir->dir != INVALID_HANDLE_VALUE) {
+        CancelIo(wdir->dir);
+        CloseHandle(wdir->dir);
+    }
+    if (wdir->ov.hEvent)
+        CloseHandle(wdir->ov.hEvent);
+
+    free(wdir->path);
+    free(wdir);
+}
+
+int native_watch_add(struct native_watch *watch, const char *path, int recursive)
+{
+    if (watch->num_dirs == WATCH_MAX_DIRS) {
+        errno = EMFILE;
+        return 0;
+    }
+
+    struct watch_dir *wdir = calloc(1, sizeof(struct watch_dir));
+    if (!wdir || !(wdir->path = malloc(strlen(path) + 3))) {
+        free(wdir);
+        errno = ENOMEM;
+        return 0;
+    }
+
+    // path + the separator and the name go in the same allocation
+    strcpy(wdir->path, path);
+    wdir->recursive = recursive;
+    if (!native_is_dir(path)) {
+        char *sep = strrchr(wdir->path, '\\');
+        char *slash = strrchr(wdir->path, '/');
+        if (slash > sep)
+            sep = slash;
+
+        if (sep) {
+            *sep = '\0';
+            wdir->only_name = sep + 1;
+        } else {
+            memmove(wdir->path + 2, wdir->path, strlen(wdir->path) + 1);
+            memcpy(wdir->path, ".", 2);
+            wdir->only_name = wdir->path + 2;
+        }
+        wdir->recursive = 0;
+    }
+
+    wdir->dir = CreateFile(wdir->path, FILE_LIST_DIRECTORY,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    wdir->ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (wdir->dir == INVALID_HANDLE_VALUE || !wdir->ov.hEvent || !watch_dir_read(wdir)) {
+        free_watch_dir(wdir);
+        errno = ENOENT;
+        return 0;
+    }
+
+    watch->dirs[watch->num_dirs++] = wdir;
+    return 1;
+}
+
+static int add_watch_change(struct native_watch *watch, const char *dir, const char *name)
+{
+    if (watch->num_changed == watch->changed_cap) {
+        size_t cap = watch->changed_cap * 2 + 16;
+        char **changed = realloc(watch->changed, cap * sizeof(char *));
+        if (!changed)
+            return 0;
+
+        watch->changed = changed;
+        watch->changed_cap = cap;
+    }
+
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (!path)
+        return 0;
+
+    if (*name)
+        sprintf(path, "%s\\%s", dir, name);
+    else
+        strcpy(path, dir);
+
+    watch->changed[watch->num_changed++] = path;
+    return 1;
+}
+
+static int read_watch_events(struct native_watch *watch, struct watch_dir *wdir)
+{
+    DWORD len;
+    if (!GetOverlappedResult(wdir->dir, &wdir->ov, &len, FALSE))
+        return 0;
+
+    // Nothing comes back when the buffer overflows, so anything may have changed
+    if (len == 0 && !add_watch_change(watch, wdir->path, wdir->only_name ? wdir->only_name : ""))
+        return 0;
+
+    char *p = len ? (char *) wdir->buf : NULL;
+    while (p) {
+        FILE_NOTIFY_INFORMATION *info = (FILE_NOTIFY_INFORMATION *) p;
+        char name[MAX_PATH];
+        int name_len = WideCharToMultiByte(CP_ACP, 0, info->FileName,
+            info->FileNameLength / sizeof(WCHAR), name, MAX_PATH - 1, NULL, NULL);
+        name[name_len] = '\0';
+
+        if (!wdir->only_name || _stricmp(name, wdir->only_name) == 0) {
+            if (!add_watch_change(watch, wdir->path, name))
+                return 0;
+        }
+
+        p = info->NextEntryOffset ? p + info->NextEntryOffset : NULL;
+    }
+
+    return watch_dir_read(wdir);
+}
+
+enum native_watch_result native_watch_wait(struct native_watch *watch, int timeout_ms,
+    int debounce_ms, int wake_on_jobs)
+{
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    DWORD num_handles = 0;
+
+    for (size_t i = 0; i < watch->num_changed; ++i)
+        free(watch->changed[i]);
+    watch->num_changed = 0;
+
+    for (DWORD i = 0; i < watch->num_dirs; ++i)
+        handles[num_handles++] = watch->dirs[i]->ov.hEvent;
+    if (wake_on_jobs) {
+        for (DWORD i = 0; i < num_tracked && num_handles < MAXIMUM_WAIT_OBJECTS; ++i)
+            handles[num_handles++] = tracked_handles[i];
+    }
+
+    DWORD timeout = timeout_ms < 0 ? INFINITE : (DWORD) timeout_ms;
+    while (watch->num_changed == 0) {
+        DWORD result = WaitForMultipleObjects(num_handles, handles, FALSE, timeout);
+        if (result == WAIT_TIMEOUT)
+            return NATIVE_WATCH_TIMEOUT;
+        if (result >= WAIT_OBJECT_0 + num_handles)
+            return NATIVE_WATCH_ERROR;
+
+        DWORD index = result - WAIT_OBJECT_0;
+        if (index >= watch->num_dirs)
+            return NATIVE_WATCH_JOBS;
+        if (!read_watch_events(watch, watch->dirs[index]))
+            return NATIVE_WATCH_ERROR;
+    }
+
+    // Gather the rest of the burst, like on Linux
+    double burst_end = native_clock() + debounce_ms * 10 / 1000.0;
+    while (native_clock() < burst_end) {
+        DWORD result = WaitForMultipleObjects(watch->num_dirs, handles, FALSE, debounce_ms);
+        if (result == WAIT_TIMEOUT)
+            break;
+        if (result >= WAIT_OBJECT_0 + watch->num_dirs)
+            return NATIVE_WATCH_ERROR;
+
+        if (!read_watch_events(watch, watch->dirs[result - WAIT_OBJECT_0]))
+            return NATIVE_WATCH_ERROR;
+    }
+
+    return NATIVE_WATCH_CHANGED;
+}
+
+const char *native_watch_changed(struct native_watch *watch, size_t index)
+{
+    return index < watch->num_changed ? watch->changed[index] : NULL;
+}
+
+void native_watch_close(struct native_watch *watch)
+{
+    for (DWORD i = 0; i < watch->num_dirs; ++i)
+        free_watch_dir(watch->dirs[i]);
+    for (size_t i = 0; i < watch->num_changed; ++i)
+        free(watch->changed[i]);
+
+    free(watch->changed);
+    free(watch);
+}
+
+struct native_prefetch
+{
+    HANDLE thread;
+    volatile LONG is_stopped;
+    long long bytes;
+    size_t count;
+    char **paths;  /* allocated along with the prefetch */
+};
+
+/* Windows has no readahead, so the files are read sequentially into a
+   buffer that is thrown away, which leaves them in the file cache */
+static DWORD WINAPI prefetch_thread(LPVOID arg)
+{
+    struct native_prefetch *prefetch = arg;
+    static const DWORD buf_size = 1024 * 1024;
+    char *buf = malloc(buf_size);
+    if (!buf)
+        return 1;
+
+    for (size_t i = 0; i < prefetch->count && !prefetch->is_stopped; ++i) {
+        HANDLE file = CreateFile(prefetch->paths[i], GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            continue;
+
+        DWORD bytes_read;
+        while (!prefetch->is_stopped &&
+                ReadFile(file, buf, buf_size, &bytes_read, NULL) && bytes_read > 0)
+            prefetch->bytes += bytes_read;
+
+        CloseHandle(file);
+    }
+
+    free(buf);
+    return 0;
+}
+
+struct native_prefetch *native_prefetch_start(const char **paths, size_t count)
+{
+    size_t size = sizeof(struct native_prefetch) + count * sizeof(char *);
+    for (size_t i = 0; i < count; ++i)
+        size += strlen(paths[i]) + 1;
+
+    struct native_prefetch *prefetch = calloc(1, size);
+    if (!prefetch)
+        return NULL;
+
+    prefetch->count = count;
+    prefetch->paths = (char **) (prefetch + 1);
+    char *strings = (char *) (prefetch->paths + count);
+    for (size_t i = 0; i < count; ++i) {
+        prefetch->paths[i] = strings;
+        strcpy(strings, paths[i]);
+        strings += strlen(paths[i]) + 1;
+    }
+
+    prefetch->thread = CreateThread(NULL, 0, prefetch_thread, prefetch, 0, NULL);
+    if (!prefetch->thread) {
+        free(prefetch);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return prefetch;
+}
+
+int native_prefetch_wait(struct native_prefetch *prefetch, int timeout_ms, long long *bytes)
+{
+    DWORD timeout = timeout_ms < 0 ? INFINITE : (DWORD) timeout_ms;
+    if (WaitForSingleObject(prefetch->thread, timeout) != WAIT_OBJECT_0)
+        return 0;
+
+    *bytes = prefetch->bytes;
+    return 1;
+}
+
+void native_prefetch_close(struct native_prefetch *prefetch)
+{
+    InterlockedExchange(&prefetch->is_stopped, 1);
+    WaitForSingleObject(prefetch->thread, INFINITE);
+    CloseHandle(prefetch->thread);
+    free(prefetch);
+}
+
+const char *native_which(const char *name)
+{
+    static char found[MAX_PATH];
+
+    if (SearchPath(NULL, name, ".exe", MAX_PATH, found, NULL) == 0)
+        return NULL;
+
+    return found;
+}
@@ -7,4 +7,6 @@ struct native_pipe_info
     HANDLE read_handle;
     HANDLE final_process;
     HANDLE file_handles[3];
+    HANDLE tee_handles[4];  /* tee pipe (read, write), tee file and original output */
+    int stage_count;  /* stage_pids holds their process handles, see HandleToLong */
 };
\ No newline at end of file
@@ -36,6 +36,25 @@ chdir.mk('copymovetests', function()
         end
     end)
 
+    mkdir 'tree'
+    mkdir 'tree/sub'
+    writef('tree/sub/file', 'nested text')
+    assert(copy('tree', 'tree_copy'), 'Copying a directory fails')
+    assert(readf('tree_copy/sub/file') == 'nested text', 'Directories are not copied recursively')
+    assert(copy('tree', 'tree_copy'), 'Copying into an existing directory fails')
+    assert(readf('tree_copy/tree/sub/file') == 'nested text', 'Directory not copied into existing directory')
+
+    assert(not copy('file1copy', 'file1copy'), 'Copying a file onto itself succeeds')
+    assert(readf('file1copy') == file1text, 'Copying a file onto itself truncates it')
+    assert(not copy('tree/sub/file', 'tree/sub'), 'Copying a file into its own directory succeeds')
+    assert(readf('tree/sub/file') == 'nested text', 'Copying a file into its own directory truncates it')
+    assert(not copy('tree', 'tree/sub'), 'Copying a directory into itself succeeds')
+    assert(not exists('tree/sub/tree'), 'Copying a directory into itself leaves a copy behind')
+
+    local ok, err = copy({'tree/sub/file', 'non-existent'}, 'tree_copy')
+    assert(not ok and err == 'Failed on file non-existent', 'Copying a missing file succeeds')
+    assert(readf('tree_copy/file') == 'nested text', 'Files before a failure are not copied')
+
     mkdir 'moved_files'
 
     local cur_entryinfos = entry_infos()
@@ -43,6 +62,63 @@ chdir.mk('copymovetests', function()
     for _, f in ipairs(glob('filey*')) do
         assert(not cur_entryinfos[f], 'File ' .. f .. ' was not moved')
     end
+
+    writef('many1', 'many text')
+    writef('many2', 'many text')
+    local ok, errors = move.many{
+        many1 = 'moved_files', many2 = 'many2moved', ['non-existent'] = 'moved_files'}
+    assert(not ok and errors['non-existent'], 'Moving a missing file succeeds')
+    assert(not errors.many1 and not errors.many2, 'Bulk move fails on good files')
+    assert(readf('moved_files/many1') == 'many text', 'Bulk move into directory fails')
+    assert(readf('many2moved') == 'many text' and not exists('many2'), 'Bulk move fails')
+    assert(move.many{many2moved = 'many2'} == true, 'Successful bulk move returns failures')
+
+    -- Reading in pieces
+    writef('lines', 'first line\nsecond line\nthird')
+    local pieces = {}
+    for chunk in readf.chunks('lines', 4) do
+        assert(#chunk <= 4, 'readf.chunks gives chunks that are too big')
+        pieces[#pieces + 1] = chunk
+    end
+    assert(table.concat(pieces) == readf('lines'), 'readf.chunks loses contents')
+
+    local map = assert(readf.map('lines'))
+    assert(#map == #readf('lines') and map:sub(1, 5) == 'first', 'readf.map gives wrong contents')
+    assert(map:sub(-5) == 'third' and map:find('second') == 12, 'readf.map searches wrong')
+    local lines = {}
+    for line in map:lines() do lines[#lines + 1] = line end
+    assert(#lines == 3 and lines[2] == 'second line', 'readf.map gives wrong lines')
+    map:close()
+
+    function readf.protocol_handlers.test(url) return url:sub(8) end
+    assert(readf('test://text') == 'text', 'protocol handlers are not called')
+    assert(readf.chunks('test://text', 2)() == 'te', 'protocol handlers cannot be read in chunks')
+
+    local p = prefetch{'lines', 'many*', 'non-existent'}
+    assert(p:wait() == #readf('lines'), 'prefetch reads wrong amount of data')
+    assert(prefetch('lines', {wait = true}):wait(0) == #readf('lines'),
+        "prefetch doesn't wait")
+
+    -- Writing
+    assert(writef('atomic', 'atomic text', {atomic = true}))
+    assert(readf('atomic') == 'atomic text', 'Atomic writef fails')
+    assert(#glob('atomic*') == 1, 'Atomic writef leaves temporary files behind')
+
+    assert(writef.many{many_a = 'A', many_b = 'B'}, 'writef.many fails')
+    assert(readf('many_a') == 'A' and readf('many_b') == 'B', 'writef.many writes wrong contents')
+    local ok, errors = writef.many{['no-dir/file'] = 'C'}
+    assert(not ok and errors['no-dir/file'], 'writef.many into a missing directory succeeds')
+
+    local w = assert(writer('written', {buffer = 8}))
+    w:write('line ', 1, '\n'):write('a longer line than the buffer\n')
+    w:close()
+    assert(readf('written') == 'line 1\na longer line than the buffer\n', 'writer writes wrong contents')
+
+    w = assert(writer('written', {atomic = true}))
+    w:write('replaced')
+    assert(readf('written') ~= 'replaced', 'Atomic writer replaces the file before closing')
+    w:close()
+    assert(readf('written') == 'replaced', 'Atomic writer does not replace the file')
 end)
 
 del('copymovetests')
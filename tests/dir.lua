@@ -14,3 +14,117 @@ chdir.mk('tests', function()
 end)
 
 del('tests')
+
+-- Test del on nested directories
+local cwd = current()
+for _, threads in ipairs{1, 4} do
+    chdir.mk('tests', function()
+        for i = 1, 5 do
+            chdir.mk('dir_' .. i, function()
+                mkdir 'sub'
+                writef('sub/file', 'CONTENT')
+                writef('file', 'CONTENT')
+            end)
+        end
+        writef('file', 'CONTENT')
+    end)
+
+    assert(del('tests', threads), 'del fails on nested directories')
+    assert(not exists('tests'), 'del leaves nested directories behind')
+    assert(current() == cwd, 'del changes the current directory')
+end
+assert(del('tests') == false, 'del of a missing entry succeeds')
+
+-- Test dir_iter
+chdir.mk('tests', function()
+    mkdir 'sub'
+    writef('file', 'CONTENT')
+
+    local found = {}
+    for name, type in dir_iter() do
+        found[name] = type
+    end
+    assert(found.sub == 'dir' and found.file == 'file', 'dir_iter gives wrong entries')
+    assert(not found['.'] and not found['..'], 'dir_iter lists . and ..')
+    assert(entry_infos().sub.type == 'dir', 'entry_infos gives wrong types')
+    assert(#entries() == 2, 'entries gives the wrong number of entries')
+end)
+del('tests')
+assert(not pcall(dir_iter, 'tests'), 'dir_iter on a missing directory succeeds')
+assert(#entries('tests') == 0, 'entries on a missing directory fails')
+
+-- Test walk
+chdir.mk('tests', function()
+    mkdir 'a'
+    mkdir 'a/b'
+    mkdir 'skip'
+    writef('a/b/deep', 'CONTENT')
+    writef('skip/hidden', 'CONTENT')
+    writef('top', 'CONTENT')
+
+    local found = {}
+    for path, type, depth in walk('.') do
+        found[path] = {type = type, depth = depth}
+    end
+    local sep = currentos.win and '\\' or '/'
+    local deep = table.concat({'.', 'a', 'b', 'deep'}, sep)
+    assert(found[deep] and found[deep].type == 'file' and found[deep].depth == 3,
+        'walk misses nested entries')
+    assert(found['.' .. sep .. 'top'].depth == 1, 'walk gives wrong depths')
+
+    local count = 0
+    for path in walk('.', {max_depth = 1}) do count = count + 1 end
+    assert(count == 3, 'walk ignores max_depth')
+
+    for path, type in walk('.', {types = {'file'}, prune = function(path)
+        return path:sub(-4) == 'skip'
+    end}) do
+        assert(type == 'file', 'walk ignores types')
+        assert(not path:find('hidden'), 'walk ignores prune')
+    end
+end)
+del('tests')
+
+-- Test stat
+chdir.mk('tests', function()
+    mkdir 'sub'
+    writef('file', 'CONTENT')
+
+    local info = stat('file', {'size', 'type'})
+    assert(info.size == 7 and info.type == 'file', 'stat gives wrong fields')
+    assert(info.mtime == nil, 'stat fetches fields that were not asked for')
+    assert(stat('sub').type == 'dir' and stat('sub').mtime, 'stat misses fields')
+    assert(stat('nothing') == false, 'stat finds missing entries')
+
+    local infos = stat({'file', 'nothing'}, {'size'})
+    assert(infos.file.size == 7 and infos.nothing == false, 'stat fails on lists')
+    assert(entry_infos('.', {'size'}).file.size == 7, 'entry_infos ignores fields')
+    for path, type, depth, info in walk('.', {fields = {'size'}}) do
+        assert(type ~= 'file' or info.size == 7, 'walk ignores fields')
+    end
+
+    stat.cache()
+    assert(not exists('new'), 'exists fails with the cache on')
+    writef('new', 'NEW')
+    assert(exists('new') and stat('new').size == 3, 'writef does not invalidate the cache')
+    stat.cache(false)
+end)
+del('tests')
+
+-- Test watch
+chdir.mk('tests', function()
+    mkdir 'sub'
+    local w = watch('.', {debounce = 50})
+    assert(w:wait(0.1) == nil, 'watch reports changes that did not happen')
+
+    writef('sub/file', 'CONTENT')
+    local changes = w:wait(5)
+    local sep = currentos.win and '\\' or '/'
+    local found = false
+    for _, path in ipairs(changes or {}) do
+        if path == table.concat({'.', 'sub', 'file'}, sep) then found = true end
+    end
+    assert(found, 'watch misses changes: ' .. inspect(changes))
+    w:close()
+end)
+del('tests')
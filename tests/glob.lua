@@ -56,6 +56,45 @@ chdir.mk('globtests', function()
     assert(
         #globcode2 == 4,
         'Could not match pattern code[._]: ' .. inspect(globcode2))
+
+    local globnotcode = glob('[!c]*')
+    assert(#globnotcode == 14, 'Could not match pattern [!c]*: ' .. inspect(globnotcode))
+
+    local globbraces = glob('{test1,thing*}')
+    assert(#globbraces == 5, 'Could not match pattern {test1,thing*}: ' .. inspect(globbraces))
+
+    -- Recursive patterns
+    mkdir 'sub'
+    mkdir 'sub/deeper'
+    writef('sub/deeper/deep.c', '// deep code')
+    writef('sub/shallow.c', '// shallow code')
+
+    local globdeep = glob('**/*.c')
+    assert(#globdeep == 6, 'Could not match pattern **/*.c: ' .. inspect(globdeep))
+    local globsub = glob('sub/*/*.c')
+    assert(#globsub == 1 and globsub[1] == 'sub/deeper/deep.c',
+        'Could not match pattern sub/*/*.c: ' .. inspect(globsub))
+
+    -- Compiled patterns
+    local sources = glob.compile('**/*.{c,h}')
+    assert(#sources() == 8, 'Compiled glob finds the wrong files')
+    assert(sources:matches('a/b/c.h'), 'Compiled glob does not match nested path')
+    assert(not sources:matches('a/b/c.lua'), 'Compiled glob matches wrong path')
+
+    -- Hidden files
+    mkdir '.hidden'
+    writef('.hidden/secret.c', '// hidden code')
+    writef('.dotfile', '')
+    assert(#glob('*') == 21, 'Star matches hidden files')
+    assert(#glob('**/*.c') == 6, 'Globstar goes into hidden directories')
+    assert(#glob('.*') == 2, 'Could not match hidden files with .*')
+    assert(#glob('.hidden/*.c') == 1, 'Could not glob inside a hidden directory')
+    assert(not sources:matches('.hidden/secret.c'), 'Compiled glob matches hidden path')
+
+    -- Stars don't backtrack exponentially
+    local many_a = string.rep('a', 64)
+    writef(many_a, '')
+    assert(#glob('*a*a*a*a*a*a*a*a*a*a*b') == 0, 'Could not reject a long name')
 end)
 
 del('globtests')
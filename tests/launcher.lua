@@ -0,0 +1,66 @@
+require 'apolo':as_global()
+
+-- The launcher is built next to the lib and tests directories
+local launcher = path(current(), '..', currentos.win and 'apolo.exe' or 'apolo')
+if not exists(launcher) then
+    print("Launcher wasn't built; skipping launcher tests")
+    return
+end
+
+del('launchertests')
+
+chdir.mk('launchertests', function()
+    -- Keep the cache of these scripts away from the user's one
+    local cache_dir = path(current(), 'cache')
+    local env = {XDG_CACHE_HOME = cache_dir, LOCALAPPDATA = cache_dir}
+    local function launch(script, extra_env)
+        local run_env = {}
+        for k, v in pairs(env) do run_env[k] = v end
+        for k, v in pairs(extra_env or {}) do run_env[k] = v end
+
+        local _, code = run.env(run_env){launcher, script}
+        return code
+    end
+    local function cached()
+        return glob 'cache/apolo/*.luac'
+    end
+
+    mkdir('cache')
+    writef('script.lua', 'os.exit(1)')
+    assert(launch 'script.lua' == 1, "launcher doesn't run the script")
+    assert(#cached() == 1, "launcher doesn't cache the script")
+
+    local entry = cached()[1]
+    local mtime = stat(entry).mtime
+    assert(launch 'script.lua' == 1, "launcher doesn't run the cached script")
+    assert(stat(entry).mtime == mtime, "launcher doesn't use the cached script")
+
+    -- Same size, so only the modification time tells the versions apart
+    local deadline = apolo.core.clock() + 0.05
+    while apolo.core.clock() < deadline do end
+    writef('script.lua', 'os.exit(2)')
+    assert(launch 'script.lua' == 2, "launcher runs a stale cached script")
+    assert(launch 'script.lua' == 2, "launcher doesn't cache the new script")
+
+    del('cache')
+    assert(launch('script.lua', {APOLO_NO_CACHE = 1}) == 2,
+        "launcher doesn't run scripts without the cache")
+    assert(#cached() == 0, "launcher caches scripts with APOLO_NO_CACHE")
+
+    -- Bundles carry the modules their script requires
+    writef('helper.lua', 'return {code = 40}')
+    writef('bundled.lua', [[
+        local helper = require 'helper'
+        os.exit(helper.code + tonumber(arg[1]))
+    ]])
+    local bundled = path(current(), currentos.win and 'bundled.exe' or 'bundled')
+    assert(run{launcher, '--bundle', 'bundled.lua', '-o', bundled}, "launcher doesn't bundle")
+
+    del('helper.lua')
+    chdir.mk('elsewhere', function()
+        local _, code = run{bundled, '2'}
+        assert(code == 42, "bundle doesn't run with its modules and arguments")
+    end)
+end)
+
+del('launchertests')
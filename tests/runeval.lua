@@ -11,6 +11,11 @@ assert(
 
 local luacmd = arg[-1]
 
+assert(which(luacmd), "which can't find the Lua interpreter")
+assert(which 'non-existent' == nil, "which finds non-existent commands")
+hash_clear()
+assert(which(luacmd) and run{luacmd, '-e', ''}, "Commands aren't found after hash_clear")
+
 chdir.mk('argstests', function()
     writef(
         'run-args.lua',
@@ -93,10 +98,52 @@ chdir.mk('envtests', function()
     assert(exit_code == 3)
 
     assert(run{luacmd, 'check-env.lua'})
+
+    local block = envblock{FOO = 'hello', BAR = 'hey'}
+    for i = 1, 3 do
+        local _, exit_code = run.env(block){luacmd, 'check-env.lua'}
+        assert(exit_code == 3, "envblock can't be reused")
+    end
+
+    -- Overrides take the place of the parent's variables
+    if os.getenv('HOME') then
+        local home_block = envblock{HOME = 'apolo-home'}
+        assert(eval.env(home_block){luacmd, '-e', 'io.write(os.getenv("HOME"))'}
+            == 'apolo-home')
+        assert(#home_block == #envblock{}, "envblock has duplicate variables")
+    end
 end)
 
 del('envtests')
 
+chdir.mk('exectests', function()
+    -- The script runs from here, so it has to be told where apolo is
+    local libdir = path(current(), '..')
+    local lua_env = {
+        LUA_PATH = path(libdir, '?.lua') .. ';;',
+        LUA_CPATH = path(libdir, '?.so') .. ';' .. path(libdir, '?.dll') .. ';;'}
+
+    writef(
+        'exec.lua',
+        [[
+            require 'apolo':as_global()
+            io.write('before exec ')
+            assert(not exec 'non-existent', 'exec returns on non-existent executable')
+            io.write('restored')
+            exec.env{EXEC_TEST = 'replaced'}.from('input.txt').out_to('exec-out.txt').err_to_out{
+                arg[-1], '-e',
+                'io.write(os.getenv("EXEC_TEST"), " ", io.read("a")) io.stderr:write(" err")'}
+            print(' not reached')
+        ]])
+    writef('input.txt', 'input')
+
+    assert(eval.env(lua_env){luacmd, 'exec.lua'} == 'before exec restored',
+        "exec doesn't replace the script or doesn't restore its output")
+    assert(readf('exec-out.txt') == 'replaced input err', "exec redirections don't work")
+end)
+
+del('exectests')
+
 chdir.mk('modifiertests', function()
     writef(
         'hello.lua',
@@ -114,6 +161,54 @@ end)
 
 del('modifiertests')
 
+chdir.mk('paralleltests', function()
+    writef(
+        'exit-with.lua',
+        [[
+            os.exit(tonumber(arg[1]))
+        ]])
+
+    local ok, codes, errors = run.parallel.jobs(2){
+        {luacmd, 'exit-with.lua', '0'},
+        {luacmd, 'exit-with.lua', '3'},
+        {'non-existent'},
+        luacmd .. ' exit-with.lua 0'}
+
+    assert(not ok, "run.parallel succeeds with failed commands")
+    assert(codes[1] == 0 and codes[2] == 3 and codes[4] == 0,
+        "run.parallel got the wrong exit codes: " .. inspect(codes))
+    assert(codes[3] == false and errors[3] == 'Command not found',
+        "run.parallel didn't report the command that couldn't start")
+
+    local commands = {}
+    for i = 1, 10 do
+        table.insert(commands, {luacmd, 'exit-with.lua', '0'})
+    end
+    local num_jobs = #jobs 'finished'
+    assert(run.parallel(commands), "run.parallel fails with successful commands")
+    assert(#jobs 'finished' == num_jobs, "run.parallel leaves its jobs in apolo.jobs")
+
+    writef(
+        'sleep-then-exit.lua',
+        [[
+            local finish = os.time() + tonumber(arg[1])
+            while os.time() < finish do end
+            os.exit(tonumber(arg[2]))
+        ]])
+
+    local slow = run.bg{luacmd, 'sleep-then-exit.lua', '3', '0'}
+    local fast = run.bg{luacmd, 'exit-with.lua', '5'}
+    assert(wait_any({slow, fast}) == fast, "wait_any didn't return the first job to finish")
+    assert(fast:exit_code() == 5, "wait_any lost the exit code of the job")
+    assert(#jobs('finished') >= 1, "jobs didn't see the finished job")
+
+    local proc, err = wait_any({slow}, 0.1)
+    assert(proc == nil and err == 'timeout', "wait_any didn't time out")
+    assert(wait_any({slow}) == slow and slow:exit_code() == 0)
+end)
+
+del('paralleltests')
+
 print("Your current username should be shown:")
 print(eval 'whoami')
 
@@ -144,10 +239,78 @@ chdir.mk('argstests', function()
             == "1 HELLO this is just one arg 2 and 3 these 4 are 5 other 6 args ")
     assert(eval(luacmd .. " eval-args.lua 'just one arg' and other args")
             == "1 just one arg 2 and 3 other 4 args ")
+
+    writef('count-args.lua', 'io.write(#arg)')
+    local many_args = {luacmd, 'count-args.lua'}
+    for i = 1, 1000 do
+        table.insert(many_args, 'arg' .. i)
+    end
+    table.insert(many_args, 1001)
+    assert(eval(many_args) == "1001", "Commands with many arguments don't work")
+
+    local many_vars = {}
+    for i = 1, 1000 do
+        many_vars['APOLO_TEST_VAR' .. i] = i
+    end
+    assert(eval.env(many_vars){luacmd, '-e', 'io.write(os.getenv("APOLO_TEST_VAR1000"))'}
+        == "1000", "Environments with many variables don't work")
+
+    local long_pipe = {{luacmd, '-e', 'io.write("through the pipe")'}}
+    for i = 1, 40 do
+        table.insert(long_pipe, {luacmd, '-e', 'io.write(io.read("a"))'})
+    end
+    assert(eval.pipe(table.unpack(long_pipe)) == "through the pipe",
+        "Long pipes don't work")
 end)
 
 del('argstests')
 
+chdir.mk('outputtests', function()
+    writef(
+        'big-output.lua',
+        [[
+            io.write(string.rep('apolo', 200000), '\0', 'after zero')
+        ]])
+
+    local expected = string.rep('apolo', 200000) .. '\0after zero'
+    assert(eval{luacmd, 'big-output.lua'} == expected, "eval truncated its output")
+    assert(eval.spill_at(4096){luacmd, 'big-output.lua'} == expected,
+        "eval output spilled from memory is different")
+
+    writef(
+        'lines.lua',
+        [[
+            for i = 1, 3 do
+                print('line ' .. i)
+            end
+            io.write('no newline')
+        ]])
+
+    local lines = {}
+    for line in eval.lines{luacmd, 'lines.lua'} do
+        table.insert(lines, line)
+    end
+    assert(#lines == 4 and lines[1] == 'line 1' and lines[4] == 'no newline',
+        "eval.lines got the wrong lines: " .. inspect(lines))
+
+    local piped = {}
+    for line in eval.lines.pipe({luacmd, 'lines.lua'}, 'sort -r') do
+        table.insert(piped, line)
+    end
+    assert(piped[1] == 'no newline', "eval.lines doesn't work with pipes")
+
+    local chunks = {}
+    local stream = eval.chunks(4096){luacmd, 'big-output.lua'}
+    for chunk in stream do
+        assert(#chunk <= 4096, "eval.chunks got a chunk that is too big")
+        table.insert(chunks, chunk)
+    end
+    assert(table.concat(chunks) == expected, "eval.chunks lost part of the output")
+    assert(stream:close(), "eval.chunks didn't get the exit code")
+end)
+
+del('outputtests')
+
 chdir.mk('envtests', function()
     writef(
         'check-env.lua',
@@ -229,6 +392,34 @@ chdir.mk('pipetests', function()
     assert(eval.pipe({'lua', 'seed.lua'}, {'lua', 'concat.lua'}, {'lua', 'concat.lua'}) == "Piped Piped Hello World" .. newline(), "Eval 3-level pipe")
 
     assert(run.pipe('whoami', 'lua concat.lua', {'lua', 'other_concat.lua'}, {'lua', 'concat.lua'}, 'lua other_concat.lua'), "Running longer 5-level pipe")
+
+    local ret, errstr = run.pipe('non-existent', 'lua concat.lua')
+    assert(not ret and errstr == 'Command not found', "Pipe with a missing command succeeds")
+
+    local fail_first = {luacmd, '-e', 'io.write("x") os.exit(3)'}
+    local ok, code, codes = run.pipe(fail_first, 'lua concat.lua')
+    assert(ok and code == 0, "Pipe fails without pipefail")
+    assert(codes[1] == 3 and codes[2] == 0, "Pipe got the wrong stage exit codes")
+
+    ok, code, codes = run.pipe.pipefail(fail_first, 'lua concat.lua')
+    assert(not ok and code == 3 and #codes == 2, "pipefail doesn't catch failed stages")
+    assert(run.pipe.pipefail('lua seed.lua', 'lua concat.lua'), "pipefail fails good pipes")
+
+    -- Executables in no known format are run by the shell, like execvp does
+    if not currentos.win then
+        writef('no-shebang.sh', 'exit $1')
+        assert(run 'chmod +x no-shebang.sh')
+        ok, code = run{'./no-shebang.sh', '5'}
+        assert(not ok and code == 5, "Scripts without a shebang aren't run by the shell")
+    end
+
+    -- Stages killed by signals get 128 + the signal, like in the shell
+    if not currentos.win then
+        ok, code, codes = run{'sh', '-c', 'kill -9 $$'}
+        assert(not ok and code == 137 and codes[1] == 137, "Killed command succeeds")
+        ok, code, codes = run.pipe('lua seed.lua', {'sh', '-c', 'kill -9 $$'})
+        assert(not ok and code == 137 and codes[2] == 137, "Killed last stage succeeds")
+    end
 end)
 
 del('pipetests')
@@ -278,6 +469,42 @@ chdir.mk('redirectiontests', function()
         ".append_to and .from together doesn't work in run")
     assert(readf("Output2.txt") == "Hello World!Hello World!", ".append_to and .from together doesn't work in run")
 
+    -- Test .tee
+    assert(run.tee("Teed.txt").out_to("Output4.txt"){luacmd, "write.lua"}, ".tee doesn't work in run")
+    assert(readf("Teed.txt") == "Greetings!", ".tee doesn't write to its file")
+    assert(readf("Output4.txt") == "Greetings!", ".tee doesn't write to the output")
+    assert(run.tee("Teed.txt").from("input.txt").pipe({luacmd, "read_pipe.lua"}, {luacmd, "read_write.lua"}),
+        ".tee doesn't work with pipes")
+    assert(readf("Teed.txt") == "Hello Hello World!", ".tee doesn't overwrite its file")
+    if pcall(run.tee("Teed.txt").bg, {luacmd, "write.lua"}) then
+        assert(false, ".tee with .bg succeeds")
+    end
+
+    -- Test .pipe_size
+    assert(eval.pipe_size(1024 * 1024).from("input.txt").pipe({luacmd, "read_pipe.lua"}, {luacmd, "read_write.lua"})
+        == "Hello Hello World!", ".pipe_size changes the output")
+
+    -- Test pump
+    assert(pump("input.txt", "Pumped.txt") == 6, "pump doesn't copy files")
+    assert(readf("Pumped.txt") == "World!", "pump copies the wrong data")
+    local src = assert(io.open("input.txt", "rb"))
+    local dst = assert(io.open("Pumped.txt", "ab"))
+    src:read(1)
+    assert(pump(src, dst) == 5, "pump doesn't start from the file position")
+    src:close()
+    dst:close()
+    assert(readf("Pumped.txt") == "World!orld!", "pump doesn't work with open files")
+    assert(not pump("non-existent.txt", "Pumped.txt"), "pump from a missing file succeeds")
+
+    -- What was read from a pipe into the Lua file's buffer isn't lost
+    if not currentos.win then
+        local pipe = assert(io.popen(luacmd .. ' -e "io.write(\'first\\nsecond\')"'))
+        assert(pipe:read('l') == 'first')
+        assert(pump(pipe, "Pumped.txt") == 6, "pump loses buffered input")
+        pipe:close()
+        assert(readf("Pumped.txt") == "second", "pump copies the wrong buffered input")
+    end
+
 
     -- Test .from and .out_to in a background process (add when merged in with process-management)
     --local proc = run.from("input.txt").out_to("Output4.txt").bg{luacmd, "read_write.lua")